@@ -66,10 +66,25 @@ int main (int argc, char* argv[])
 			printf("Failed to parse command line\n");
 			// Exit with error
 		}
+		else if (FAILED(state->initialize()))
+		{
+			printf("Failed to initialize NAT state\n");
+		}
 		else
 		{
+			bool bReplay;
+
+			options->getReplay(bReplay);
+
 			// execute core
-			core->executeNAT();
+			if (bReplay)
+			{
+				core->executeReplay();
+			}
+			else
+			{
+				core->executeNAT();
+			}
 			
 			// Clean up
 			delete core;
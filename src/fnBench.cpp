@@ -0,0 +1,491 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+/**
+* @file fnBench.cpp
+* @author Jeremy Beker
+* @version
+*
+* @overview Benchmark of fnCore::processPacket over synthetic flows, for every
+*			mapping and filtering method
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+namespace po = boost::program_options;
+
+#include "fnChecksum.h"
+#include "fnCore.h"
+#include "fnOptions.h"
+#include "fnState.h"
+
+#define BENCH_EXTERNAL_IP "203.0.113.1"
+#define BENCH_INTERNAL_NET 0x0A000000	///< 10.0.0.0/8, internal hosts
+#define BENCH_REMOTE_NET 0xC6120000		///< 198.18.0.0/15, remote endpoints
+#define BENCH_PAYLOAD 16
+#define BENCH_MAX_PACKET 64
+
+static const char* s_mapMethods[] = { "ind", "addr", "port" };
+static const char* s_filterMethods[] = { "ind", "addr", "port" };
+static const uint16_t s_udpPorts[] = { 53, 123, 443, 3478, 5060 };
+static const uint16_t s_tcpPorts[] = { 80, 443, 22, 993, 8080 };
+
+typedef struct _bench_config
+{
+	unsigned int	flows;
+	unsigned int	packets;	///< per flow, alternating outbound and inbound
+	unsigned int	hosts;
+	unsigned int	remotes;
+	unsigned int	weights[3];	///< UDP, TCP and ICMP share of the flows
+} bench_config;
+
+/**
+* One synthetic conversation.  Addresses and ports are in host byte order, the
+* ICMP query identifier is kept in internal_port.
+*/
+typedef struct _bench_flow
+{
+	uint8_t		protocol;
+	uint32_t	internal_ip;
+	uint16_t	internal_port;
+	uint32_t	remote_ip;
+	uint16_t	remote_port;
+	uint32_t	external_ip;	///< learned from the first translated packet
+	uint16_t	external_port;
+} bench_flow;
+
+/**
+* Counts verdicts instead of acting on them.
+*/
+class fnBenchSink : public fnPacketSink
+{
+	public:
+		fnBenchSink() : m_nAccepted(0), m_nDropped(0), m_bDropped(false) {}
+
+		virtual FN_STATUS accept(fnPacket &packet) { m_nAccepted++; m_bDropped = false; return FN_S_OK; }
+		virtual FN_STATUS drop(fnPacket &packet) { m_nDropped++; m_bDropped = true; return FN_S_OK; }
+		virtual FN_STATUS transmit(fnPacket &packet) { m_nAccepted++; m_bDropped = false; return FN_S_OK; }
+
+		uint64_t	m_nAccepted;
+		uint64_t	m_nDropped;
+		bool		m_bDropped;	///< verdict of the last packet
+};
+
+/**
+* @brief Returns a monotonic time stamp in nanoseconds
+*/
+static inline uint64_t nanoseconds()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+* @brief Stores a 16 or 32 bit value in network byte order
+*/
+static inline void put16(unsigned char *p, uint16_t value)
+{
+	p[0] = (unsigned char)(value >> 8);
+	p[1] = (unsigned char)value;
+}
+
+static inline void put32(unsigned char *p, uint32_t value)
+{
+	put16(p, (uint16_t)(value >> 16));
+	put16(p + 2, (uint16_t)value);
+}
+
+static inline uint16_t get16(const unsigned char *p)
+{
+	return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t get32(const unsigned char *p)
+{
+	return ((uint32_t)get16(p) << 16) | get16(p + 2);
+}
+
+/**
+* @brief Creates the flows, spread over the internal hosts and remote endpoints
+*/
+static void createFlows(const bench_config &config, std::vector<bench_flow> &flows)
+{
+	unsigned int total = config.weights[0] + config.weights[1] + config.weights[2];
+
+	srand(1);
+	flows.resize(config.flows);
+
+	for (unsigned int i = 0; i < config.flows; i++)
+	{
+		bench_flow &flow = flows[i];
+		unsigned int pick = (unsigned int)rand() % total;
+
+		flow.internal_ip = BENCH_INTERNAL_NET + 1 + i % config.hosts;
+		flow.internal_port = (uint16_t)(1024 + (i / config.hosts) % 64512);
+		flow.remote_ip = BENCH_REMOTE_NET + 1 + (unsigned int)rand() % config.remotes;
+		flow.external_ip = 0;
+		flow.external_port = 0;
+
+		if (pick < config.weights[0])
+		{
+			flow.protocol = PROTO_UDP;
+			flow.remote_port = s_udpPorts[rand() % (sizeof(s_udpPorts) / sizeof(s_udpPorts[0]))];
+		}
+		else if (pick < config.weights[0] + config.weights[1])
+		{
+			flow.protocol = PROTO_TCP;
+			flow.remote_port = s_tcpPorts[rand() % (sizeof(s_tcpPorts) / sizeof(s_tcpPorts[0]))];
+		}
+		else
+		{
+			flow.protocol = PROTO_ICMP;
+			flow.remote_port = 0;
+		}
+	}
+}
+
+/**
+* @brief Builds packet n of a flow, with valid checksums
+*
+* @detailed Even packets go out from the internal host, odd ones are the replies to
+*			the flow's external endpoint.  TCP flows open with SYN and SYN/ACK and close
+*			with a FIN from each side.
+*
+* @return Length of the packet
+*/
+static int buildPacket(unsigned char *pBuffer, const bench_flow &flow, unsigned int n, unsigned int nPackets)
+{
+	bool bOutbound = (n % 2) == 0;
+	unsigned char *l4 = pBuffer + 20;
+	unsigned char pseudo[12];
+	int nHeader = 8;
+	int nPayload = BENCH_PAYLOAD;
+	int nL4;
+
+	switch (flow.protocol)
+	{
+		case PROTO_UDP:
+			put16(l4, bOutbound ? flow.internal_port : flow.remote_port);
+			put16(l4 + 2, bOutbound ? flow.remote_port : flow.external_port);
+			put16(l4 + 4, (uint16_t)(nHeader + nPayload));
+			put16(l4 + 6, 0);
+			break;
+
+		case PROTO_TCP:
+		{
+			uint8_t flags = TCP_FLAG_ACK;
+
+			if (n == 0)
+			{
+				flags = TCP_FLAG_SYN;
+			}
+			else if (n == 1)
+			{
+				flags = TCP_FLAG_SYN | TCP_FLAG_ACK;
+			}
+			else if (n + 2 >= nPackets)
+			{
+				flags = TCP_FLAG_FIN | TCP_FLAG_ACK;
+			}
+
+			nHeader = 20;
+			nPayload = (flags & TCP_FLAG_SYN) ? 0 : BENCH_PAYLOAD;
+			put16(l4, bOutbound ? flow.internal_port : flow.remote_port);
+			put16(l4 + 2, bOutbound ? flow.remote_port : flow.external_port);
+			put32(l4 + 4, 1000 + n);
+			put32(l4 + 8, (flags & TCP_FLAG_ACK) ? 2000 + n : 0);
+			l4[12] = 0x50;
+			l4[13] = flags;
+			put16(l4 + 14, 65535);
+			put16(l4 + 16, 0);
+			put16(l4 + 18, 0);
+			break;
+		}
+
+		default:
+			l4[0] = bOutbound ? ICMP_TYPE_ECHO_REQUEST : ICMP_TYPE_ECHO_REPLY;
+			l4[1] = 0;
+			put16(l4 + 2, 0);
+			put16(l4 + 4, bOutbound ? flow.internal_port : flow.external_port);
+			put16(l4 + 6, (uint16_t)(n / 2));
+			break;
+	}
+
+	nL4 = nHeader + nPayload;
+	memset(l4 + nHeader, 0xA5, nPayload);
+
+	pBuffer[0] = 0x45;
+	pBuffer[1] = 0;
+	put16(pBuffer + 2, (uint16_t)(20 + nL4));
+	put16(pBuffer + 4, (uint16_t)n);
+	put16(pBuffer + 6, 0);
+	pBuffer[8] = 64;
+	pBuffer[9] = flow.protocol;
+	put16(pBuffer + 10, 0);
+	put32(pBuffer + 12, bOutbound ? flow.internal_ip : flow.remote_ip);
+	put32(pBuffer + 16, bOutbound ? flow.remote_ip : flow.external_ip);
+
+	*(uint16_t*)(pBuffer + 10) = ~fnChecksum(pBuffer, 20);
+
+	if (flow.protocol == PROTO_ICMP)
+	{
+		*(uint16_t*)(l4 + 2) = ~fnChecksum(l4, nL4);
+	}
+	else
+	{
+		memcpy(pseudo, pBuffer + 12, 8);
+		pseudo[8] = 0;
+		pseudo[9] = flow.protocol;
+		put16(pseudo + 10, (uint16_t)nL4);
+
+		*(uint16_t*)(l4 + (flow.protocol == PROTO_TCP ? 16 : 6)) = ~fnChecksum(l4, nL4, fnChecksum(pseudo, sizeof(pseudo)));
+	}
+
+	return 20 + nL4;
+}
+
+/**
+* @brief Returns if the IP and transport checksums of a translated packet are correct
+*
+* @detailed A correct checksum makes the one's complement sum of what it covers all
+*			ones.  A UDP checksum of zero was never computed and is not checked.
+*/
+static bool checksumsValid(const unsigned char *pBuffer)
+{
+	const unsigned char *l4 = pBuffer + 20;
+	int nL4 = get16(pBuffer + 2) - 20;
+	unsigned char pseudo[12];
+
+	if (fnChecksum(pBuffer, 20) != 0xFFFF)
+	{
+		return false;
+	}
+
+	if (pBuffer[9] == PROTO_ICMP)
+	{
+		return fnChecksum(l4, nL4) == 0xFFFF;
+	}
+
+	if (pBuffer[9] == PROTO_UDP && get16(l4 + 6) == 0)
+	{
+		return true;
+	}
+
+	memcpy(pseudo, pBuffer + 12, 8);
+	pseudo[8] = 0;
+	pseudo[9] = pBuffer[9];
+	put16(pseudo + 10, (uint16_t)nL4);
+
+	return fnChecksum(l4, nL4, fnChecksum(pseudo, sizeof(pseudo))) == 0xFFFF;
+}
+
+/**
+* @brief Configures fnOptions and a fresh fnState for one method combination
+*/
+static FN_STATUS setup(const bench_config &config, const char *pMapMethod, const char *pFilterMethod)
+{
+	char maxMaps[16];
+	const char *args[] =
+	{
+		"bench", "--external_ip", BENCH_EXTERNAL_IP,
+		"--map_method", pMapMethod, "--filter_method", pFilterMethod,
+		"--port_assign", "pres", "--map_lifetime", "600", "--verbose", "0",
+		"--max_maps", maxMaps,
+	};
+
+	snprintf(maxMaps, sizeof(maxMaps), "%u", config.flows + 1024);
+
+	if (FAILED(fnOptions::getInstance()->initialize(sizeof(args) / sizeof(args[0]), (char**)args)))
+	{
+		return FN_E_FAIL;
+	}
+
+	return fnState::getInstance()->initialize();
+}
+
+/**
+* @brief Runs every flow through processPacket and prints one result line
+*
+* @detailed The checksums of every packet that is let through are verified after
+*			it has been timed.
+*
+* @return Number of packets dropped or let through with a wrong checksum
+*/
+static uint64_t runCombination(const bench_config &config, std::vector<bench_flow> &flows,
+	const char *pMapMethod, const char *pFilterMethod)
+{
+	fnCore *pCore = fnCore::getInstance();
+	fnBenchSink sink;
+	std::vector<uint32_t> samples;
+	uint64_t nTotal = 0;
+	uint64_t nCreate = 0;
+	uint64_t nBadChecksums = 0;
+	unsigned char buffer[BENCH_MAX_PACKET] __attribute__((aligned(8)));
+	uint32_t nID = 0;
+
+	samples.reserve((size_t)config.flows * config.packets);
+
+	// packet n of every flow before packet n + 1 of any, so the tables are as large as they get
+	for (unsigned int n = 0; n < config.packets; n++)
+	{
+		for (unsigned int i = 0; i < config.flows; i++)
+		{
+			bench_flow &flow = flows[i];
+			int nLength = buildPacket(buffer, flow, n, config.packets);
+			fnPacket packet(buffer, nLength,
+				(n % 2) ? FN_REPLAY_EXTERNAL_IFINDEX : FN_REPLAY_INTERNAL_IFINDEX, ++nID);
+			uint64_t start = nanoseconds();
+			uint64_t elapsed;
+
+			pCore->processPacket(packet, sink, NULL);
+
+			elapsed = nanoseconds() - start;
+			samples.push_back((uint32_t)elapsed);
+			nTotal += elapsed;
+
+			if (!sink.m_bDropped && !checksumsValid(buffer))
+			{
+				nBadChecksums++;
+			}
+
+			if (n == 0)
+			{
+				nCreate += elapsed;
+
+				// the reply goes to wherever the NAT mapped the flow
+				flow.external_ip = get32(buffer + 12);
+				flow.external_port = get16(buffer + (flow.protocol == PROTO_ICMP ? 24 : 20));
+			}
+		}
+	}
+
+	std::sort(samples.begin(), samples.end());
+
+	printf("%-6s %-6s %12.0f %8u %8u %8u %8u %9u %12.0f %8llu %9llu\n",
+		pMapMethod, pFilterMethod,
+		nTotal ? samples.size() * 1e9 / nTotal : 0.0,
+		samples[samples.size() / 2],
+		samples[samples.size() * 90 / 100],
+		samples[samples.size() * 99 / 100],
+		samples[samples.size() * 999 / 1000],
+		samples.back(),
+		nCreate ? config.flows * 1e9 / nCreate : 0.0,
+		(unsigned long long)sink.m_nDropped,
+		(unsigned long long)nBadChecksums);
+
+	return sink.m_nDropped + nBadChecksums;
+}
+
+/**
+* @brief Benchmark entry point
+*
+* @detailed Generates the flows once, then for each mapping and filtering method
+*			replays them through a fresh fnState and prints packets/s, the
+*			distribution of the time spent per packet and the rate maps are created at.
+*			Times include the cost of reading the clock around each packet.
+*/
+int main(int argc, char* argv[])
+{
+	bench_config config;
+	std::vector<bench_flow> flows;
+	int ret = 0;
+
+	po::options_description opts("Benchmark");
+	opts.add_options()
+		("help", "This help")
+		("flows", po::value<unsigned int>(&config.flows)->default_value(50000), "Number of flows")
+		("packets", po::value<unsigned int>(&config.packets)->default_value(10), "Packets per flow, at least 2")
+		("hosts", po::value<unsigned int>(&config.hosts)->default_value(1000), "Internal hosts the flows come from")
+		("remotes", po::value<unsigned int>(&config.remotes)->default_value(10000), "Remote addresses the flows go to")
+		("udp", po::value<unsigned int>(&config.weights[0])->default_value(60), "Share of UDP flows")
+		("tcp", po::value<unsigned int>(&config.weights[1])->default_value(30), "Share of TCP flows")
+		("icmp", po::value<unsigned int>(&config.weights[2])->default_value(10), "Share of ICMP echo flows")
+		;
+
+	try
+	{
+		po::variables_map vm;
+		po::store(po::parse_command_line(argc, argv, opts), vm);
+		po::notify(vm);
+
+		if (vm.count("help"))
+		{
+			std::cout << opts << "\n";
+			return 0;
+		}
+	}
+	catch (std::exception &e)
+	{
+		printf("%s\n", e.what());
+		return 1;
+	}
+
+	if (config.flows == 0 || config.packets < 2 || config.hosts == 0 || config.remotes == 0 ||
+		config.weights[0] + config.weights[1] + config.weights[2] == 0)
+	{
+		printf("flows, hosts, remotes and the protocol shares must not be 0, packets at least 2\n");
+		return 1;
+	}
+
+	printf("%u flows x %u packets, %u hosts, %u remotes, udp/tcp/icmp %u/%u/%u\n",
+		config.flows, config.packets, config.hosts, config.remotes,
+		config.weights[0], config.weights[1], config.weights[2]);
+	printf("%-6s %-6s %12s %8s %8s %8s %8s %9s %12s %8s %9s\n",
+		"map", "filter", "packets/s", "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns", "new maps/s", "dropped", "bad csum");
+
+	for (unsigned int m = 0; m < sizeof(s_mapMethods) / sizeof(s_mapMethods[0]); m++)
+	{
+		for (unsigned int f = 0; f < sizeof(s_filterMethods) / sizeof(s_filterMethods[0]); f++)
+		{
+			createFlows(config, flows);
+
+			if (FAILED(setup(config, s_mapMethods[m], s_filterMethods[f])))
+			{
+				printf("can't configure %s/%s\n", s_mapMethods[m], s_filterMethods[f]);
+				return 1;
+			}
+
+			// every reply answers a flow the NAT just saw, none should be dropped or corrupted
+			if (runCombination(config, flows, s_mapMethods[m], s_filterMethods[f]) != 0)
+			{
+				ret = 1;
+			}
+
+			delete fnState::getInstance();
+		}
+	}
+
+	return ret;
+}
@@ -0,0 +1,265 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+/**
+* @file fnChecksum.cpp
+* @author Jeremy Beker
+* @version
+*
+* @overview Full Internet checksum kernels, picked at run time for the CPU
+*/
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FN_CHECKSUM_X86
+#endif
+
+#include "fnChecksum.h"
+
+/**
+* @brief Folds a 64 bit one's complement accumulator into 16 bits
+*/
+static inline uint16_t fold64(uint64_t sum)
+{
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+
+	return fnChecksumFold((uint32_t)sum);
+}
+
+/**
+* @brief Adds up to 7 trailing bytes, zero padded to a whole 64 bit word
+*/
+static inline uint64_t addTail(uint64_t sum, const unsigned char *p, unsigned int nLength)
+{
+	uint64_t word = 0;
+
+	memcpy(&word, p, nLength);
+	sum += word;
+
+	return sum + (sum < word);
+}
+
+/**
+* @brief Portable kernel, one 64 bit word per step with an end-around carry
+*
+* @param pData [IN] Data to be summed, starting on a 16 bit word of the checksummed region
+* @param nLength [IN] Length in bytes, a trailing odd byte is padded with zero
+* @param sum [IN] Sum to continue from, e.g. of a pseudo header
+*
+* @return One's complement sum of the data, not yet complemented
+*/
+static uint16_t checksumScalar(const void *pData, unsigned int nLength, uint32_t sum)
+{
+	const unsigned char *p = (const unsigned char*)pData;
+	uint64_t acc = sum;
+
+	while (nLength >= 32)
+	{
+		uint64_t w[4];
+
+		memcpy(w, p, sizeof(w));
+
+		acc += w[0];
+		acc += (acc < w[0]);
+		acc += w[1];
+		acc += (acc < w[1]);
+		acc += w[2];
+		acc += (acc < w[2]);
+		acc += w[3];
+		acc += (acc < w[3]);
+
+		p += 32;
+		nLength -= 32;
+	}
+
+	while (nLength >= 8)
+	{
+		uint64_t w;
+
+		memcpy(&w, p, sizeof(w));
+		acc += w;
+		acc += (acc < w);
+
+		p += 8;
+		nLength -= 8;
+	}
+
+	return fold64(addTail(acc, p, nLength));
+}
+
+#ifdef FN_CHECKSUM_X86
+
+/**
+* @brief SSE2 kernel, widens 32 bit words into 64 bit lanes so no carry is ever lost
+*/
+__attribute__((target("sse2")))
+static uint16_t checksumSSE2(const void *pData, unsigned int nLength, uint32_t sum)
+{
+	const unsigned char *p = (const unsigned char*)pData;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc0 = _mm_setzero_si128();
+	__m128i acc1 = _mm_setzero_si128();
+	uint64_t lanes[2];
+	uint64_t acc;
+
+	while (nLength >= 32)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*)p);
+		__m128i b = _mm_loadu_si128((const __m128i*)(p + 16));
+
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(b, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(b, zero));
+
+		p += 32;
+		nLength -= 32;
+	}
+
+	_mm_storeu_si128((__m128i*)lanes, _mm_add_epi64(acc0, acc1));
+
+	// each lane is far from overflowing, so plain adds are safe here
+	acc = (uint64_t)sum + lanes[0] + lanes[1];
+
+	return checksumScalar(p, nLength, fold64(acc));
+}
+
+/**
+* @brief AVX2 kernel, the SSE2 scheme over 256 bit registers
+*/
+__attribute__((target("avx2")))
+static uint16_t checksumAVX2(const void *pData, unsigned int nLength, uint32_t sum)
+{
+	const unsigned char *p = (const unsigned char*)pData;
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = _mm256_setzero_si256();
+	__m256i acc1 = _mm256_setzero_si256();
+	uint64_t lanes[4];
+	uint64_t acc;
+
+	while (nLength >= 64)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i*)p);
+		__m256i b = _mm256_loadu_si256((const __m256i*)(p + 32));
+
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(b, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(b, zero));
+
+		p += 64;
+		nLength -= 64;
+	}
+
+	_mm256_storeu_si256((__m256i*)lanes, _mm256_add_epi64(acc0, acc1));
+
+	acc = (uint64_t)sum + lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+	return checksumScalar(p, nLength, fold64(acc));
+}
+
+#endif
+
+/**
+* @brief Lists the kernels usable on this CPU
+*
+* @param pKernels [OUT] Array to fill in, slowest kernel first
+* @param nMax [IN] Size of the array
+*
+* @return Number of kernels filled in
+*/
+unsigned int fnChecksumKernels(checksum_kernel *pKernels, unsigned int nMax)
+{
+	checksum_kernel all[3];
+	unsigned int count = 0;
+
+	all[count].name = "scalar";
+	all[count].fn = checksumScalar;
+	count++;
+
+#ifdef FN_CHECKSUM_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse2"))
+	{
+		all[count].name = "sse2";
+		all[count].fn = checksumSSE2;
+		count++;
+	}
+
+	if (__builtin_cpu_supports("avx2"))
+	{
+		all[count].name = "avx2";
+		all[count].fn = checksumAVX2;
+		count++;
+	}
+#endif
+
+	if (count > nMax)
+	{
+		count = nMax;
+	}
+
+	memcpy(pKernels, all, count * sizeof(checksum_kernel));
+
+	return count;
+}
+
+static uint16_t checksumResolve(const void *pData, unsigned int nLength, uint32_t sum);
+
+static checksum_fn s_pChecksum = checksumResolve; ///< Kernel in use, picked on first call
+
+/**
+* @brief Picks the fastest kernel for the CPU, then forwards the call to it
+*/
+static uint16_t checksumResolve(const void *pData, unsigned int nLength, uint32_t sum)
+{
+	checksum_kernel kernels[3];
+	unsigned int count = fnChecksumKernels(kernels, 3);
+	checksum_fn fn = kernels[count - 1].fn;
+
+	__atomic_store_n(&s_pChecksum, fn, __ATOMIC_RELAXED);
+
+	return fn(pData, nLength, sum);
+}
+
+/**
+* @brief Computes the one's complement sum of a region
+*
+* @detailed The result is not complemented, so sums of several regions can be
+*			chained through the sum parameter before the final complement.
+*
+* @param pData [IN] Data to be summed
+* @param nLength [IN] Length in bytes, a trailing odd byte is padded with zero, so only
+*			the last region of a chain may have an odd length
+* @param sum [IN] Sum to continue from, e.g. of a pseudo header
+*
+* @return One's complement sum in network byte order
+*/
+uint16_t fnChecksum(const void *pData, unsigned int nLength, uint32_t sum)
+{
+	return __atomic_load_n(&s_pChecksum, __ATOMIC_RELAXED)(pData, nLength, sum);
+}
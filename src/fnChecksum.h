@@ -0,0 +1,96 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#ifndef FN_FNCHECKSUM_H // one-time include
+#define FN_FNCHECKSUM_H
+
+#include <stdint.h>
+
+/**
+* Internet checksum helpers.  The one's complement sum does not depend on byte
+* order, so every value here is taken exactly as it sits in the packet (network
+* byte order) and no conversion is needed.
+*/
+
+typedef uint16_t (*checksum_fn)(const void *pData, unsigned int nLength, uint32_t sum);
+
+typedef struct _checksum_kernel
+{
+	const char*	name;
+	checksum_fn	fn;
+} checksum_kernel;
+
+uint16_t fnChecksum(const void *pData, unsigned int nLength, uint32_t sum = 0);
+unsigned int fnChecksumKernels(checksum_kernel *pKernels, unsigned int nMax);
+
+/**
+* @brief Folds a 32 bit accumulator of 16 bit words into a 16 bit one's complement sum
+*/
+inline uint16_t fnChecksumFold(uint32_t sum)
+{
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+
+	return (uint16_t)sum;
+}
+
+/**
+* @brief Updates a checksum for one changed 16 bit word (RFC 1624, eqn. 3)
+*
+* @param check [IN] Checksum field as found in the packet
+* @param old_word [IN] Word before the change
+* @param new_word [IN] Word after the change
+*
+* @return New value for the checksum field
+*/
+inline uint16_t fnChecksumAdjust16(uint16_t check, uint16_t old_word, uint16_t new_word)
+{
+	uint32_t sum = (uint16_t)~check;
+
+	sum += (uint16_t)~old_word;
+	sum += new_word;
+
+	return (uint16_t)~fnChecksumFold(sum);
+}
+
+/**
+* @brief Updates a checksum for a changed 32 bit field, e.g. an IP address
+*
+* @param check [IN] Checksum field as found in the packet
+* @param old_value [IN] Field before the change
+* @param new_value [IN] Field after the change
+*
+* @return New value for the checksum field
+*/
+inline uint16_t fnChecksumAdjust32(uint16_t check, uint32_t old_value, uint32_t new_value)
+{
+	uint32_t sum = (uint16_t)~check;
+
+	sum += (uint16_t)~old_value;
+	sum += (uint16_t)~(old_value >> 16);
+	sum += (uint16_t)new_value;
+	sum += (uint16_t)(new_value >> 16);
+
+	return (uint16_t)~fnChecksumFold(sum);
+}
+
+#endif
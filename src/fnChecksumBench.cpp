@@ -0,0 +1,131 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+/**
+* @file fnChecksumBench.cpp
+* @author Jeremy Beker
+* @version
+*
+* @overview Microbenchmark of the checksum kernels over a range of payload sizes
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fnChecksum.h"
+
+#define BENCH_BYTES (256 * 1024 * 1024)	///< bytes summed per kernel and size
+#define BENCH_MAX_KERNELS 8
+
+static const unsigned int s_sizes[] = { 20, 40, 64, 128, 256, 576, 1024, 1500, 4096, 9000, 65535 };
+
+/**
+* @brief Returns a monotonic time stamp in nanoseconds
+*/
+static double nanoseconds()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+* @brief Checksum benchmark entry point
+*
+* @detailed Checks that every kernel agrees with the scalar one on each size and
+*			alignment, then prints the time per call and throughput of each kernel.
+*/
+int main(int argc, char* argv[])
+{
+	checksum_kernel kernels[BENCH_MAX_KERNELS];
+	unsigned int nKernels = fnChecksumKernels(kernels, BENCH_MAX_KERNELS);
+	unsigned char *pBuffer = new unsigned char[65536 + 64];
+	volatile uint16_t sink = 0;
+	int ret = 0;
+
+	srand(1);
+
+	for (unsigned int i = 0; i < 65536 + 64; i++)
+	{
+		pBuffer[i] = (unsigned char)rand();
+	}
+
+	// every kernel must agree with the scalar one, including odd lengths and offsets
+	for (unsigned int len = 0; len <= 2048; len++)
+	{
+		for (unsigned int offset = 0; offset < 8; offset++)
+		{
+			uint16_t expected = kernels[0].fn(pBuffer + offset, len, 0x1234);
+
+			for (unsigned int k = 1; k < nKernels; k++)
+			{
+				if (kernels[k].fn(pBuffer + offset, len, 0x1234) != expected)
+				{
+					printf("%s disagrees with %s at length %u offset %u\n", kernels[k].name, kernels[0].name, len, offset);
+					ret = 1;
+				}
+			}
+		}
+	}
+
+	printf("%8s", "bytes");
+
+	for (unsigned int k = 0; k < nKernels; k++)
+	{
+		printf("  %10s ns  %6s GB/s", kernels[k].name, "");
+	}
+
+	printf("\n");
+
+	for (unsigned int s = 0; s < sizeof(s_sizes) / sizeof(s_sizes[0]); s++)
+	{
+		unsigned int size = s_sizes[s];
+		unsigned int iterations = BENCH_BYTES / size;
+
+		printf("%8u", size);
+
+		for (unsigned int k = 0; k < nKernels; k++)
+		{
+			double start = nanoseconds();
+			double elapsed;
+
+			for (unsigned int i = 0; i < iterations; i++)
+			{
+				sink += kernels[k].fn(pBuffer, size, i);
+			}
+
+			elapsed = nanoseconds() - start;
+
+			printf("  %13.1f ns  %11.2f", elapsed / iterations, (double)iterations * size / elapsed);
+		}
+
+		printf("\n");
+	}
+
+	delete [] pBuffer;
+
+	return ret;
+}
@@ -0,0 +1,51 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+
+#ifndef FN_FNCLOCK_H // one-time include
+#define FN_FNCLOCK_H
+
+#include <time.h>
+
+/**
+* Time base of the map lifetimes.  Live sources run on the wall clock, offline
+* sources on the time stamps of the packets they replay.
+*/
+class fnClock
+{
+	public:
+		virtual ~fnClock() {}
+
+		/// Current time in seconds
+		virtual time_t now() = 0;
+};
+
+/**
+* The system's wall clock
+*/
+class fnWallClock : public fnClock
+{
+	public:
+		virtual time_t now() { return time(NULL); }
+};
+
+#endif
@@ -30,10 +30,25 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <vector>
 
 #include "structures.h"
 #include "fnCore.h"
+#include "fnLinkMonitor.h"
+#include "fnNfqueue.h"
+#include "fnPcapReplay.h"
+#include "fnLog.h"
+#include "fnTrace.h"
 #include "fnOptions.h"
 #include "fnState.h"
 
@@ -78,22 +93,104 @@ fnCore* fnCore::getInstance()
 }
 
 /**
-* @brief Packet handler callback
-* 
-* @detailed Callback function for received packets.  Immediately passes packet 
-* to fnCore::processPacket
+* @brief Records a packet's current addresses and ports in a trace ring
 * 
-* @param qh [IN] Netfilter handle
-* @param nfmsg [IN]
-* @param nfa [IN] packet data
-* @param data [IN] unused
+* @param pTrace [IN] Ring of the queue thread
+* @param type [IN] TRACE_EVENT_PACKET before any rewriting, TRACE_EVENT_MAP after
+* @param packet [IN] Packet
+* @param ifindex [IN] Interface the packet came in on or leaves through
+*/
+static void tracePacket(fnTraceRing *pTrace, TRACE_EVENT_TYPE type, const fnPacket &packet, uint32_t ifindex)
+{
+	trace_event event;
+	tcp_packet_tuple tcp;
+	icmp_packet_tuple icmp;
+	
+	memset(&event, 0, sizeof(event));
+	event.time = fnTrace::now();
+	event.packet = packet.getNetfilterID();
+	event.type = type;
+	event.protocol = packet.getProtocol();
+	event.ifindex = ifindex;
+	event.tuple.src_ip = packet.getSourceIP();
+	event.tuple.dest_ip = packet.getDestinationIP();
+	
+	switch (event.protocol)
+	{
+		case PROTO_UDP:
+			packet.getPacketTuple(event.tuple);
+			break;
+			
+		case PROTO_TCP:
+			packet.getPacketTuple(tcp);
+			event.tuple.src_port = tcp.src_port;
+			event.tuple.dest_port = tcp.dest_port;
+			break;
+			
+		case PROTO_ICMP:
+			packet.getPacketTuple(icmp);
+			event.tuple.src_port = icmp.id;
+			break;
+			
+		default:
+			break;
+	}
+	
+	pTrace->push(event);
+}
+
+/**
+* @brief Records a state machine step or a verdict in a trace ring
 * 
+* @param pTrace [IN] Ring of the queue thread
+* @param type [IN] TRACE_EVENT_STATE or TRACE_EVENT_VERDICT
+* @param packet [IN] Packet
+* @param value [IN] State or verdict
 */
-static int packet_callback(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg,
-	      struct nfq_data *nfa, void *data)
+static void traceValue(fnTraceRing *pTrace, TRACE_EVENT_TYPE type, const fnPacket &packet, uint8_t value)
 {
-	fnCore* core = fnCore::getInstance();
-	return core->processPacket(qh,nfmsg,nfa,data);
+	trace_event event;
+	
+	memset(&event, 0, sizeof(event));
+	event.time = fnTrace::now();
+	event.packet = packet.getNetfilterID();
+	event.type = type;
+	event.value = value;
+	
+	pTrace->push(event);
+}
+
+/**
+* @brief Returns the name of a state machine state, for traces
+*/
+const char* fnCore::getStateName(CORE_PCL_STATES state)
+{
+	static const char *s_names[] =
+	{
+		"DETERMINE_DIRECTION",
+		"INTERNAL_PACKET_RECEIVED",
+		"EXTERNAL_PACKET_RECEIVED",
+		"FIND_OUTBOUND_MAP",
+		"FIND_INBOUND_MAP",
+		"CREATE_NEW_MAP_UDP",
+		"TRANSFORM_OUTBOUND_ICMP",
+		"TRANSFORM_OUTBOUND_UDP",
+		"TRANSFORM_OUTBOUND_TCP",
+		"TRANSFORM_INBOUND_ICMP",
+		"TRANSFORM_INBOUND_ICMP_ERROR",
+		"TRANSFORM_INBOUND_UDP",
+		"TRANSFORM_INBOUND_TCP",
+		"UPDATE_MAP",
+		"VERIFY_DESTINATION",
+		"SEND_PACKET",
+		"DROP_PACKET",
+		"DONE",
+		"ERROR",
+	};
+	
+	static_assert(sizeof(s_names) / sizeof(s_names[0]) == PCL_ERROR + 1, "a state has no name");
+	
+	return ((unsigned int)state <= PCL_ERROR) ? s_names[state] : "?";
 }
 
 /**
@@ -102,57 +199,69 @@ static int packet_callback(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg,
 * @detailed Main program logic for packet handling.  Implements a process control
 * loop which manages the identification and transformation of all packets
 * 
-* @param qh [IN] Netfilter handle
-* @param nfmsg [IN]
-* @param nfa [IN] packet data
-* @param data [IN] unused
+* @param packet [IN] Packet to be translated, rewritten in place
+* @param sink [IN] Receives the verdict
+* @param pTrace [IN] Trace ring of the calling thread, NULL when not tracing
 * 
+* @return Status of the verdict
 */
-int fnCore::processPacket(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struct nfq_data *nfa, void *data)
+FN_STATUS fnCore::processPacket(fnPacket &packet, fnPacketSink &sink, fnTraceRing *pTrace)
 {
 	CORE_PCL_STATES state = PCL_DETERMINE_DIRECTION;
 	bool bProcessing = true;
-	int ret;
-	fnPacket packet(nfa);
+	FN_STATUS ret = FN_S_OK;
 	fnOptions *pOptions = fnOptions::getInstance();
 	fnState *pState = fnState::getInstance();
-	nat_map_entry MapEntry;
+	nat_map_view MapView;
 
 
-	printf("--------------- NEW PACKET ----------------------------------\n");
+	FN_DEBUG("--------------- NEW PACKET ----------------------------------\n");
+	
+	if (pTrace != NULL)
+	{
+		tracePacket(pTrace, TRACE_EVENT_PACKET, packet, packet.getInboundIfIndex());
+	}
 
 	while (bProcessing)
 	{
+		if (pTrace != NULL)
+		{
+			traceValue(pTrace, TRACE_EVENT_STATE, packet, state);
+		}
+		
 		switch (state)
 		{
 			case PCL_DETERMINE_DIRECTION:
 			{
-				std::string strExternalInterface;
-				std::string strInternalInterface;
-				std::string strPacketReceivedInterface;
+				uint32_t nExternalIfIndex;
+				uint32_t nInternalIfIndex;
+				uint32_t nPacketReceivedIfIndex;
 				
-				pOptions->getExternalInterface(strExternalInterface);
-				pOptions->getInternalInterface(strInternalInterface);
-				packet.getInboundInterface(strPacketReceivedInterface);
+				pOptions->getExternalIfIndex(nExternalIfIndex);
+				pOptions->getInternalIfIndex(nInternalIfIndex);
+				nPacketReceivedIfIndex = packet.getInboundIfIndex();
 				
 				
-				if (strPacketReceivedInterface == strExternalInterface)
+				if (nPacketReceivedIfIndex == nExternalIfIndex)
 				{
-					printf("** Packet received on external interface\n");
+					FN_DEBUG("** Packet received on external interface\n");
 					state = PCL_FIND_INBOUND_MAP;
 				}
-				else if (strPacketReceivedInterface == strInternalInterface)
+				else if (nPacketReceivedIfIndex == nInternalIfIndex)
 				{
-					printf("** Packet received on internal interface\n");
+					FN_DEBUG("** Packet received on internal interface\n");
 					state = PCL_FIND_OUTBOUND_MAP;
 				}
 				else
 				{
-					printf("** Packet received from unknown interface %s\n",strPacketReceivedInterface.c_str());
+					FN_DEBUG("** Packet received from unknown interface %u\n",nPacketReceivedIfIndex);
 					state = PCL_ERROR;
 				}
 
-				packet.dump();
+				if (FN_LOG_ENABLED(FN_LOG_TRACE))
+				{
+					packet.dump();
+				}
 
 			}
 			break;
@@ -161,12 +270,63 @@ int fnCore::processPacket(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struc
 			
 			case PCL_FIND_OUTBOUND_MAP:	// Looks up map to transform packet on way out
 			{
-				printf("** Process outbound packet\n");
+				FN_DEBUG("** Process outbound packet\n");
 				
 				switch (packet.getProtocol())
 				{
 					case PROTO_ICMP:
-						state = PCL_TRANSFORM_OUTBOUND_ICMP;
+						{
+							FN_STATUS ret;
+							icmp_packet_tuple tuple;
+
+							if (!packet.isICMPQuery())
+							{
+								FN_DEBUG(" * ICMP type %d is not translated\n",packet.getICMPType());
+								state = PCL_DROP_PACKET;
+								break;
+							}
+
+							if (FAILED(packet.getPacketTuple(tuple)))
+							{
+								FN_DEBUG(" * Truncated packet\n");
+								state = PCL_DROP_PACKET;
+								break;
+							}
+
+							ret = pState->getOutBoundMap(tuple,MapView);
+					
+							if (SUCCEEDED(ret))
+							{
+								FN_DEBUG(" * Found existing NAT map entry \n");
+								state = PCL_TRANSFORM_OUTBOUND_ICMP;
+							}
+							else if (ret == FN_E_NO_MAP_FOUND)
+							{
+								ret = pState->createOutBoundMap(packet,MapView);
+								
+								if (SUCCEEDED(ret))
+								{
+									FN_DEBUG(" * Created new NAT map entry \n");
+
+									state = PCL_TRANSFORM_OUTBOUND_ICMP;
+								}
+								else if (ret == FN_E_NO_MAP_FOUND)
+								{
+									FN_DEBUG(" * Not a query request\n");
+									state = PCL_DROP_PACKET;
+								}
+								else
+								{
+									FN_WARN(" * Couldn't create map\n");
+									state = PCL_ERROR;
+								}
+							}
+							else
+							{
+								FN_WARN(" * Couldn't find or create map\n");
+								state = PCL_ERROR;
+							}
+						}
 						break;
 					
 					case PROTO_UDP:
@@ -174,34 +334,39 @@ int fnCore::processPacket(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struc
 							FN_STATUS ret;
 							udp_packet_tuple tuple;
 
-							packet.getPacketTuple(tuple);
+							if (FAILED(packet.getPacketTuple(tuple)))
+							{
+								FN_DEBUG(" * Truncated packet\n");
+								state = PCL_DROP_PACKET;
+								break;
+							}
 
-							ret = pState->getOutBoundMap(tuple,MapEntry);
+							ret = pState->getOutBoundMap(tuple,MapView);
 					
 							if (SUCCEEDED(ret))
 							{
-								printf(" * Found existing NAT map entry \n");
+								FN_DEBUG(" * Found existing NAT map entry \n");
 								state = PCL_TRANSFORM_OUTBOUND_UDP;
 							}
 							else if (ret == FN_E_NO_MAP_FOUND)
 							{
-								ret = pState->createOutBoundMap(packet,MapEntry);
+								ret = pState->createOutBoundMap(packet,MapView);
 								
 								if (SUCCEEDED(ret))
 								{
-									printf(" * Created new NAT map entry \n");
+									FN_DEBUG(" * Created new NAT map entry \n");
 
 									state = PCL_TRANSFORM_OUTBOUND_UDP;
 								}
 								else
 								{
-									printf(" * Couldn't create map\n");
+									FN_WARN(" * Couldn't create map\n");
 									state = PCL_ERROR;
 								}
 							}
 							else
 							{
-								printf(" * Couldn't find or create map\n");
+								FN_WARN(" * Couldn't find or create map\n");
 								state = PCL_ERROR;
 							}
 					
@@ -210,8 +375,55 @@ int fnCore::processPacket(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struc
 						break;
 						
 					case PROTO_TCP:
+						{
+							FN_STATUS ret;
+							tcp_packet_tuple tuple;
+
+							if (FAILED(packet.getPacketTuple(tuple)))
+							{
+								FN_DEBUG(" * Truncated packet\n");
+								state = PCL_DROP_PACKET;
+								break;
+							}
+
+							ret = pState->getOutBoundMap(tuple,packet.getTCPFlags(),MapView);
+					
+							if (SUCCEEDED(ret))
+							{
+								FN_DEBUG(" * Found existing NAT map entry \n");
+								state = PCL_TRANSFORM_OUTBOUND_TCP;
+							}
+							else if (ret == FN_E_NO_MAP_FOUND)
+							{
+								ret = pState->createOutBoundMap(packet,MapView);
+								
+								if (SUCCEEDED(ret))
+								{
+									FN_DEBUG(" * Created new NAT map entry \n");
+
+									state = PCL_TRANSFORM_OUTBOUND_TCP;
+								}
+								else if (ret == FN_E_NO_MAP_FOUND)
+								{
+									FN_DEBUG(" * Not part of a known connection\n");
+									state = PCL_DROP_PACKET;
+								}
+								else
+								{
+									FN_WARN(" * Couldn't create map\n");
+									state = PCL_ERROR;
+								}
+							}
+							else
+							{
+								FN_WARN(" * Couldn't find or create map\n");
+								state = PCL_ERROR;
+							}
+						}
+						break;
+						
 					default:
-						printf("** Unsupported protocol: %d\n",packet.getProtocol());
+						FN_DEBUG("** Unsupported protocol: %d\n",packet.getProtocol());
 						state = PCL_DROP_PACKET;
 						break;
 				}			
@@ -221,12 +433,67 @@ int fnCore::processPacket(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struc
 			
 			case PCL_FIND_INBOUND_MAP:	// Looks up map to transform packet on way back in	
 			{
-				printf("** Process inbound packet\n");
+				FN_DEBUG("** Process inbound packet\n");
 				
 				switch (packet.getProtocol())
 				{
 					case PROTO_ICMP:
-						state = PCL_TRANSFORM_OUTBOUND_ICMP;
+						{
+							FN_STATUS ret;
+							icmp_packet_tuple tuple;
+
+							if (packet.isICMPError())
+							{
+								udp_packet_tuple embedded;
+								uint8_t protocol;
+								
+								ret = packet.getEmbeddedTuple(protocol,embedded);
+								
+								if (SUCCEEDED(ret))
+								{
+									ret = pState->getInBoundErrorMap(protocol,embedded,MapView);
+								}
+								
+								if (SUCCEEDED(ret))
+								{
+									FN_DEBUG(" * Found NAT map entry of quoted packet\n");
+									state = PCL_TRANSFORM_INBOUND_ICMP_ERROR;
+								}
+								else
+								{
+									FN_DEBUG(" * No NAT map entry for quoted packet\n");
+									state = PCL_DROP_PACKET;
+								}
+								break;
+							}
+
+							if (!packet.isICMPQuery())
+							{
+								FN_DEBUG(" * ICMP type %d is not translated\n",packet.getICMPType());
+								state = PCL_DROP_PACKET;
+								break;
+							}
+
+							if (FAILED(packet.getPacketTuple(tuple)))
+							{
+								FN_DEBUG(" * Truncated packet\n");
+								state = PCL_DROP_PACKET;
+								break;
+							}
+
+							ret = pState->getInBoundMap(tuple,MapView);
+					
+							if (SUCCEEDED(ret))
+							{
+								FN_DEBUG(" * Found existing NAT map entry\n");
+								state = PCL_TRANSFORM_INBOUND_ICMP;
+							}
+							else
+							{
+								FN_DEBUG(" * No existing NAT map entry exists\n");
+								state = PCL_DROP_PACKET;
+							}
+						}
 						break;
 					
 					case PROTO_UDP:
@@ -234,26 +501,57 @@ int fnCore::processPacket(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struc
 							FN_STATUS ret;
 							udp_packet_tuple tuple;
 
-							packet.getPacketTuple(tuple);
+							if (FAILED(packet.getPacketTuple(tuple)))
+							{
+								FN_DEBUG(" * Truncated packet\n");
+								state = PCL_DROP_PACKET;
+								break;
+							}
 
-							ret = pState->getInBoundMap(tuple,MapEntry);
+							ret = pState->getInBoundMap(tuple,MapView);
 					
 							if (SUCCEEDED(ret))
 							{
-								printf(" * Found existing NAT map entry\n");
+								FN_DEBUG(" * Found existing NAT map entry\n");
 								state = PCL_TRANSFORM_INBOUND_UDP;
 							}
 							else
 							{
-								printf(" * No existing NAT map entry exists\n");
+								FN_DEBUG(" * No existing NAT map entry exists\n");
 								state = PCL_DROP_PACKET;
 							}
 						}
 						break;
 						
 					case PROTO_TCP:
+						{
+							FN_STATUS ret;
+							tcp_packet_tuple tuple;
+
+							if (FAILED(packet.getPacketTuple(tuple)))
+							{
+								FN_DEBUG(" * Truncated packet\n");
+								state = PCL_DROP_PACKET;
+								break;
+							}
+
+							ret = pState->getInBoundMap(tuple,packet.getTCPFlags(),MapView);
+					
+							if (SUCCEEDED(ret))
+							{
+								FN_DEBUG(" * Found existing NAT map entry\n");
+								state = PCL_TRANSFORM_INBOUND_TCP;
+							}
+							else
+							{
+								FN_DEBUG(" * No existing NAT map entry exists\n");
+								state = PCL_DROP_PACKET;
+							}
+						}
+						break;
+						
 					default:
-						printf(" * Unsupported protocol: %d\n",packet.getProtocol());
+						FN_DEBUG(" * Unsupported protocol: %d\n",packet.getProtocol());
 						state = PCL_DROP_PACKET;
 						break;
 				}			
@@ -264,9 +562,9 @@ int fnCore::processPacket(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struc
 			
 			case PCL_TRANSFORM_OUTBOUND_ICMP:	// Apply map to ICMP packet
 			{
-				printf("** Transform outbound ICMP packet\n");
-				packet.setOutboundInterface(MapEntry.out_interface);
-				packet.setPacketTuple(MapEntry.outside_icmp);
+				FN_DEBUG("** Transform outbound ICMP packet\n");
+				packet.setOutboundIfIndex(MapView.out_ifindex);
+				packet.setPacketTuple(MapView.icmp);
 				
 				state = PCL_VERIFY_DESTINATION;
 			
@@ -276,9 +574,9 @@ int fnCore::processPacket(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struc
 
 			case PCL_TRANSFORM_OUTBOUND_UDP:	// Apply map to UDP packet
 			{
-				printf("** Transform outbound UDP packet\n");
-				packet.setOutboundInterface(MapEntry.out_interface);
-				packet.setPacketTuple(MapEntry.outside_udp);
+				FN_DEBUG("** Transform outbound UDP packet\n");
+				packet.setOutboundIfIndex(MapView.out_ifindex);
+				packet.setPacketTuple(MapView.udp);
 				
 				state = PCL_VERIFY_DESTINATION;
 			
@@ -287,9 +585,9 @@ int fnCore::processPacket(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struc
 			
 			case PCL_TRANSFORM_OUTBOUND_TCP:	// Apply map to TCP packet
 			{
-				printf("** Transform outbound TCP packet\n");
-				packet.setOutboundInterface(MapEntry.out_interface);
-				packet.setPacketTuple(MapEntry.outside_tcp);
+				FN_DEBUG("** Transform outbound TCP packet\n");
+				packet.setOutboundIfIndex(MapView.out_ifindex);
+				packet.setPacketTuple(MapView.tcp);
 				
 				state = PCL_VERIFY_DESTINATION;
 			
@@ -300,9 +598,21 @@ int fnCore::processPacket(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struc
 			
 			case PCL_TRANSFORM_INBOUND_ICMP:	// Apply map to ICMP packet
 			{
-				printf("** Transform inbound ICMP packet\n");
-				packet.setOutboundInterface(MapEntry.out_interface);
-				packet.setPacketTuple(MapEntry.inside_icmp);
+				FN_DEBUG("** Transform inbound ICMP packet\n");
+				packet.setOutboundIfIndex(MapView.out_ifindex);
+				packet.setPacketTuple(MapView.icmp);
+				
+				state = PCL_SEND_PACKET;
+			
+			}
+			break;
+
+
+			case PCL_TRANSFORM_INBOUND_ICMP_ERROR:	// Apply map to the packet quoted by an ICMP error
+			{
+				FN_DEBUG("** Transform inbound ICMP error\n");
+				packet.setOutboundIfIndex(MapView.out_ifindex);
+				packet.setEmbeddedTuple(MapView.udp);
 				
 				state = PCL_SEND_PACKET;
 			
@@ -312,9 +622,9 @@ int fnCore::processPacket(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struc
 
 			case PCL_TRANSFORM_INBOUND_UDP:	// Apply map to UDP packet
 			{
-				printf("** Transform inbound UDP packet\n");
-				packet.setOutboundInterface(MapEntry.out_interface);
-				packet.setPacketTuple(MapEntry.inside_udp);
+				FN_DEBUG("** Transform inbound UDP packet\n");
+				packet.setOutboundIfIndex(MapView.out_ifindex);
+				packet.setPacketTuple(MapView.udp);
 				
 				state = PCL_SEND_PACKET;
 			
@@ -322,11 +632,11 @@ int fnCore::processPacket(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struc
 			break;
 			
 			
-			case PCL_TRANSFORM_INBOUND_TCP:	// Apply map to UDP packet
+			case PCL_TRANSFORM_INBOUND_TCP:	// Apply map to TCP packet
 			{
-				printf("** Transform inbound TCP packet\n");
-				packet.setOutboundInterface(MapEntry.out_interface);
-				packet.setPacketTuple(MapEntry.inside_tcp);
+				FN_DEBUG("** Transform inbound TCP packet\n");
+				packet.setOutboundIfIndex(MapView.out_ifindex);
+				packet.setPacketTuple(MapView.tcp);
 				
 				state = PCL_SEND_PACKET;
 			}
@@ -334,7 +644,7 @@ int fnCore::processPacket(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struc
 			
 			case PCL_VERIFY_DESTINATION:// Check to see if hairpinning rule needs apply
 			{
-				printf("** Verify outbound destination for hairpinning\n");
+				FN_DEBUG("** Verify outbound destination for hairpinning\n");
 				fnOptions *pOptions = fnOptions::getInstance();
 				HAIRPIN hairpin;
 				uint32_t external_addr;
@@ -354,12 +664,12 @@ int fnCore::processPacket(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struc
 					// if hairpinning enabled, remap packet
 					if (hairpin == HAIRPIN_ALLOW)
 					{
-						printf(" * Hairpin detected - remapping\n");
+						FN_DEBUG(" * Hairpin detected - remapping\n");
 						state = PCL_FIND_INBOUND_MAP;	
 					}
 					else  // else drop it.
 					{
-						printf(" * Attempted Hairpin detected - dropping\n");
+						FN_DEBUG(" * Attempted Hairpin detected - dropping\n");
 						state = PCL_DROP_PACKET;
 					}
 				}
@@ -372,24 +682,62 @@ int fnCore::processPacket(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struc
 			
 			case PCL_SEND_PACKET:		// Send the packet
 			{
-				FN_STATUS status;
-				// Send packet out new interface
+				bool bResend;
+				
+				pOptions->getResend(bResend);
+				
+				// A packet queued after routing keeps the egress the kernel picked for it,
+				// so one the map sends elsewhere has to be sent by us
+				if (packet.getRoutedIfIndex() != 0 && packet.getRoutedIfIndex() != packet.getOutboundIfIndex())
+				{
+					bResend = true;
+				}
+				
+				if (pTrace != NULL)
+				{
+					tracePacket(pTrace, TRACE_EVENT_MAP, packet, packet.getOutboundIfIndex());
+					traceValue(pTrace, TRACE_EVENT_VERDICT, packet, bResend ? TRACE_VERDICT_RESEND : TRACE_VERDICT_ACCEPT);
+				}
+				
+				if (bResend)
+				{
+					// Send packet out new interface
 
-				printf("** Retransmitting packet\n");
-				packet.dump();
+					FN_DEBUG("** Retransmitting packet\n");
+					if (FN_LOG_ENABLED(FN_LOG_TRACE))
+					{
+						packet.dump();
+					}
 
-				status = packet.send();
+					ret = sink.transmit(packet);
+				}
+				else
+				{
+					// Let the kernel carry on with the rewritten packet
+					
+					FN_DEBUG("** Accepting rewritten packet\n");
+					if (FN_LOG_ENABLED(FN_LOG_TRACE))
+					{
+						packet.dump();
+					}
+					
+					ret = sink.accept(packet);
+				}
 				
-				// Drop it out of netfilter_queue
-				ret = nfq_set_verdict(qh, packet.getNetfilterID(), NF_DROP, 0, NULL); 
 				state = PCL_DONE;
 			}
 			break;
 			
 			case PCL_DROP_PACKET:		// Drop the packet
 			{
-				printf("** Dropping packet\n");
-				ret = nfq_set_verdict(qh, packet.getNetfilterID(), NF_DROP, 0, NULL); 
+				FN_DEBUG("** Dropping packet\n");
+				
+				if (pTrace != NULL)
+				{
+					traceValue(pTrace, TRACE_EVENT_VERDICT, packet, TRACE_VERDICT_DROP);
+				}
+				
+				ret = sink.drop(packet);
 				state = PCL_DONE;
 			}
 			break;
@@ -403,13 +751,21 @@ int fnCore::processPacket(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struc
 			
 			case PCL_ERROR:				// Something bad happened
 			{
-				printf("** Error\n");
+				FN_ERROR("** Error\n");
+
+				// every packet needs a verdict, or it stays queued in the kernel
+				if (pTrace != NULL)
+				{
+					traceValue(pTrace, TRACE_EVENT_VERDICT, packet, TRACE_VERDICT_DROP);
+				}
+
+				ret = sink.drop(packet);
 				bProcessing = false;
 			}
 			break;
 			
 			default:
-				printf("Invalid state\n");
+				FN_ERROR("Invalid state\n");
 		
 		}
 	}
@@ -417,59 +773,161 @@ int fnCore::processPacket(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struc
 	return ret;
 }
 
+/**
+* @brief Worker thread entry point
+* 
+* @detailed Pins the thread if requested and runs the receive loop of its queue.
+* 
+* @param arg [IN] fn_worker owned by fnCore::executeNAT
+* 
+*/
+static void* worker_thread(void *arg)
+{
+	fn_worker *pWorker = (fn_worker*)arg;
+	
+	if (pWorker->cpu >= 0)
+	{
+		cpu_set_t cpus;
+		
+		CPU_ZERO(&cpus);
+		CPU_SET(pWorker->cpu, &cpus);
+		
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+		{
+			FN_WARN("can't pin queue %d to cpu %d\n", pWorker->pQueue->getQueue(), pWorker->cpu);
+		}
+	}
+	
+	pWorker->pQueue->run(pWorker->pTrace);
+	
+	return NULL;
+}
+
 /**
 * @brief fnCore entry point
 * 
-* @detailed Loops over all incoming packets and dispatches them to the packet handler
+* @detailed Opens one netfilter queue per configured worker, starting at the configured
+* base queue number, and serves each from its own thread.  Pair with
+* "-j NFQUEUE --queue-balance base:base+N-1" so that the kernel spreads flows over the
+* queues; a flow always hashes to the same queue and so is handled by one thread in order.
 * 
 */
 FN_STATUS fnCore::executeNAT()
 {
-	struct nfq_handle *h;
-	struct nfq_q_handle *qh;
-	struct nfnl_handle *nh;
-	int fd;
-	int rv;
-	char buf[4096];
-
-	h = nfq_open();
-	if (!h) {
-		fprintf(stderr, "error during nfq_open()\n");
-		return FN_E_FAIL;
+	fnOptions *pOptions = fnOptions::getInstance();
+	FN_STATUS ret = FN_S_OK;
+	unsigned int nQueues;
+	unsigned int nBase;
+	bool bPin;
+	long nCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+	std::vector<fn_worker> workers;
+	std::string strTrace;
+	bool bFixed;
+
+	pOptions->getQueues(nBase, nQueues);
+	pOptions->getCPUPinning(bPin);
+	pOptions->getTraceFile(strTrace);
+	pOptions->getFixedAddresses(bFixed);
+
+	if (nCPUs < 1) {
+		nCPUs = 1;
 	}
 
-	if (nfq_unbind_pf(h, AF_INET) < 0) {
-		fprintf(stderr, "error during nfq_unbind_pf()\n");
-	}
+	workers.resize(nQueues);
 
-	if (nfq_bind_pf(h, AF_INET) < 0) {
-		fprintf(stderr, "error during nfq_bind_pf()\n");
-		return FN_E_FAIL;
+	// keep the cached interface addresses current, without it they stay as parsed
+	if (!bFixed && FAILED(fnLinkMonitor::getInstance()->start())) {
+		FN_WARN("interface address changes will not be picked up\n");
 	}
 
-	qh = nfq_create_queue(h,  0, &packet_callback, NULL);
-	if (!qh) {
-		fprintf(stderr, "error during nfq_create_queue()\n");
-		return FN_E_FAIL;
+	if (!strTrace.empty() && FAILED(fnTrace::getInstance()->start(strTrace, nQueues))) {
+		FN_WARN("tracing disabled\n");
 	}
 
-	if (nfq_set_mode(qh, NFQNL_COPY_PACKET, 0xffff) < 0) {
-		fprintf(stderr, "can't set packet_copy mode\n");
-		return FN_E_FAIL;
+	for (unsigned int i = 0; i < nQueues; i++) {
+		workers[i].pQueue = new fnNfqueue(nBase + i);
+		workers[i].cpu = bPin ? (int)(i % nCPUs) : -1;
+		workers[i].pTrace = fnTrace::getInstance()->getRing(i);
+
+		if (SUCCEEDED(ret)) {
+			ret = workers[i].pQueue->open(i == 0);
+		}
 	}
 
-	nh = nfq_nfnlh(h);
-	fd = nfnl_fd(nh);
+	if (SUCCEEDED(ret)) {
+		for (unsigned int i = 0; i < nQueues; i++) {
+			if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]) != 0) {
+				FN_ERROR("can't start worker for queue %d\n", workers[i].pQueue->getQueue());
+				ret = FN_E_FAIL;
+
+				// the remaining queues are never served
+				nQueues = i;
+				break;
+			}
+		}
 
-	while ((rv = recv(fd, buf, sizeof(buf), 0)) && rv >= 0) {
-		nfq_handle_packet(h, buf, rv);
+		for (unsigned int i = 0; i < nQueues; i++) {
+			pthread_join(workers[i].thread, NULL);
+		}
 	}
 
-	nfq_destroy_queue(qh);
+	for (unsigned int i = 0; i < workers.size(); i++) {
+		delete workers[i].pQueue;
+	}
 
-	nfq_close(h);
+	// write out what the queues recorded before they stopped
+	fnTrace::getInstance()->stop();
 
-	return FN_S_OK;
+	return ret;
 
 }
 
+/**
+* @brief fnCore entry point for replaying capture files
+* 
+* @detailed Feeds the configured captures through processPacket on the calling thread
+* and writes the rewritten packets to the configured output captures.
+* 
+* @return Status of the replay
+*/
+FN_STATUS fnCore::executeReplay()
+{
+	fnOptions *pOptions = fnOptions::getInstance();
+	FN_STATUS ret = FN_S_OK;
+	uint32_t nInternalIfIndex;
+	uint32_t nExternalIfIndex;
+	std::string strInputs[REPLAY_SIDE_COUNT];
+	std::string strOutputs[REPLAY_SIDE_COUNT];
+	std::string strTrace;
+
+	pOptions->getInternalIfIndex(nInternalIfIndex);
+	pOptions->getExternalIfIndex(nExternalIfIndex);
+	pOptions->getReplayInput(strInputs[REPLAY_INSIDE], strInputs[REPLAY_OUTSIDE]);
+	pOptions->getReplayOutput(strOutputs[REPLAY_INSIDE], strOutputs[REPLAY_OUTSIDE]);
+	pOptions->getTraceFile(strTrace);
+
+	fnPcapReplay replay(nInternalIfIndex, nExternalIfIndex);
+
+	for (int side = 0; side < REPLAY_SIDE_COUNT && SUCCEEDED(ret); side++) {
+		if (!strInputs[side].empty()) {
+			ret = replay.openInput((REPLAY_SIDE)side, strInputs[side]);
+		}
+
+		if (SUCCEEDED(ret) && !strOutputs[side].empty()) {
+			ret = replay.openOutput((REPLAY_SIDE)side, strOutputs[side]);
+		}
+	}
+
+	if (SUCCEEDED(ret)) {
+		if (!strTrace.empty() && FAILED(fnTrace::getInstance()->start(strTrace, 1))) {
+			FN_WARN("tracing disabled\n");
+		}
+
+		ret = replay.run(fnTrace::getInstance()->getRing(0));
+		replay.report();
+
+		fnTrace::getInstance()->stop();
+	}
+
+	return ret;
+}
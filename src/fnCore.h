@@ -23,14 +23,15 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #ifndef FN_FNCORE_H // one-time include
 #define FN_FNCORE_H
 
-extern "C" {
-#include <libnetfilter_queue/libnetfilter_queue.h>
-#include <libnetfilter_queue/libipq.h>
-#include <linux/netfilter.h>
-}
+#include <pthread.h>
+#include <stdint.h>
 
 #include "fn_error.h"
 #include "fnPacket.h"
+#include "fnPacketIO.h"
+#include "fnTrace.h"
+
+class fnNfqueue;
 
 // State machine states
 
@@ -46,6 +47,7 @@ typedef enum _CORE_PCL_STATES
 	PCL_TRANSFORM_OUTBOUND_UDP,
 	PCL_TRANSFORM_OUTBOUND_TCP,
 	PCL_TRANSFORM_INBOUND_ICMP,
+	PCL_TRANSFORM_INBOUND_ICMP_ERROR,	// Apply map to the packet quoted by an ICMP error
 	PCL_TRANSFORM_INBOUND_UDP,
 	PCL_TRANSFORM_INBOUND_TCP,
 	PCL_UPDATE_MAP,			// Update expiry of map entry
@@ -58,6 +60,17 @@ typedef enum _CORE_PCL_STATES
 
 
 
+// A netfilter queue and the thread serving it
+
+typedef struct _fn_worker
+{
+	fnNfqueue*	pQueue;
+	int		cpu;	///< CPU the thread is pinned to, -1 for none
+	pthread_t	thread;
+	fnTraceRing*	pTrace;	///< trace events of this queue, NULL when not tracing
+} fn_worker;
+
+
 class fnCore
 {
    public:
@@ -66,7 +79,10 @@ class fnCore
         
   		FN_STATUS initialize();
   		FN_STATUS executeNAT();
-  		int processPacket(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struct nfq_data *nfa, void *data);
+  		FN_STATUS executeReplay();
+  		FN_STATUS processPacket(fnPacket &packet, fnPacketSink &sink, fnTraceRing *pTrace);
+  		
+  		static const char* getStateName(CORE_PCL_STATES state);
 
 	
     protected:
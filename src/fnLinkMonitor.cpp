@@ -0,0 +1,214 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+
+/**
+* @file fnLinkMonitor.cpp
+* @author Jeremy Beker
+* @version
+*
+* @overview Refreshes the cached interface addresses on rtnetlink events
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "fnLinkMonitor.h"
+#include "fnLog.h"
+#include "fnOptions.h"
+
+// Ensure that the singleton instance always starts out as NULL.
+fnLinkMonitor* fnLinkMonitor::s_Instance = NULL;
+
+/**
+* @brief Constructor for fnLinkMonitor class
+*/
+fnLinkMonitor::fnLinkMonitor()
+{
+	m_fd = -1;
+}
+
+/**
+* @brief Destructor for fnLinkMonitor class
+*
+* @detailed Closes the rtnetlink socket, which ends the monitor thread
+*/
+fnLinkMonitor::~fnLinkMonitor()
+{
+	if (m_fd >= 0)
+	{
+		shutdown(m_fd, SHUT_RDWR);
+		close(m_fd);
+	}
+}
+
+/**
+* @brief The getInstance function provides access to the singleton instance of the class
+*
+* @detailed This class is defined as a singleton so there is exactly one instance of the class throughout the calling program.  This class
+*           should never be created by the calling program through new.  It should only be accessed by the getInstance method to get
+*           a pointer to the singleton instance.
+*
+* @post
+* - A non-null pointer to the singleton instance is returned
+*
+* @return A non-null pointer to the singleton instance
+*/
+fnLinkMonitor* fnLinkMonitor::getInstance()
+{
+	if ( s_Instance == NULL )
+	{
+		s_Instance = new fnLinkMonitor();
+	}
+
+	return s_Instance;
+}
+
+/**
+* @brief Subscribes to link and address events and starts the monitor thread
+*
+* @detailed The interfaces are looked up once more after subscribing, so a change
+*			between option parsing and now is not missed.
+*
+* @return Status of start
+*
+* @retval FN_E_FAIL No rtnetlink socket or thread, the cached values stay as they are
+* @retval FN_S_OK Monitor running
+*/
+FN_STATUS fnLinkMonitor::start()
+{
+	FN_STATUS ret = FN_S_OK;
+	struct sockaddr_nl addr;
+
+	if (m_fd >= 0)
+	{
+		return ret;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+
+	m_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+
+	if (m_fd < 0)
+	{
+		FN_ERROR("can't open rtnetlink socket: %s\n", strerror(errno));
+		ret = FN_E_FAIL;
+	}
+	else if (bind(m_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		FN_ERROR("can't subscribe to rtnetlink events: %s\n", strerror(errno));
+		ret = FN_E_FAIL;
+	}
+	else if (pthread_create(&m_thread, NULL, monitorThread, this) != 0)
+	{
+		FN_ERROR("can't start interface monitor\n");
+		ret = FN_E_FAIL;
+	}
+	else
+	{
+		pthread_detach(m_thread);
+		fnOptions::getInstance()->refreshInterfaces();
+	}
+
+	if (FAILED(ret) && m_fd >= 0)
+	{
+		close(m_fd);
+		m_fd = -1;
+	}
+
+	return ret;
+}
+
+/**
+* @brief Monitor thread entry point
+*
+* @param arg [IN] fnLinkMonitor instance
+*/
+void* fnLinkMonitor::monitorThread(void *arg)
+{
+	((fnLinkMonitor*)arg)->run();
+
+	return NULL;
+}
+
+/**
+* @brief Receive loop of the monitor thread
+*
+* @detailed Each datagram may hold several messages; the interfaces are looked up
+*			at most once per datagram.  If the socket overflowed, events were lost,
+*			so they are looked up anyway.
+*/
+void fnLinkMonitor::run()
+{
+	fnOptions *pOptions = fnOptions::getInstance();
+	char buf[8192];
+	int rv;
+
+	for (;;)
+	{
+		bool bChanged = false;
+
+		rv = recv(m_fd, buf, sizeof(buf), 0);
+
+		if (rv > 0)
+		{
+			struct nlmsghdr *nh;
+			int len = rv;
+
+			for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, (unsigned int)len); nh = NLMSG_NEXT(nh, len))
+			{
+				switch (nh->nlmsg_type)
+				{
+					case RTM_NEWLINK:
+					case RTM_DELLINK:
+					case RTM_NEWADDR:
+					case RTM_DELADDR:
+						bChanged = true;
+						break;
+
+					default:
+						break;
+				}
+			}
+		}
+		else if (rv < 0 && errno == ENOBUFS)
+		{
+			bChanged = true;
+		}
+		else if (rv == 0 || errno != EINTR)
+		{
+			break;
+		}
+
+		if (bChanged)
+		{
+			pOptions->refreshInterfaces();
+		}
+	}
+}
@@ -0,0 +1,57 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+
+#ifndef FN_FNLINKMONITOR_H // one-time include
+#define FN_FNLINKMONITOR_H
+
+#include <pthread.h>
+
+#include "fn_error.h"
+
+/**
+* Keeps the interface addresses and indexes cached by fnOptions current.  A
+* background thread listens for rtnetlink link and IPv4 address events and has
+* fnOptions look both interfaces up again after each burst of them, so the packet
+* path never has to ask the kernel.
+*/
+class fnLinkMonitor
+{
+	public:
+		static fnLinkMonitor* getInstance();
+		~fnLinkMonitor();
+
+		FN_STATUS start();
+
+	protected:
+		fnLinkMonitor(); ///< Protected constructor prevents creation of object my non-members
+		static fnLinkMonitor* s_Instance; ///< The singleton instance
+
+		static void* monitorThread(void *arg);
+		void run();
+
+	private:
+		int		m_fd;		///< rtnetlink socket, -1 until started
+		pthread_t	m_thread;
+};
+
+#endif
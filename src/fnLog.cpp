@@ -0,0 +1,67 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+
+/**
+* @file fnLog.cpp
+* @author Jeremy Beker
+* @version
+*
+* @overview Level gated diagnostics, see fnLog.h for the macros
+*/
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "fnLog.h"
+
+int g_nLogLevel = FN_LOG_WARN;
+
+/**
+* @brief Sets the highest level printed
+*
+* @detailed Levels above FN_LOG_MAX_LEVEL stay silent, their messages are not compiled in.
+*
+* @param level [IN] FN_LOG_ERROR to FN_LOG_TRACE
+*/
+void fnLogSetLevel(int level)
+{
+	__atomic_store_n(&g_nLogLevel, level, __ATOMIC_RELAXED);
+}
+
+/**
+* @brief Prints a message
+*
+* @detailed Errors and warnings go to stderr, everything else to stdout.  Callers go
+*			through the FN_ERROR .. FN_TRACE macros, which check the level first.
+*
+* @param level [IN] Level of the message
+* @param format [IN] printf format
+*/
+void fnLogPrint(int level, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	vfprintf(level <= FN_LOG_WARN ? stderr : stdout, format, args);
+	va_end(args);
+}
@@ -0,0 +1,93 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+
+#ifndef FN_FNLOG_H // one-time include
+#define FN_FNLOG_H
+
+#define FN_LOG_ERROR 0	///< Something failed
+#define FN_LOG_WARN 1	///< A packet or map was refused for lack of resources
+#define FN_LOG_INFO 2	///< Startup and configuration
+#define FN_LOG_DEBUG 3	///< Every decision taken for a packet
+#define FN_LOG_TRACE 4	///< Packet dumps
+
+/**
+* Highest level compiled in.  Calls above it expand to nothing, arguments included,
+* so a release build (make LOG_LEVEL=1) carries no code for the packet path messages.
+*/
+#ifndef FN_LOG_MAX_LEVEL
+#define FN_LOG_MAX_LEVEL FN_LOG_TRACE
+#endif
+
+extern int g_nLogLevel;	///< Highest level printed, set through --verbose
+
+void fnLogSetLevel(int level);
+void fnLogPrint(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+* @brief Returns if messages of a level are printed
+*
+* @detailed Constant false for levels that are compiled out, otherwise a single load.
+*/
+#define FN_LOG_ENABLED(level) \
+	((level) <= FN_LOG_MAX_LEVEL && (level) <= __atomic_load_n(&g_nLogLevel, __ATOMIC_RELAXED))
+
+/**
+* @brief Prints a message if its level is enabled
+*
+* @detailed The arguments are only evaluated, and the message only formatted, when the
+*			level is enabled.
+*/
+#define FN_LOG(level, ...) \
+	do { if (FN_LOG_ENABLED(level)) fnLogPrint((level), __VA_ARGS__); } while (0)
+
+#if FN_LOG_MAX_LEVEL >= FN_LOG_ERROR
+#define FN_ERROR(...) FN_LOG(FN_LOG_ERROR, __VA_ARGS__)
+#else
+#define FN_ERROR(...) do { } while (0)
+#endif
+
+#if FN_LOG_MAX_LEVEL >= FN_LOG_WARN
+#define FN_WARN(...) FN_LOG(FN_LOG_WARN, __VA_ARGS__)
+#else
+#define FN_WARN(...) do { } while (0)
+#endif
+
+#if FN_LOG_MAX_LEVEL >= FN_LOG_INFO
+#define FN_INFO(...) FN_LOG(FN_LOG_INFO, __VA_ARGS__)
+#else
+#define FN_INFO(...) do { } while (0)
+#endif
+
+#if FN_LOG_MAX_LEVEL >= FN_LOG_DEBUG
+#define FN_DEBUG(...) FN_LOG(FN_LOG_DEBUG, __VA_ARGS__)
+#else
+#define FN_DEBUG(...) do { } while (0)
+#endif
+
+#if FN_LOG_MAX_LEVEL >= FN_LOG_TRACE
+#define FN_TRACE(...) FN_LOG(FN_LOG_TRACE, __VA_ARGS__)
+#else
+#define FN_TRACE(...) do { } while (0)
+#endif
+
+#endif
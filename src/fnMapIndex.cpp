@@ -0,0 +1,284 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+/**
+* @file fnMapIndex.cpp
+* @author Jeremy Beker
+* @version
+*
+* @overview Hash index used by fnState to find map entries in constant time
+*/
+
+#include <stddef.h>
+#include <string.h>
+
+#include "fnMapIndex.h"
+
+/**
+* @brief Constructor for fnMapIndex class
+*
+* @param nInitialSize [IN] Initial number of slots, rounded up to a power of two
+*/
+fnMapIndex::fnMapIndex(unsigned int nInitialSize)
+{
+	uint32_t size = 16;
+
+	while (size < nInitialSize)
+	{
+		size <<= 1;
+	}
+
+	m_pSlots = new index_slot[size];
+	memset(m_pSlots, 0, sizeof(index_slot) * size);
+	m_nMask = size - 1;
+	m_nCount = 0;
+}
+
+/**
+* @brief Destructor for fnMapIndex class
+*
+* @detailed The index does not own the entries it points to, only the slot table is freed
+*/
+fnMapIndex::~fnMapIndex()
+{
+	delete [] m_pSlots;
+}
+
+/**
+* @brief Hashes a key into 32 bits
+*
+* @detailed Folds the key into a 64 bit word and runs it through a multiply/xor-shift mixer
+*			so that keys differing only in low port bits spread over the whole table.
+*/
+uint32_t fnMapIndex::hash(const nat_map_key &key)
+{
+	uint64_t h = ((uint64_t)key.local_ip << 32) | key.remote_ip;
+
+	h ^= ((uint64_t)key.local_port << 48) | ((uint64_t)key.remote_port << 32) | key.protocol;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return (uint32_t)h;
+}
+
+/**
+* @brief Compares two keys
+*/
+inline bool fnMapIndex::equal(const nat_map_key &a, const nat_map_key &b)
+{
+	return a.local_ip == b.local_ip &&
+		a.remote_ip == b.remote_ip &&
+		a.local_port == b.local_port &&
+		a.remote_port == b.remote_port &&
+		a.protocol == b.protocol;
+}
+
+/**
+* @brief Looks up the entry stored for a key
+*
+* @param key [IN] Key to search for
+*
+* @return The stored entry, or NULL if the key is not present
+*/
+nat_map_entry* fnMapIndex::find(const nat_map_key &key) const
+{
+	uint32_t i = hash(key) & m_nMask;
+
+	while (m_pSlots[i].pEntry != NULL)
+	{
+		if (equal(m_pSlots[i].key, key))
+		{
+			return m_pSlots[i].pEntry;
+		}
+
+		i = (i + 1) & m_nMask;
+	}
+
+	return NULL;
+}
+
+/**
+* @brief Adds a key to the index
+*
+* @detailed If the key is already present its entry is replaced.
+*
+* @param key [IN] Key of the entry
+* @param pEntry [IN] Entry to be stored
+*
+* @return Status of insert
+*
+* @retval FN_E_NULLPOINTER pEntry was NULL
+* @retval FN_S_OK Entry stored
+*/
+FN_STATUS fnMapIndex::insert(const nat_map_key &key, nat_map_entry *pEntry)
+{
+	uint32_t i;
+
+	if (pEntry == NULL)
+	{
+		return FN_E_NULLPOINTER;
+	}
+
+	// keep the load factor at or below one half
+	if ((m_nCount + 1) * 2 > m_nMask + 1)
+	{
+		grow();
+	}
+
+	i = hash(key) & m_nMask;
+
+	while (m_pSlots[i].pEntry != NULL)
+	{
+		if (equal(m_pSlots[i].key, key))
+		{
+			m_pSlots[i].pEntry = pEntry;
+			return FN_S_OK;
+		}
+
+		i = (i + 1) & m_nMask;
+	}
+
+	m_pSlots[i].key = key;
+	m_pSlots[i].pEntry = pEntry;
+	m_nCount++;
+
+	return FN_S_OK;
+}
+
+/**
+* @brief Removes a key from the index
+*
+* @detailed The run of slots following the removed one is shifted back so that
+*			every remaining key stays reachable from its home slot.
+*
+* @param key [IN] Key to be removed
+*
+* @return Status of removal
+*
+* @retval FN_E_NO_MAP_FOUND Key was not in the index
+* @retval FN_S_OK Key removed
+*/
+FN_STATUS fnMapIndex::remove(const nat_map_key &key)
+{
+	uint32_t i = hash(key) & m_nMask;
+	uint32_t j;
+
+	while (m_pSlots[i].pEntry != NULL && !equal(m_pSlots[i].key, key))
+	{
+		i = (i + 1) & m_nMask;
+	}
+
+	if (m_pSlots[i].pEntry == NULL)
+	{
+		return FN_E_NO_MAP_FOUND;
+	}
+
+	j = i;
+
+	for (;;)
+	{
+		uint32_t home;
+
+		j = (j + 1) & m_nMask;
+
+		if (m_pSlots[j].pEntry == NULL)
+		{
+			break;
+		}
+
+		// slot j can move into the hole at i only if its home slot is not in (i, j]
+		home = hash(m_pSlots[j].key) & m_nMask;
+
+		if (((j - home) & m_nMask) >= ((j - i) & m_nMask))
+		{
+			m_pSlots[i] = m_pSlots[j];
+			i = j;
+		}
+	}
+
+	m_pSlots[i].pEntry = NULL;
+	m_nCount--;
+
+	return FN_S_OK;
+}
+
+/**
+* @brief Starts loading the slot a key hashes to into the cache
+*
+* @detailed Only a hint, so it may run without the lock that guards the index: a
+*			slot of a table that is being replaced costs a wasted load, never a fault.
+*
+* @param key [IN] Key about to be looked up
+*/
+void fnMapIndex::prefetch(const nat_map_key &key) const
+{
+	const index_slot *pSlots = __atomic_load_n(&m_pSlots, __ATOMIC_RELAXED);
+	uint32_t mask = __atomic_load_n(&m_nMask, __ATOMIC_RELAXED);
+	
+	__builtin_prefetch(&pSlots[hash(key) & mask]);
+}
+
+/**
+* @brief Returns the number of keys stored
+*/
+unsigned int fnMapIndex::size() const
+{
+	return m_nCount;
+}
+
+/**
+* @brief Doubles the slot table and rehashes all keys
+*/
+void fnMapIndex::grow()
+{
+	index_slot* pOld = m_pSlots;
+	uint32_t nOldSize = m_nMask + 1;
+	uint32_t nNewSize = nOldSize * 2;
+	index_slot* pNew = new index_slot[nNewSize];
+
+	memset(pNew, 0, sizeof(index_slot) * nNewSize);
+
+	// prefetch reads these without the lock
+	__atomic_store_n(&m_pSlots, pNew, __ATOMIC_RELAXED);
+	__atomic_store_n(&m_nMask, nNewSize - 1, __ATOMIC_RELAXED);
+
+	for (uint32_t n = 0; n < nOldSize; n++)
+	{
+		if (pOld[n].pEntry != NULL)
+		{
+			uint32_t i = hash(pOld[n].key) & m_nMask;
+
+			while (m_pSlots[i].pEntry != NULL)
+			{
+				i = (i + 1) & m_nMask;
+			}
+
+			m_pSlots[i] = pOld[n];
+		}
+	}
+
+	delete [] pOld;
+}
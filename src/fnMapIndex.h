@@ -0,0 +1,80 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#ifndef FN_FNMAPINDEX_H // one-time include
+#define FN_FNMAPINDEX_H
+
+#include <stdint.h>
+
+#include "fn_error.h"
+#include "structures.h"
+
+/**
+* Lookup key for the map indexes.  Fields that are not significant for the
+* configured mapping or filtering behavior are left as zero.
+*/
+typedef struct _nat_map_key
+{
+	uint32_t	local_ip;
+	uint32_t	remote_ip;
+	uint16_t	local_port;
+	uint16_t	remote_port;
+	uint16_t	protocol;
+	uint16_t	reserved;
+} nat_map_key;
+
+/**
+* Open addressing (linear probing) hash table from nat_map_key to a map entry.
+* Keys are unique; deletion uses backward shifting so no tombstones are left behind.
+*/
+class fnMapIndex
+{
+	public:
+		fnMapIndex(unsigned int nInitialSize = 1024);
+		~fnMapIndex();
+
+		nat_map_entry* find(const nat_map_key &key) const;
+		FN_STATUS insert(const nat_map_key &key, nat_map_entry *pEntry);
+		FN_STATUS remove(const nat_map_key &key);
+		void prefetch(const nat_map_key &key) const;
+
+		unsigned int size() const;
+
+	protected:
+		typedef struct _index_slot
+		{
+			nat_map_key		key;
+			nat_map_entry*	pEntry;	///< NULL marks an empty slot
+		} index_slot;
+
+		static uint32_t hash(const nat_map_key &key);
+		static bool equal(const nat_map_key &a, const nat_map_key &b);
+
+		void grow();
+
+	private:
+		index_slot*		m_pSlots;	///< replaced with atomic stores, see prefetch
+		uint32_t		m_nMask;	///< table size - 1, table size is a power of two
+		unsigned int	m_nCount;
+};
+
+#endif
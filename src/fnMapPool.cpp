@@ -0,0 +1,162 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+/**
+* @file fnMapPool.cpp
+* @author Jeremy Beker
+* @version
+*
+* @overview Slab allocator for NAT map entries
+*/
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "fnMapPool.h"
+
+/**
+* @brief Constructor for fnMapPool class
+*
+* @param nMax [IN] Maximum number of entries that may exist at once
+*/
+fnMapPool::fnMapPool(unsigned int nMax)
+{
+	m_pFree = NULL;
+	m_nMax = nMax;
+	m_nCapacity = 0;
+	m_nInUse = 0;
+}
+
+/**
+* @brief Destructor for fnMapPool class
+*
+* @detailed Frees every slab.  Entries still in use become invalid.
+*/
+fnMapPool::~fnMapPool()
+{
+	for (std::vector<nat_map_entry*>::iterator i = m_slabs.begin(); i != m_slabs.end(); i++)
+	{
+		free(*i);
+	}
+}
+
+/**
+* @brief Changes the maximum number of entries
+*
+* @detailed Slabs that already exist are kept even if they exceed the new limit.
+*
+* @param nMax [IN] Maximum number of entries that may exist at once
+*/
+void fnMapPool::setLimit(unsigned int nMax)
+{
+	m_nMax = nMax;
+}
+
+/**
+* @brief Adds a slab and puts its entries on the free list
+*
+* @return false if the limit has been reached or memory is exhausted
+*/
+bool fnMapPool::addSlab()
+{
+	nat_map_entry *pSlab;
+	void *pMemory;
+
+	if (m_nCapacity >= m_nMax)
+	{
+		return false;
+	}
+
+	// new[] only guarantees 16 byte alignment, entries must start on a cache line
+	if (posix_memalign(&pMemory, alignof(nat_map_entry), sizeof(nat_map_entry) * FN_MAP_SLAB_SIZE) != 0)
+	{
+		return false;
+	}
+
+	pSlab = (nat_map_entry*)pMemory;
+
+	m_slabs.push_back(pSlab);
+
+	for (unsigned int i = FN_MAP_SLAB_SIZE; i > 0; i--)
+	{
+		pSlab[i - 1].timer_next = m_pFree;
+		m_pFree = &pSlab[i - 1];
+	}
+
+	m_nCapacity += FN_MAP_SLAB_SIZE;
+
+	return true;
+}
+
+/**
+* @brief Takes an entry from the pool
+*
+* @return An uninitialized entry, or NULL if the maximum number of entries is in use
+*/
+nat_map_entry* fnMapPool::allocate()
+{
+	nat_map_entry *pEntry;
+
+	if (m_nInUse >= m_nMax)
+	{
+		return NULL;
+	}
+
+	if (m_pFree == NULL && !addSlab())
+	{
+		return NULL;
+	}
+
+	pEntry = m_pFree;
+	m_pFree = pEntry->timer_next;
+	m_nInUse++;
+
+	return pEntry;
+}
+
+/**
+* @brief Returns an entry to the pool
+*
+* @param pEntry [IN] Entry obtained from allocate, invalid on return
+*/
+void fnMapPool::release(nat_map_entry *pEntry)
+{
+	pEntry->timer_next = m_pFree;
+	m_pFree = pEntry;
+	m_nInUse--;
+}
+
+/**
+* @brief Returns the number of entries handed out
+*/
+unsigned int fnMapPool::inUse() const
+{
+	return m_nInUse;
+}
+
+/**
+* @brief Returns the number of entries that have been carved out of slabs
+*/
+unsigned int fnMapPool::capacity() const
+{
+	return m_nCapacity;
+}
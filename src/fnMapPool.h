@@ -0,0 +1,63 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#ifndef FN_FNMAPPOOL_H // one-time include
+#define FN_FNMAPPOOL_H
+
+#include <vector>
+
+#include "structures.h"
+
+#define FN_MAP_SLAB_SIZE 4096	///< map entries carved out of each slab
+
+/**
+* Fixed size allocator for map entries.  Entries are carved out of slabs that are
+* never returned to the heap, and free entries are kept on a list threaded through
+* their timer_next field, so allocate and release are constant time.  Slabs are
+* added on demand until the configured maximum number of entries exists.
+*/
+class fnMapPool
+{
+	public:
+		fnMapPool(unsigned int nMax = 262144);
+		~fnMapPool();
+
+		void setLimit(unsigned int nMax);
+
+		nat_map_entry* allocate();
+		void release(nat_map_entry *pEntry);
+
+		unsigned int inUse() const;
+		unsigned int capacity() const;
+
+	protected:
+		bool addSlab();
+
+	private:
+		std::vector<nat_map_entry*>	m_slabs;
+		nat_map_entry*	m_pFree;
+		unsigned int	m_nMax;
+		unsigned int	m_nCapacity;
+		unsigned int	m_nInUse;
+};
+
+#endif
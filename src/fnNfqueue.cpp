@@ -0,0 +1,482 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+
+/**
+* @file fnNfqueue.cpp
+* @author Jeremy Beker
+* @version
+*
+* @overview Netfilter queue packet source and sink
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+
+#include "fnNfqueue.h"
+#include "fnCore.h"
+#include "fnLog.h"
+#include "fnOptions.h"
+#include "fnState.h"
+
+/**
+* @brief Constructor for fnNfqueue class
+*
+* @param queue [IN] Netfilter queue number
+*/
+fnNfqueue::fnNfqueue(uint16_t queue)
+{
+	m_nQueue = queue;
+	m_pHandle = NULL;
+	m_pQueueHandle = NULL;
+	m_fd = -1;
+	m_pTrace = NULL;
+	m_pBuffers = new unsigned char[FN_NFQ_BATCH * FN_NFQ_BUFFER_SIZE];
+	m_nBatch = 0;
+	m_nDropID = 0;
+	m_nDrops = 0;
+	m_nFailed = 0;
+	m_nOverruns = 0;
+	m_nTruncated = 0;
+
+	memset(m_msgs, 0, sizeof(m_msgs));
+
+	for (unsigned int i = 0; i < FN_NFQ_BATCH; i++) {
+		m_iov[i].iov_base = m_pBuffers + i * FN_NFQ_BUFFER_SIZE;
+		m_iov[i].iov_len = FN_NFQ_BUFFER_SIZE;
+		m_msgs[i].msg_hdr.msg_iov = &m_iov[i];
+		m_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+/**
+* @brief Destructor for fnNfqueue class
+*/
+fnNfqueue::~fnNfqueue()
+{
+	close();
+
+	delete [] m_pBuffers;
+}
+
+/**
+* @brief Returns the netfilter queue number
+*/
+uint16_t fnNfqueue::getQueue() const
+{
+	return m_nQueue;
+}
+
+/**
+* @brief Opens the netfilter queue
+*
+* @param bBindPF [IN] Rebind the AF_INET queue handler, only done for the first queue
+*
+* @return Status of queue creation
+*
+* @retval FN_E_FAIL Queue could not be set up
+* @retval FN_S_OK Queue ready
+*/
+FN_STATUS fnNfqueue::open(bool bBindPF)
+{
+	struct timeval tv;
+
+	m_pQueueHandle = NULL;
+	m_pHandle = nfq_open();
+	if (!m_pHandle) {
+		FN_ERROR("error during nfq_open()\n");
+		return FN_E_FAIL;
+	}
+
+	if (bBindPF) {
+		if (nfq_unbind_pf(m_pHandle, AF_INET) < 0) {
+			FN_WARN("error during nfq_unbind_pf()\n");
+		}
+
+		if (nfq_bind_pf(m_pHandle, AF_INET) < 0) {
+			FN_ERROR("error during nfq_bind_pf()\n");
+			return FN_E_FAIL;
+		}
+	}
+
+	m_pQueueHandle = nfq_create_queue(m_pHandle, m_nQueue, &callback, this);
+	if (!m_pQueueHandle) {
+		FN_ERROR("error during nfq_create_queue(%d)\n", m_nQueue);
+		return FN_E_FAIL;
+	}
+
+	if (nfq_set_mode(m_pQueueHandle, NFQNL_COPY_PACKET, FN_NFQ_COPY_RANGE) < 0) {
+		FN_ERROR("can't set packet_copy mode\n");
+		return FN_E_FAIL;
+	}
+
+	if (nfq_set_queue_maxlen(m_pQueueHandle, FN_NFQ_MAXLEN) < 0) {
+		FN_WARN("can't set queue length of queue %d\n", m_nQueue);
+	}
+
+	// Room for bursts, the kernel reports ENOBUFS once this fills up
+	if (nfnl_rcvbufsiz(nfq_nfnlh(m_pHandle), FN_NFQ_RCVBUF) < FN_NFQ_RCVBUF) {
+		FN_WARN("receive buffer of queue %d is smaller than %d bytes, raise net.core.rmem_max\n", m_nQueue, FN_NFQ_RCVBUF);
+	}
+
+	m_fd = nfnl_fd(nfq_nfnlh(m_pHandle));
+
+	// Wake up at least once a second so idle maps expire without traffic
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	if (setsockopt(m_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+		FN_WARN("can't set receive timeout\n");
+	}
+
+	return FN_S_OK;
+}
+
+/**
+* @brief Releases the netfilter handles
+*/
+void fnNfqueue::close()
+{
+	if (m_pQueueHandle) {
+		nfq_destroy_queue(m_pQueueHandle);
+		m_pQueueHandle = NULL;
+	}
+
+	if (m_pHandle) {
+		nfq_close(m_pHandle);
+		m_pHandle = NULL;
+	}
+
+	m_fd = -1;
+}
+
+/**
+* @brief Receive loop of the queue
+*
+* @detailed Dispatches every packet of the queue to fnCore::processPacket, in the order
+* the kernel queued them, until the queue socket fails.  Each recvmmsg call waits for
+* the first message and then takes whatever else is already queued, up to FN_NFQ_BATCH.
+* ENOBUFS means the socket overflowed and messages were lost, the loop counts it and
+* carries on with the messages that are still coming.  A message cut short by the
+* receive buffer is dropped by its packet id, so it does not hold a queue slot.
+*
+* @param pTrace [IN] Trace ring of the calling thread, NULL when not tracing
+*
+* @return Status of the queue
+*
+* @retval FN_E_FAIL The queue socket failed, or a truncated message had no packet id
+*/
+FN_STATUS fnNfqueue::run(fnTraceRing *pTrace)
+{
+	fnState *pState = fnState::getInstance();
+	int rv;
+
+	m_pTrace = pTrace;
+
+	for (;;) {
+		rv = recvmmsg(m_fd, m_msgs, FN_NFQ_BATCH, MSG_WAITFORONE, NULL);
+
+		if (rv > 0) {
+			bool bLost = false;
+
+			m_nBatch = 0;
+
+			for (int i = 0; i < rv; i++) {
+				if (m_msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+					uint32_t id;
+
+					m_nTruncated++;
+
+					// the packet header comes first and survives, the rest of the packet is lost
+					if (getTruncatedID((unsigned char*)m_iov[i].iov_base, m_msgs[i].msg_len, id)) {
+						FN_WARN("queue %d: packet %u larger than %d bytes (%lu truncated)\n", m_nQueue, id, FN_NFQ_BUFFER_SIZE, m_nTruncated);
+						nfq_set_verdict(m_pQueueHandle, id, NF_DROP, 0, NULL);
+					}
+					else {
+						FN_ERROR("queue %d: truncated message without a packet id\n", m_nQueue);
+						bLost = true;
+					}
+					continue;
+				}
+
+				nfq_handle_packet(m_pHandle, (char*)m_iov[i].iov_base, m_msgs[i].msg_len);
+			}
+
+			processBatch();
+
+			if (bLost) {
+				// a packet would sit in the queue forever
+				break;
+			}
+		}
+		else if (rv < 0 && errno == ENOBUFS) {
+			m_nOverruns++;
+			FN_WARN("queue %d: receive buffer overrun, packets lost (%lu overruns)\n", m_nQueue, m_nOverruns);
+		}
+		else if (rv == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+			break;
+		}
+
+		pState->expireMaps(pState->now());
+	}
+
+	return FN_E_FAIL;
+}
+
+/**
+* @brief Finds the packet id of a queue message cut short by the receive buffer
+*
+* @detailed libnetfilter_queue refuses a truncated message, but the packet header
+* attribute is sent ahead of the payload and is normally intact.
+*
+* @param pMsg [IN] Netlink message as received
+* @param nLength [IN] Bytes received
+* @param id [OUT] Netfilter packet id, host byte order
+*
+* @return true if the packet header attribute was found whole
+*/
+bool fnNfqueue::getTruncatedID(const unsigned char *pMsg, unsigned int nLength, uint32_t &id)
+{
+	const struct nlmsghdr *nlh = (const struct nlmsghdr*)pMsg;
+	unsigned int nOffset = NLMSG_HDRLEN + NLMSG_ALIGN(sizeof(struct nfgenmsg));
+
+	if (nLength < nOffset || (nlh->nlmsg_type & 0xFF) != NFQNL_MSG_PACKET) {
+		return false;
+	}
+
+	while (nOffset + NLA_HDRLEN <= nLength) {
+		const struct nlattr *attr = (const struct nlattr*)(pMsg + nOffset);
+
+		if (attr->nla_len < NLA_HDRLEN) {
+			break;
+		}
+
+		if ((attr->nla_type & NLA_TYPE_MASK) == NFQA_PACKET_HDR) {
+			if (attr->nla_len < NLA_HDRLEN + sizeof(struct nfqnl_msg_packet_hdr) || nOffset + attr->nla_len > nLength) {
+				break;
+			}
+
+			id = ntohl(((const struct nfqnl_msg_packet_hdr*)(pMsg + nOffset + NLA_HDRLEN))->packet_id);
+			return true;
+		}
+
+		nOffset += NLA_ALIGN(attr->nla_len);
+	}
+
+	return false;
+}
+
+/**
+* @brief Packet handler callback
+*
+* @detailed Callback function for received packets.  Adds the packet to the batch
+* being received, it is processed by processBatch once the whole batch is in.  nfa
+* does not outlive the callback but the payload stays in the receive buffer.
+*
+* @param qh [IN] Netfilter handle
+* @param nfmsg [IN]
+* @param nfa [IN] packet data
+* @param data [IN] fnNfqueue the packet was queued to
+*
+*/
+int fnNfqueue::callback(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struct nfq_data *nfa, void *data)
+{
+	fnNfqueue *pQueue = (fnNfqueue*)data;
+	struct nfqnl_msg_packet_hdr *ph = nfq_get_msg_packet_hdr(nfa);
+	nfq_packet *pPacket;
+
+	// a buffer normally holds a single message, but never overrun the batch
+	if (pQueue->m_nBatch == FN_NFQ_BATCH) {
+		pQueue->processBatch();
+	}
+
+	pPacket = &pQueue->m_batch[pQueue->m_nBatch];
+	pPacket->length = nfq_get_payload(nfa, (char**)&pPacket->data);
+	pPacket->indev = nfq_get_indev(nfa);
+	pPacket->outdev = nfq_get_outdev(nfa);
+	pPacket->id = (ph != NULL) ? ntohl(ph->packet_id) : 0;
+
+	if (pPacket->length < 0) {
+		// nothing to translate, don't let it pass untranslated either
+		nfq_set_verdict(pQueue->m_pQueueHandle, pPacket->id, NF_DROP, 0, NULL);
+	}
+	else if (pPacket->length >= 4 && ((pPacket->data[2] << 8) | pPacket->data[3]) > pPacket->length) {
+		// IP total length beyond the copy, accepting the rewritten part would cut the packet short
+		pQueue->m_nTruncated++;
+		FN_WARN("queue %d: packet %u truncated to %d bytes (%lu truncated)\n", pQueue->m_nQueue, pPacket->id, pPacket->length, pQueue->m_nTruncated);
+		nfq_set_verdict(pQueue->m_pQueueHandle, pPacket->id, NF_DROP, 0, NULL);
+	}
+	else {
+		pQueue->m_nBatch++;
+	}
+
+	return 0;
+}
+
+/**
+* @brief Processes the packets of a received batch
+*
+* @detailed First prefetches the map index slot of every packet, so the cache misses
+* of the whole batch are taken together, then runs each packet through
+* fnCore::processPacket in arrival order.  The drops of the batch are delivered at
+* the end, so no verdict waits for more than one batch.
+*/
+void fnNfqueue::processBatch()
+{
+	fnCore *pCore = fnCore::getInstance();
+	fnState *pState = fnState::getInstance();
+	uint32_t nInternalIfIndex;
+
+	fnOptions::getInstance()->getInternalIfIndex(nInternalIfIndex);
+
+	for (unsigned int i = 0; i < m_nBatch; i++) {
+		nfq_packet &p = m_batch[i];
+		fnPacket packet(p.data, p.length, p.indev, p.id, p.outdev);
+
+		pState->prefetchMap(packet, p.indev == nInternalIfIndex);
+	}
+
+	for (unsigned int i = 0; i < m_nBatch; i++) {
+		nfq_packet &p = m_batch[i];
+		fnPacket packet(p.data, p.length, p.indev, p.id, p.outdev);
+
+		pCore->processPacket(packet, *this, m_pTrace);
+	}
+
+	m_nBatch = 0;
+
+	flushDrops();
+}
+
+/**
+* @brief Delivers the pending drop verdicts
+*
+* @detailed nfq_set_verdict_batch applies to every packet of the queue up to the given
+* id that is still waiting for a verdict.  Packets get their verdicts in the order they
+* were queued and only drops are held back, so those are the pending drops plus any
+* packet whose accept verdict could not be delivered.  Those accepts are sent again
+* first; a packet whose accept fails a second time is dropped with the batch rather
+* than left to hold a queue slot.
+*/
+void fnNfqueue::flushDrops()
+{
+	unsigned int nLost = 0;
+
+	for (unsigned int i = 0; i < m_nFailed; i++) {
+		nfq_packet &p = m_failed[i];
+
+		if (nfq_set_verdict(m_pQueueHandle, p.id, NF_ACCEPT, p.length, p.data) < 0) {
+			nLost++;
+		}
+	}
+
+	if (nLost > 0) {
+		FN_WARN("queue %d: %u accept verdicts not delivered, the packets are dropped\n", m_nQueue, nLost);
+	}
+
+	m_nFailed = 0;
+
+	if (m_nDrops == 0) {
+		return;
+	}
+
+	if (nfq_set_verdict_batch(m_pQueueHandle, m_nDropID, NF_DROP) < 0) {
+		FN_WARN("can't deliver %u drop verdicts\n", m_nDrops);
+	}
+
+	m_nDrops = 0;
+}
+
+/**
+* @brief Returns the rewritten packet to the kernel
+*
+* @detailed A verdict that can't be delivered is retried by flushDrops, before the
+* batch's drop verdict would otherwise drop the packet.  The packet stays in the
+* receive buffer until then.
+*
+* @retval FN_E_FAIL Verdict not delivered yet
+* @retval FN_S_OK Verdict delivered
+*/
+FN_STATUS fnNfqueue::accept(fnPacket &packet)
+{
+	int rv = nfq_set_verdict(m_pQueueHandle, packet.getNetfilterID(), NF_ACCEPT, packet.getLength(), packet.getData());
+
+	if (rv < 0 && m_nFailed < FN_NFQ_BATCH) {
+		nfq_packet &p = m_failed[m_nFailed++];
+
+		p.id = (uint32_t)packet.getNetfilterID();
+		p.data = (unsigned char*)packet.getData();
+		p.length = packet.getLength();
+	}
+
+	return (rv < 0) ? FN_E_FAIL : FN_S_OK;
+}
+
+/**
+* @brief Has the kernel drop the packet
+*
+* @detailed The verdict is held back until the end of the batch, see flushDrops.
+*
+* @retval FN_S_OK Verdict pending
+*/
+FN_STATUS fnNfqueue::drop(fnPacket &packet)
+{
+	uint32_t id = (uint32_t)packet.getNetfilterID();
+
+	// a batch verdict can't reach back across a wrap of the packet ids
+	if (m_nDrops > 0 && id < m_nDropID) {
+		flushDrops();
+	}
+
+	m_nDropID = id;
+	m_nDrops++;
+
+	return FN_S_OK;
+}
+
+/**
+* @brief Sends the rewritten packet from a raw socket and drops the queued original
+*
+* @retval FN_E_FAIL Packet not sent or verdict not delivered
+* @retval FN_S_OK Packet sent
+*/
+FN_STATUS fnNfqueue::transmit(fnPacket &packet)
+{
+	FN_STATUS ret = packet.send();
+
+	if (FAILED(ret))
+	{
+		FN_WARN(" * Send failed\n");
+	}
+
+	if (FAILED(drop(packet)))
+	{
+		ret = FN_E_FAIL;
+	}
+
+	return ret;
+}
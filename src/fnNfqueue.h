@@ -0,0 +1,106 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+
+#ifndef FN_FNNFQUEUE_H // one-time include
+#define FN_FNNFQUEUE_H
+
+extern "C" {
+#include <libnetfilter_queue/libnetfilter_queue.h>
+#include <linux/netfilter.h>
+}
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "fnPacketIO.h"
+
+#define FN_NFQ_BATCH 32			///< netlink messages received per system call
+#define FN_NFQ_COPY_RANGE 0xffff	///< bytes of each packet copied to us, a whole IP packet
+#define FN_NFQ_BUFFER_SIZE (0x10000 + 4096)	///< receive buffer per message, copy range plus netlink and queue headers
+#define FN_NFQ_RCVBUF (8 * 1024 * 1024)	///< queue socket receive buffer
+#define FN_NFQ_MAXLEN 8192		///< packets the kernel holds for the queue before dropping
+
+/**
+* A queued packet, taken out of its netlink message so that it can be processed
+* after the rest of its batch has been received
+*/
+typedef struct _nfq_packet
+{
+	unsigned char*	data;	///< IP header, inside the receive buffer
+	int		length;
+	uint32_t	indev;
+	uint32_t	outdev;
+	uint32_t	id;		///< netfilter packet id, host byte order
+} nfq_packet;
+
+/**
+* Live packet source and sink: one netfilter queue.  Packets are received in
+* batches of up to FN_NFQ_BATCH with one system call, and the map lookups of a
+* whole batch are prefetched before its first packet is processed.  Verdicts are
+* returned to the kernel, packets to be transmitted by us go out through fnTransmit.
+* Drop verdicts are held back and delivered with a single message per batch, which
+* also drops every earlier packet still waiting for a verdict, so accept verdicts
+* that could not be delivered are sent again first.
+*/
+class fnNfqueue : public fnPacketSource, public fnPacketSink
+{
+	public:
+		fnNfqueue(uint16_t queue);
+		virtual ~fnNfqueue();
+
+		FN_STATUS open(bool bBindPF);
+		void close();
+		uint16_t getQueue() const;
+
+		virtual FN_STATUS run(fnTraceRing *pTrace);
+
+		virtual FN_STATUS accept(fnPacket &packet);
+		virtual FN_STATUS drop(fnPacket &packet);
+		virtual FN_STATUS transmit(fnPacket &packet);
+
+	protected:
+		static int callback(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struct nfq_data *nfa, void *data);
+		static bool getTruncatedID(const unsigned char *pMsg, unsigned int nLength, uint32_t &id);
+		void processBatch();
+		void flushDrops();
+
+	private:
+		uint16_t	m_nQueue;	///< netfilter queue number
+		struct nfq_handle*	m_pHandle;
+		struct nfq_q_handle*	m_pQueueHandle;
+		int		m_fd;
+		fnTraceRing*	m_pTrace;	///< ring of the thread running the queue
+		unsigned char*	m_pBuffers;	///< FN_NFQ_BATCH receive buffers of FN_NFQ_BUFFER_SIZE bytes
+		struct iovec	m_iov[FN_NFQ_BATCH];
+		struct mmsghdr	m_msgs[FN_NFQ_BATCH];
+		nfq_packet	m_batch[FN_NFQ_BATCH];
+		unsigned int	m_nBatch;	///< packets waiting in m_batch
+		uint32_t	m_nDropID;	///< highest packet id with a pending drop verdict
+		unsigned int	m_nDrops;	///< drop verdicts not yet delivered
+		nfq_packet	m_failed[FN_NFQ_BATCH];	///< accepts whose verdict was not delivered, retried before the drops
+		unsigned int	m_nFailed;	///< entries in m_failed
+		unsigned long	m_nOverruns;	///< ENOBUFS reported by the queue socket
+		unsigned long	m_nTruncated;	///< messages or packets that did not arrive whole
+};
+
+#endif
@@ -38,11 +38,14 @@ namespace po = boost::program_options;
 using namespace std;
 
 #include <stddef.h>
+#include <arpa/inet.h>
 #include <net/if.h>
 #include <resolv.h>
 #include <sys/ioctl.h>
+#include <unistd.h>
 
 #include "fnOptions.h"
+#include "fnLog.h"
 
 // Ensure that the singleton instance always starts out as NULL.
 fnOptions* fnOptions::s_Instance = NULL;
@@ -56,6 +59,11 @@ fnOptions::fnOptions()
 	
 	m_strInternalInterface = "vmnet2";
 	m_strExternalInterface = "eth0";
+	m_nInternalIfIndex = 0;
+	m_nExternalIfIndex = 0;
+	m_nInternalIP = 0;
+	m_nExternalIP = 0;
+	m_bFixedAddresses = false;
 	m_MappingMethod = MAP_INDEPENDENT;
 	m_FilterMethod = FILTER_INDEPENDENT;
 	m_PortAssignmentMethod = PORT_PRESERVE;
@@ -63,6 +71,22 @@ fnOptions::fnOptions()
 	m_PortParity = PARITY_ENABLED;
 	m_Hairpinning = HAIRPIN_ALLOW;
 	m_ulMappingLifetime = 0;
+	m_TCPLifetimes[TCP_SYN_SENT] = 240;
+	m_TCPLifetimes[TCP_ESTABLISHED] = 7440;
+	m_TCPLifetimes[TCP_FIN_WAIT] = 240;
+	m_TCPLifetimes[TCP_TIME_WAIT] = 10;
+	m_TCPLifetimes[TCP_CLOSED] = 0;
+	m_ICMPLifetime = 60;
+	m_nPortMin = 1024;
+	m_nPortMax = 65535;
+	m_nMaxMaps = 262144;
+	m_nQueueBase = 0;
+	m_nQueues = 1;
+	m_nShards = 0;
+	m_bPinCPUs = false;
+	m_bResend = false;
+	m_nLogLevel = FN_LOG_WARN;
+	m_bReplay = false;
 
 }
 
@@ -126,6 +150,26 @@ FN_STATUS fnOptions::initialize(int argc, char* argv[])
 			("port_parity","Port Parity Enforced")
 			("hairpin","Hairpinning allowed")
 			("map_lifetime", po::value<int>(),"Map Lifetime")
+			("tcp_syn_lifetime", po::value<int>(), "Lifetime of a TCP map until its SYN is answered [240]")
+			("tcp_established_lifetime", po::value<int>(), "Idle lifetime of an established TCP map [7440]")
+			("tcp_fin_lifetime", po::value<int>(), "Lifetime of a TCP map after a FIN in one direction [240]")
+			("tcp_time_wait_lifetime", po::value<int>(), "Lifetime of a TCP map after FINs in both directions [10]")
+			("icmp_lifetime", po::value<int>(), "Idle lifetime of an ICMP query map [60]")
+			("port_min", po::value<int>(), "Lowest external port [1024]")
+			("port_max", po::value<int>(), "Highest external port [65535]")
+			("max_maps", po::value<unsigned int>(), "Maximum number of NAT maps [262144]")
+			("queue", po::value<unsigned int>(), "First netfilter queue number [0]")
+			("queues", po::value<unsigned int>(), "Number of queues, each served by its own thread [1]")
+			("pin_cpus", "Pin each queue thread to its own CPU")
+			("shards", po::value<unsigned int>(), "Number of partitions of the map tables, at most 64 [4 per queue]")
+			("resend", "Send rewritten packets from user space instead of returning them to the kernel")
+			("verbose", po::value<int>(), "Log level, 0 errors, 1 warnings, 2 info, 3 packet decisions, 4 packet dumps [1]")
+			("trace_file", po::value<string>(), "Record every packet's path through the state machine in this file")
+			("replay_inside", po::value<string>(), "Replay this capture as arriving on the inside instead of running on netfilter queues")
+			("replay_outside", po::value<string>(), "Replay this capture as arriving on the outside")
+			("replay_out_inside", po::value<string>(), "Write packets leaving on the inside during a replay to this capture")
+			("replay_out_outside", po::value<string>(), "Write packets leaving on the outside during a replay to this capture")
+			("external_ip", po::value<string>(), "External address used instead of --internal/--external, for replays and benchmarks")
 			;
 			
 		// Parse command line
@@ -144,25 +188,96 @@ FN_STATUS fnOptions::initialize(int argc, char* argv[])
 		{
 			retval = FN_S_OK;
 			
-			if (configuration.count("internal")) 
-			{
-				m_strInternalInterface = configuration["internal"].as<string>();
-			} 
-			else 
+			m_bReplay = configuration.count("replay_inside") || configuration.count("replay_outside");
+
+			if (m_bReplay)
 			{
-				printf("Internal Interface required\n");
-				retval = FN_E_FAIL;
+				if (configuration.count("replay_inside"))
+				{
+					m_strReplayInside = configuration["replay_inside"].as<string>();
+				}
+
+				if (configuration.count("replay_outside"))
+				{
+					m_strReplayOutside = configuration["replay_outside"].as<string>();
+				}
+
+				if (configuration.count("replay_out_inside"))
+				{
+					m_strReplayOutInside = configuration["replay_out_inside"].as<string>();
+				}
+
+				if (configuration.count("replay_out_outside"))
+				{
+					m_strReplayOutOutside = configuration["replay_out_outside"].as<string>();
+				}
 			}
 
-			if (configuration.count("external"))
+			if (configuration.count("external_ip"))
 			{
-				m_strExternalInterface = configuration["external"].as<string>();
+				struct in_addr addr;
+
+				// no interfaces are needed, packets are presented on made up indexes
+				m_nInternalIfIndex = FN_REPLAY_INTERNAL_IFINDEX;
+				m_nExternalIfIndex = FN_REPLAY_EXTERNAL_IFINDEX;
+				m_bFixedAddresses = true;
+
+				if (inet_aton(configuration["external_ip"].as<string>().c_str(), &addr) == 0)
+				{
+					printf("Invalid external_ip %s\n", configuration["external_ip"].as<string>().c_str());
+					retval = FN_E_FAIL;
+				}
+				else
+				{
+					m_nExternalIP = ntohl(addr.s_addr);
+				}
 			}
-			else
+			else if (m_bReplay)
 			{
-				printf("External Interface required\n");
+				printf("External IP required for a replay\n");
 				retval = FN_E_FAIL;
 			}
+			else
+			{
+				if (configuration.count("internal")) 
+				{
+					m_strInternalInterface = configuration["internal"].as<string>();
+					m_nInternalIfIndex = if_nametoindex(m_strInternalInterface.c_str());
+				
+					if (m_nInternalIfIndex == 0)
+					{
+						printf("Unknown internal interface %s\n", m_strInternalInterface.c_str());
+						retval = FN_E_FAIL;
+					}
+				} 
+				else 
+				{
+					printf("Internal Interface required\n");
+					retval = FN_E_FAIL;
+				}
+
+				if (configuration.count("external"))
+				{
+					m_strExternalInterface = configuration["external"].as<string>();
+					m_nExternalIfIndex = if_nametoindex(m_strExternalInterface.c_str());
+				
+					if (m_nExternalIfIndex == 0)
+					{
+						printf("Unknown external interface %s\n", m_strExternalInterface.c_str());
+						retval = FN_E_FAIL;
+					}
+				}
+				else
+				{
+					printf("External Interface required\n");
+					retval = FN_E_FAIL;
+				}
+			
+				if (SUCCEEDED(retval))
+				{
+					refreshInterfaces();
+				}
+			}
 
 			if (configuration.count("port_parity"))
 			{
@@ -187,6 +302,132 @@ FN_STATUS fnOptions::initialize(int argc, char* argv[])
 				m_ulMappingLifetime = configuration["map_lifetime"].as<int>();
 			}
 
+			if (configuration.count("tcp_syn_lifetime"))
+			{
+				m_TCPLifetimes[TCP_SYN_SENT] = configuration["tcp_syn_lifetime"].as<int>();
+			}
+
+			if (configuration.count("tcp_established_lifetime"))
+			{
+				m_TCPLifetimes[TCP_ESTABLISHED] = configuration["tcp_established_lifetime"].as<int>();
+			}
+
+			if (configuration.count("tcp_fin_lifetime"))
+			{
+				m_TCPLifetimes[TCP_FIN_WAIT] = configuration["tcp_fin_lifetime"].as<int>();
+			}
+
+			if (configuration.count("tcp_time_wait_lifetime"))
+			{
+				m_TCPLifetimes[TCP_TIME_WAIT] = configuration["tcp_time_wait_lifetime"].as<int>();
+			}
+
+			if (configuration.count("icmp_lifetime"))
+			{
+				m_ICMPLifetime = configuration["icmp_lifetime"].as<int>();
+			}
+
+			if (configuration.count("port_min"))
+			{
+				int port = configuration["port_min"].as<int>();
+				
+				if (port < 1 || port > 65535)
+				{
+					printf("Invalid port_min: [1-65535]\n");
+					retval = FN_E_FAIL;
+				}
+				else
+				{
+					m_nPortMin = port;
+				}
+			}
+
+			if (configuration.count("port_max"))
+			{
+				int port = configuration["port_max"].as<int>();
+				
+				if (port < 1 || port > 65535)
+				{
+					printf("Invalid port_max: [1-65535]\n");
+					retval = FN_E_FAIL;
+				}
+				else
+				{
+					m_nPortMax = port;
+				}
+			}
+			
+			if (m_nPortMin > m_nPortMax)
+			{
+				printf("port_min must not be greater than port_max\n");
+				retval = FN_E_FAIL;
+			}
+
+			if (configuration.count("max_maps"))
+			{
+				m_nMaxMaps = configuration["max_maps"].as<unsigned int>();
+			}
+
+			if (configuration.count("queue"))
+			{
+				m_nQueueBase = configuration["queue"].as<unsigned int>();
+			}
+
+			if (configuration.count("queues"))
+			{
+				m_nQueues = configuration["queues"].as<unsigned int>();
+			}
+
+			if (m_nQueues < 1 || m_nQueueBase + m_nQueues > 65536)
+			{
+				printf("Invalid queue range\n");
+				retval = FN_E_FAIL;
+			}
+
+			if (configuration.count("pin_cpus"))
+			{
+				m_bPinCPUs = true;
+			}
+
+			if (configuration.count("resend"))
+			{
+				m_bResend = true;
+			}
+
+			if (configuration.count("verbose"))
+			{
+				m_nLogLevel = configuration["verbose"].as<int>();
+
+				if (m_nLogLevel < FN_LOG_ERROR || m_nLogLevel > FN_LOG_TRACE)
+				{
+					printf("verbose must be between %d and %d\n", FN_LOG_ERROR, FN_LOG_TRACE);
+					retval = FN_E_FAIL;
+				}
+				else if (m_nLogLevel > FN_LOG_MAX_LEVEL)
+				{
+					printf("Log level %d is not compiled in, messages above level %d are not available\n",
+						m_nLogLevel, FN_LOG_MAX_LEVEL);
+				}
+
+				fnLogSetLevel(m_nLogLevel);
+			}
+
+			if (configuration.count("trace_file"))
+			{
+				m_strTraceFile = configuration["trace_file"].as<string>();
+			}
+
+			if (configuration.count("shards"))
+			{
+				m_nShards = configuration["shards"].as<unsigned int>();
+
+				if (m_nShards < 1 || m_nShards > 64)
+				{
+					printf("shards must be between 1 and 64\n");
+					retval = FN_E_FAIL;
+				}
+			}
+
 
 			if (configuration.count("filter_method"))
 			{
@@ -304,7 +545,7 @@ FN_STATUS fnOptions::getInternalInterface(std::string &interface)
 /**
  * @brief Provides the ip address of the internal interface
  * 
- * @param ip [OUT] Internal IP address 
+ * @param ip [OUT] Internal IP address, 0 if the interface has none
  * 
  * @return Success or failure
  * 
@@ -312,18 +553,9 @@ FN_STATUS fnOptions::getInternalInterface(std::string &interface)
  */
 FN_STATUS fnOptions::getInternalIP(uint32_t &ip)
 {
-	FN_STATUS retval = FN_E_UNDEFINED;
-
-	int fd;
-	struct ifreq ifr; 
-	struct sockaddr_in saddr;
+	FN_STATUS retval = FN_S_OK;
 
-	fd=socket(PF_INET,SOCK_STREAM,0);
-	strcpy(ifr.ifr_name,m_strInternalInterface.c_str());
-	ioctl(fd,SIOCGIFADDR,&ifr);
-	saddr=*((struct sockaddr_in *)(&(ifr.ifr_addr))); /* is the address */
-	
-	ip = ntohl(saddr.sin_addr.s_addr);
+	ip = __atomic_load_n(&m_nInternalIP, __ATOMIC_RELAXED);
 
 	return retval;
 }
@@ -331,7 +563,7 @@ FN_STATUS fnOptions::getInternalIP(uint32_t &ip)
 /**
  * @brief Provides the ip address of the external interface
  *
- * @param ip [OUT] External IP address
+ * @param ip [OUT] External IP address, 0 if the interface has none
  *
  * @return Success or failure
  *
@@ -339,19 +571,68 @@ FN_STATUS fnOptions::getInternalIP(uint32_t &ip)
  */
 FN_STATUS fnOptions::getExternalIP(uint32_t &ip)
 {
-	FN_STATUS retval = FN_E_UNDEFINED;
+	FN_STATUS retval = FN_S_OK;
+
+	ip = __atomic_load_n(&m_nExternalIP, __ATOMIC_RELAXED);
+
+	return retval;
+}
 
+/**
+ * @brief Looks up the index and address of both interfaces again
+ *
+ * @detailed Called once the options are parsed and by fnLinkMonitor whenever the
+ *			kernel reports an address or link change, so the getters only read
+ *			memory.  An interface that is gone or has no IPv4 address reads as 0
+ *			until it comes back.  Nothing is looked up when the addresses were
+ *			given with --external_ip.
+ *
+ * @return Success or failure
+ *
+ * @retval FN_E_FAIL No socket for the address queries
+ * @retval FN_S_OK success
+ */
+FN_STATUS fnOptions::refreshInterfaces()
+{
+	FN_STATUS retval = FN_S_OK;
+	const std::string *pNames[2] = { &m_strInternalInterface, &m_strExternalInterface };
+	volatile uint32_t *pIfIndexes[2] = { &m_nInternalIfIndex, &m_nExternalIfIndex };
+	volatile uint32_t *pAddresses[2] = { &m_nInternalIP, &m_nExternalIP };
 	int fd;
-	struct ifreq ifr; 
-	struct sockaddr_in saddr;
 
-	fd=socket(PF_INET,SOCK_STREAM,0);
-	strcpy(ifr.ifr_name,m_strExternalInterface.c_str());
-	ioctl(fd,SIOCGIFADDR,&ifr);
-	saddr=*((struct sockaddr_in *)(&(ifr.ifr_addr))); /* is the address */
-	
-	ip = ntohl(saddr.sin_addr.s_addr);
+	if (m_bFixedAddresses)
+	{
+		return retval;
+	}
+
+	fd = socket(PF_INET, SOCK_DGRAM, 0);
+
+	if (fd < 0)
+	{
+		printf("fnOptions::refreshInterfaces: no socket for address queries\n");
+		retval = FN_E_FAIL;
+	}
+	else
+	{
+		for (int i = 0; i < 2; i++)
+		{
+			struct ifreq ifr;
+			uint32_t ip = 0;
+
+			memset(&ifr, 0, sizeof(ifr));
+			strncpy(ifr.ifr_name, pNames[i]->c_str(), IFNAMSIZ - 1);
+
+			if (ioctl(fd, SIOCGIFADDR, &ifr) == 0)
+			{
+				ip = ntohl(((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr.s_addr);
+			}
+
+			__atomic_store_n(pIfIndexes[i], if_nametoindex(pNames[i]->c_str()), __ATOMIC_RELAXED);
+			__atomic_store_n(pAddresses[i], ip, __ATOMIC_RELAXED);
+		}
 
+		close(fd);
+	}
 
 	return retval;
 }
@@ -374,6 +655,60 @@ FN_STATUS fnOptions::getExternalInterface(std::string &interface)
 	return retval;
 }
 
+/**
+ * @brief Provides the kernel interface index of the internal interface
+ *
+ * @param ifindex [OUT] Interface index, kept current by refreshInterfaces
+ *
+ * @return Success or failure
+ *
+ * @retval FN_S_OK success
+ */
+FN_STATUS fnOptions::getInternalIfIndex(uint32_t &ifindex)
+{
+	FN_STATUS retval = FN_S_OK;
+
+	ifindex = __atomic_load_n(&m_nInternalIfIndex, __ATOMIC_RELAXED);
+
+	return retval;
+}
+
+/**
+ * @brief Provides the kernel interface index of the external interface
+ *
+ * @param ifindex [OUT] Interface index, kept current by refreshInterfaces
+ *
+ * @return Success or failure
+ *
+ * @retval FN_S_OK success
+ */
+FN_STATUS fnOptions::getExternalIfIndex(uint32_t &ifindex)
+{
+	FN_STATUS retval = FN_S_OK;
+
+	ifindex = __atomic_load_n(&m_nExternalIfIndex, __ATOMIC_RELAXED);
+
+	return retval;
+}
+
+/**
+ * @brief Reports whether the addresses were given with --external_ip
+ *
+ * @param fixed [OUT] true if the interface indexes and addresses never change
+ *
+ * @return Success or failure
+ *
+ * @retval FN_S_OK success
+ */
+FN_STATUS fnOptions::getFixedAddresses(bool &fixed)
+{
+	FN_STATUS retval = FN_S_OK;
+
+	fixed = m_bFixedAddresses;
+
+	return retval;
+}
+
 /**
  * @brief Provides the mapping method in use
  *
@@ -498,6 +833,267 @@ FN_STATUS fnOptions::getMappingLifetime(time_t &lifetime)
 	return retval;
 }
 
+/**
+ * @brief Provides how long an idle TCP map lives in a connection state
+ *
+ * @param state [IN] Connection state
+ * @param lifetime [OUT] Lifetime in seconds
+ *
+ * @return Success or failure
+ *
+ * @retval FN_E_FAIL Unknown state
+ * @retval FN_S_OK success
+ */
+FN_STATUS fnOptions::getTCPLifetime(TCP_STATE state, time_t &lifetime)
+{
+	FN_STATUS retval = FN_S_OK;
+
+	if (state < TCP_STATE_COUNT)
+	{
+		lifetime = m_TCPLifetimes[state];
+	}
+	else
+	{
+		lifetime = 0;
+		retval = FN_E_FAIL;
+	}
+
+	return retval;
+}
+
+/**
+ * @brief Provides how long an idle ICMP query map lives
+ *
+ * @param lifetime [OUT] Lifetime in seconds
+ *
+ * @return Success or failure
+ *
+ * @retval FN_S_OK success
+ */
+FN_STATUS fnOptions::getICMPLifetime(time_t &lifetime)
+{
+	FN_STATUS retval = FN_S_OK;
+
+	lifetime = m_ICMPLifetime;
+
+	return retval;
+}
+
+
+
+
+
+/**
+ * @brief Provides the range of external ports that may be assigned
+ *
+ * @param low [OUT] Lowest port
+ * @param high [OUT] Highest port
+ *
+ * @return Success or failure
+ *
+ * @retval FN_S_OK success
+ */
+FN_STATUS fnOptions::getPortRange(uint16_t &low, uint16_t &high)
+{
+	FN_STATUS retval = FN_S_OK;
+
+	low = m_nPortMin;
+	high = m_nPortMax;
+
+	return retval;
+}
+
+/**
+ * @brief Provides the maximum number of NAT maps that may exist at once
+ *
+ * @param max [OUT] Maximum number of maps
+ *
+ * @return Success or failure
+ *
+ * @retval FN_S_OK success
+ */
+FN_STATUS fnOptions::getMaxMaps(unsigned int &max)
+{
+	FN_STATUS retval = FN_S_OK;
+
+	max = m_nMaxMaps;
+
+	return retval;
+}
+
+/**
+ * @brief Provides the netfilter queues to be served
+ *
+ * @param base [OUT] First queue number
+ * @param count [OUT] Number of consecutive queues, one thread each
+ *
+ * @return Success or failure
+ *
+ * @retval FN_S_OK success
+ */
+FN_STATUS fnOptions::getQueues(unsigned int &base, unsigned int &count)
+{
+	FN_STATUS retval = FN_S_OK;
+
+	base = m_nQueueBase;
+	count = m_nQueues;
+
+	return retval;
+}
+
+/**
+ * @brief Returns if queue threads should be pinned to CPUs
+ *
+ * @param pin [OUT] true to pin each thread to its own CPU
+ *
+ * @return Success or failure
+ *
+ * @retval FN_S_OK success
+ */
+FN_STATUS fnOptions::getCPUPinning(bool &pin)
+{
+	FN_STATUS retval = FN_S_OK;
+
+	pin = m_bPinCPUs;
+
+	return retval;
+}
+
+/**
+ * @brief Provides the number of partitions of the map tables
+ *
+ * @detailed Unless configured, four per queue thread (at most 64) so that threads
+ *			rarely wait on each other's shard locks.
+ *
+ * @param shards [OUT] Number of shards
+ *
+ * @return Success or failure
+ *
+ * @retval FN_S_OK success
+ */
+FN_STATUS fnOptions::getShards(unsigned int &shards)
+{
+	FN_STATUS retval = FN_S_OK;
+
+	shards = m_nShards;
+
+	if (shards == 0)
+	{
+		shards = m_nQueues * 4 < 64 ? m_nQueues * 4 : 64;
+	}
+
+	return retval;
+}
+
+/**
+ * @brief Returns how rewritten packets are sent on
+ *
+ * @param resend [OUT] true to send a new copy through a raw socket and drop the
+ *			original, false to hand the rewritten packet back with the verdict
+ *
+ * @return Success or failure
+ *
+ * @retval FN_S_OK success
+ */
+FN_STATUS fnOptions::getResend(bool &resend)
+{
+	FN_STATUS retval = FN_S_OK;
+
+	resend = m_bResend;
+
+	return retval;
+}
+
+/**
+ * @brief Provides the highest level of messages printed
+ *
+ * @param level [OUT] FN_LOG_ERROR to FN_LOG_TRACE
+ *
+ * @return Success or failure
+ *
+ * @retval FN_S_OK success
+ */
+FN_STATUS fnOptions::getLogLevel(int &level)
+{
+	FN_STATUS retval = FN_S_OK;
+
+	level = m_nLogLevel;
+
+	return retval;
+}
+
+/**
+ * @brief Provides the file packet traces are written to
+ *
+ * @param path [OUT] Trace file, empty if tracing is off
+ *
+ * @return Success or failure
+ *
+ * @retval FN_S_OK success
+ */
+FN_STATUS fnOptions::getTraceFile(std::string &path)
+{
+	FN_STATUS retval = FN_S_OK;
+
+	path = m_strTraceFile;
+
+	return retval;
+}
+
+/**
+ * @brief Returns if packets are replayed from capture files
+ *
+ * @param replay [OUT] true when replaying
+ *
+ * @return Success or failure
+ *
+ * @retval FN_S_OK success
+ */
+FN_STATUS fnOptions::getReplay(bool &replay)
+{
+	FN_STATUS retval = FN_S_OK;
+
+	replay = m_bReplay;
+
+	return retval;
+}
+
+/**
+ * @brief Provides the capture files replayed on each side
+ *
+ * @param inside [OUT] Capture arriving on the inside, empty if none
+ * @param outside [OUT] Capture arriving on the outside, empty if none
+ *
+ * @return Success or failure
+ *
+ * @retval FN_S_OK success
+ */
+FN_STATUS fnOptions::getReplayInput(std::string &inside, std::string &outside)
+{
+	FN_STATUS retval = FN_S_OK;
+
+	inside = m_strReplayInside;
+	outside = m_strReplayOutside;
+
+	return retval;
+}
 
+/**
+ * @brief Provides the capture files receiving the packets leaving each side during a replay
+ *
+ * @param inside [OUT] Capture of packets leaving on the inside, empty if not written
+ * @param outside [OUT] Capture of packets leaving on the outside, empty if not written
+ *
+ * @return Success or failure
+ *
+ * @retval FN_S_OK success
+ */
+FN_STATUS fnOptions::getReplayOutput(std::string &inside, std::string &outside)
+{
+	FN_STATUS retval = FN_S_OK;
 
+	inside = m_strReplayOutInside;
+	outside = m_strReplayOutOutside;
 
+	return retval;
+}
@@ -26,6 +26,10 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <string>
 #include "fn_error.h"
 
+// Interface indexes packets are presented on when running without interfaces (--external_ip)
+#define FN_REPLAY_INTERNAL_IFINDEX 0x7FFF0001
+#define FN_REPLAY_EXTERNAL_IFINDEX 0x7FFF0002
+
 
 typedef enum _MAPPING_METHOD
 {
@@ -68,6 +72,16 @@ typedef enum _HAIRPIN
 	HAIRPIN_DISABLE
 } HAIRPIN;
 
+typedef enum _TCP_STATE
+{
+	TCP_SYN_SENT,		// SYN seen from the inside only
+	TCP_ESTABLISHED,	// SYN answered
+	TCP_FIN_WAIT,		// FIN seen in one direction
+	TCP_TIME_WAIT,		// FIN seen in both directions
+	TCP_CLOSED,			// reset, the map is removed at once
+	TCP_STATE_COUNT,
+} TCP_STATE;
+
 class fnOptions
 {
    public:
@@ -80,6 +94,9 @@ class fnOptions
 		FN_STATUS getInternalIP(uint32_t &ip);
 		FN_STATUS getExternalIP(uint32_t &ip);
 		FN_STATUS getExternalInterface(std::string &interface); 
+		FN_STATUS getInternalIfIndex(uint32_t &ifindex);
+		FN_STATUS getExternalIfIndex(uint32_t &ifindex);
+		FN_STATUS getFixedAddresses(bool &fixed);
 		FN_STATUS getMappingMethod(MAPPING_METHOD &method);
 		FN_STATUS getFilterMethod(FILTER_METHOD &method);
 		FN_STATUS getPortAssigmentMethod(PORT_ASSIGNMENT_METHOD &method);
@@ -87,6 +104,21 @@ class fnOptions
 		FN_STATUS getPortParity(PORT_PARITY &parity);
 		FN_STATUS getMappingLifetime(time_t &lifetime);
 		FN_STATUS getHairpinning(HAIRPIN & hairpin);
+		FN_STATUS getPortRange(uint16_t &low, uint16_t &high);
+		FN_STATUS getMaxMaps(unsigned int &max);
+		FN_STATUS getQueues(unsigned int &base, unsigned int &count);
+		FN_STATUS getCPUPinning(bool &pin);
+		FN_STATUS getShards(unsigned int &shards);
+		FN_STATUS getResend(bool &resend);
+		FN_STATUS getTCPLifetime(TCP_STATE state, time_t &lifetime);
+		FN_STATUS getICMPLifetime(time_t &lifetime);
+		FN_STATUS getLogLevel(int &level);
+		FN_STATUS getTraceFile(std::string &path);
+		FN_STATUS getReplay(bool &replay);
+		FN_STATUS getReplayInput(std::string &inside, std::string &outside);
+		FN_STATUS getReplayOutput(std::string &inside, std::string &outside);
+		
+		FN_STATUS refreshInterfaces();
 		       	
     protected:
     	fnOptions(); ///< Protected constructor prevents creation of object my non-members
@@ -97,6 +129,11 @@ class fnOptions
 		
 		std::string m_strInternalInterface;
 		std::string m_strExternalInterface;
+		volatile uint32_t m_nInternalIfIndex;
+		volatile uint32_t m_nExternalIfIndex;
+		volatile uint32_t m_nInternalIP;	///< cached by refreshInterfaces, host byte order
+		volatile uint32_t m_nExternalIP;
+		bool m_bFixedAddresses;	///< --external_ip given, refreshInterfaces leaves the above alone
 		MAPPING_METHOD m_MappingMethod;
 		FILTER_METHOD m_FilterMethod;
 		PORT_ASSIGNMENT_METHOD m_PortAssignmentMethod;
@@ -104,6 +141,23 @@ class fnOptions
 		PORT_PARITY m_PortParity;
 		HAIRPIN m_Hairpinning;
 		time_t m_ulMappingLifetime;
+		time_t m_TCPLifetimes[TCP_STATE_COUNT];
+		time_t m_ICMPLifetime;
+		uint16_t m_nPortMin;
+		uint16_t m_nPortMax;
+		unsigned int m_nMaxMaps;
+		unsigned int m_nQueueBase;
+		unsigned int m_nQueues;
+		unsigned int m_nShards;	///< 0 picks a default from the queue count
+		bool m_bPinCPUs;
+		bool m_bResend;
+		int m_nLogLevel;
+		std::string m_strTraceFile;	///< empty when not tracing
+		bool m_bReplay;	///< packets come from capture files instead of netfilter queues
+		std::string m_strReplayInside;
+		std::string m_strReplayOutside;
+		std::string m_strReplayOutInside;
+		std::string m_strReplayOutOutside;
 	
 		
 		
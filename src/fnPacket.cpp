@@ -23,10 +23,12 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <stdio.h>
-#include <libnet.h>
 
 
 #include "fnPacket.h"
+#include "fnTransmit.h"
+#include "fnChecksum.h"
+#include "fnLog.h"
 
 
 /**
@@ -39,33 +41,43 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 fnPacket::fnPacket(struct nfq_data *nfa)
 {
+	struct nfqnl_msg_packet_hdr *ph;
+	
 	m_nfData = nfa;
-	u_int32_t ifi;
-	char	buf[IF_NAMESIZE];
 
 	m_nPacketDataLen = nfq_get_payload(m_nfData, (char**)&m_pPacketData);
 
+	m_nInboundIfIndex = nfq_get_indev(m_nfData);
+	m_nOutboundIfIndex = nfq_get_outdev(m_nfData);
+	m_nRoutedIfIndex = m_nOutboundIfIndex;
 	
-	ifi = nfq_get_indev(m_nfData);
-	if (ifi)
-	{
-		if (if_indextoname(ifi, buf))
-		{
-			m_strInboundInterface.clear();
-			m_strInboundInterface = buf;
-		}
-	}
-
-	ifi = nfq_get_outdev(m_nfData);
-	if (ifi)
-	{
-		if (if_indextoname(ifi, buf))
-		{
-			m_strOutboundInterface.clear();
-			m_strOutboundInterface = buf;
-		}
-	}
+	ph = nfq_get_msg_packet_hdr(m_nfData);
+	m_nID = (ph != NULL) ? ntohl(ph->packet_id) : 0;
+}
 
+/**
+* @brief Constructor for fnPacket class
+* 
+* @detailed Creates a packet object over a buffer holding an IPv4 packet, e.g. one read
+*			from a capture file.  The buffer is rewritten in place and must outlive the
+*			object.
+* 
+* @param pData [IN] Packet, starting with its IP header
+* @param nLength [IN] Length of the packet
+* @param nInboundIfIndex [IN] Interface the packet arrived on
+* @param nID [IN] Identifier of the packet, reported by getNetfilterID
+* @param nRoutedIfIndex [IN] Egress chosen by the kernel before queueing, 0 if none yet
+*/
+fnPacket::fnPacket(unsigned char *pData, int nLength, uint32_t nInboundIfIndex, uint32_t nID, uint32_t nRoutedIfIndex)
+{
+	m_nfData = NULL;
+	m_pPacketData = (rawPacket*)pData;
+	m_nPacketDataLen = nLength;
+	
+	m_nInboundIfIndex = nInboundIfIndex;
+	m_nOutboundIfIndex = nRoutedIfIndex;
+	m_nRoutedIfIndex = nRoutedIfIndex;
+	m_nID = nID;
 }
 
 /**
@@ -89,22 +101,14 @@ fnPacket::~fnPacket()
 
 const int fnPacket::getNetfilterID() const
 {
-	int id = 0;
-	struct nfqnl_msg_packet_hdr *ph;
-		
-	ph = nfq_get_msg_packet_hdr(m_nfData);
-	if (ph)
-	{
-		id = ntohl(ph->packet_id);
-	}
-	
-	return id;
+	return m_nID;
 }
 
 /**
 * @brief The send function sends the packet based on its internal information
 * 
-* @detailed The packet is sent out of its outbound interface
+* @detailed The packet is sent out of its outbound interface as it is, without
+*			rebuilding its IP header, through the interface's long-lived raw socket.
 * 
 * @return Status of packet send.
 *
@@ -115,95 +119,23 @@ const int fnPacket::getNetfilterID() const
 
 FN_STATUS fnPacket::send()
 {
-	FN_STATUS ret = FN_E_UNDEFINED;
-	libnet_t *l;
-    char errbuf[LIBNET_ERRBUF_SIZE];
-    libnet_ptag_t ip_ptag = 0;
-    int count;
-    std::string strOutboundInterface;
-    
-    l = libnet_init(LIBNET_RAW4,(char*)m_strOutboundInterface.c_str(),errbuf);
-
-    if (l == NULL)
-    {
-        fprintf(stderr, "libnet_init() failed: %s", errbuf);
-        ret = FN_E_FAIL;
-    }
-    else
-    {
-    	//printf("Sending out %s\n",m_strOutboundInterface.c_str());
-    	ret = FN_S_OK;
-    }
-
-
-	if (SUCCEEDED(ret))
-	{
-		// Build packet
-		
-		// Advance pointer past any options headers.
-		unsigned char* pData = (m_pPacketData->data) + this->getPacketHeaderLength() - LIBNET_IPV4_H;
-		
-		ip_ptag = libnet_build_ipv4(
-			LIBNET_IPV4_H + ntohs(m_pPacketData->nPacketLength) - this->getPacketHeaderLength(),                  /* length */
-			m_pPacketData->flagsTOS,		/* TOS */
-			this->getFragmentID(),			/* IP fragment ID */
-			this->getFragmentFlags(),		/* IP Frag flags*/
-			m_pPacketData->TTL,				/* TTL */
-			m_pPacketData->nProtocol,		/* protocol */
-			0,								/* checksum (let libnet calculate) */
-			m_pPacketData->srcIP.raw,		/* source IP */
-			m_pPacketData->dstIP.raw,		/* destination IP */
-			pData,							/* payload */
-			ntohs(m_pPacketData->nPacketLength) - this->getPacketHeaderLength(),                                  /* payload size */
-			l,								/* libnet handle */
-			ip_ptag);						/* libnet id */
-			
-			
-		if (ip_ptag == -1)
-		{
-			fprintf(stderr, "Can't build IP header: %s\n", libnet_geterror(l));
-			ret = FN_E_FAIL;
-		}
-		else
-		{
-			ret = FN_S_OK;
-		}
-		
-		// TODO: Add IP options (if any)
-		
-	
-		if (SUCCEEDED(ret))
-		{
-			// Write to network
-			
-			count = libnet_write(l);
-			if (count == -1)
-			{
-				fprintf(stderr, "Write error: %s\n", libnet_geterror(l));
-				ret = FN_E_FAIL;
-			}
-			else
-			{
-			//	fprintf(stderr, "Wrote %d byte IP packet\n", count);
-				ret = FN_S_OK;
-
-			}
-		}
-		
-	
-		libnet_destroy(l);
-	}
-
-	return ret;
+	return fnTransmit::getInstance()->send(m_nOutboundIfIndex, (const unsigned char*)m_pPacketData,
+		ntohs(m_pPacketData->nPacketLength));
 }
 
 /**
 * @brief Debug function that prvides a text dump of the packet.
+* 
+* @detailed Printed at FN_LOG_TRACE.  Callers check FN_LOG_ENABLED first, since looking
+*			up the interface names costs system calls even when nothing is printed.
 */
-void fnPacket::dump()
+void fnPacket::dump() const
 {
-	printf("\tInbound interface: %s\n",m_strInboundInterface.c_str());
-	printf("\tOutbound interface: %s\n",m_strOutboundInterface.c_str());
+#if FN_LOG_MAX_LEVEL >= FN_LOG_TRACE
+	char ifname[IF_NAMESIZE];
+	
+	FN_TRACE("\tInbound interface: %s\n",if_indextoname(m_nInboundIfIndex, ifname) ? ifname : "");
+	FN_TRACE("\tOutbound interface: %s\n",if_indextoname(m_nOutboundIfIndex, ifname) ? ifname : "");
 //	printf("\n");
 	
 //	printf("\tPacket Version: %d\n",(m_pPacketData->nVersionLength & 0xF0 ) >> 4);
@@ -213,13 +145,13 @@ void fnPacket::dump()
 //	printf("\tPacket Length: %d\n",ntohs(m_pPacketData->nPacketLength));
 
 	// TODO: these two printfs will break if Network order != Host order
-	printf("\tSource IP: %d.%d.%d.%d\n",
+	FN_TRACE("\tSource IP: %d.%d.%d.%d\n",
 		m_pPacketData->srcIP.octet[0],
 		m_pPacketData->srcIP.octet[1],
 		m_pPacketData->srcIP.octet[2],
 		m_pPacketData->srcIP.octet[3]);
 	
-	printf("\tDestination IP: %d.%d.%d.%d\n",
+	FN_TRACE("\tDestination IP: %d.%d.%d.%d\n",
 		m_pPacketData->dstIP.octet[0],
 		m_pPacketData->dstIP.octet[1],
 		m_pPacketData->dstIP.octet[2],
@@ -227,39 +159,39 @@ void fnPacket::dump()
 		
 	if (this->getProtocol() == PROTO_ICMP)
 	{
-		printf("\tICMP Packet\n");
+		FN_TRACE("\tICMP Packet\n");
 	}
 	else if (this->getProtocol() == PROTO_UDP)
 	{
 //		printf("\tUDP Packet\n");
 
-		unsigned char* pData = (m_pPacketData->data) + this->getPacketHeaderLength() - LIBNET_IPV4_H;
+		unsigned char* pData = (m_pPacketData->data) + this->getPacketHeaderLength() - FN_IPV4_H;
 		udpPacket* udp = (udpPacket*)pData;
 		
-		printf("\tUDP Source Port: %d\n",ntohs(udp->srcPort));
-		printf("\tUDP Destination Port: %d\n",ntohs(udp->dstPort));
+		FN_TRACE("\tUDP Source Port: %d\n",ntohs(udp->srcPort));
+		FN_TRACE("\tUDP Destination Port: %d\n",ntohs(udp->dstPort));
 		
-		calcUDPchecksum();
 
 	}
 	else if (this->getProtocol() == PROTO_TCP)
 	{
 //		printf("\tTCP Packet\n");
 		
-		unsigned char* pData = (m_pPacketData->data) + this->getPacketHeaderLength() - LIBNET_IPV4_H;
+		unsigned char* pData = (m_pPacketData->data) + this->getPacketHeaderLength() - FN_IPV4_H;
 		tcpPacket* tcp = (tcpPacket*)pData;
 		
-		printf("\tTCP Source Port: %d\n",ntohs(tcp->srcPort));
-		printf("\tTCP Destination Port: %d\n",ntohs(tcp->dstPort));
+		FN_TRACE("\tTCP Source Port: %d\n",ntohs(tcp->srcPort));
+		FN_TRACE("\tTCP Destination Port: %d\n",ntohs(tcp->dstPort));
 	}
 	else
 	{
-		printf("\tUnknown Protocol\n");
+		FN_TRACE("\tUnknown Protocol\n");
 	}
 	
 		
 	//printf("L3 data\n");
 	//this->dumpMem(m_pPacketData->data,ntohs(m_pPacketData->nPacketLength) - this->getPacketHeaderLength());
+#endif
 }
 
 /**
@@ -270,6 +202,7 @@ void fnPacket::dump()
 * @return Status of packet info.
 *
 * @retval FN_E_INVALID_PROTOCOL Invalid protocol requested
+* @retval FN_E_PACKET_TRUNCATED The IP or ICMP header is incomplete
 * @retval FN_S_OK Data set
 
 */
@@ -277,10 +210,19 @@ FN_STATUS fnPacket::getPacketTuple(icmp_packet_tuple &tuple) const
 {
 	FN_STATUS ret = FN_E_INVALID_PROTOCOL;
 	
-	if (this->getProtocol() == PROTO_ICMP)
+	if (this->getProtocol() == PROTO_ICMP && !hasTransportHeader(sizeof(icmpPacket)))
+	{
+		ret = FN_E_PACKET_TRUNCATED;
+	}
+	else if (this->getProtocol() == PROTO_ICMP)
 	{
+		unsigned char* pData = (m_pPacketData->data) + this->getPacketHeaderLength() - FN_IPV4_H;
+		icmpPacket* icmp = (icmpPacket*)pData;
+
 		tuple.src_ip = this->getSourceIP();
 		tuple.dest_ip = this->getDestinationIP();
+		tuple.id = this->isICMPQuery() ? ntohs(icmp->nID) : 0;
+		tuple.reserved = 0;
 		
 		ret = FN_S_OK;
 	}
@@ -296,6 +238,7 @@ FN_STATUS fnPacket::getPacketTuple(icmp_packet_tuple &tuple) const
 * @return Status of packet info.
 *
 * @retval FN_E_INVALID_PROTOCOL Invalid protocol requested
+* @retval FN_E_PACKET_TRUNCATED The IP or UDP header is incomplete
 * @retval FN_S_OK Data set
 
 */
@@ -304,9 +247,13 @@ FN_STATUS fnPacket::getPacketTuple(udp_packet_tuple &tuple) const
 	FN_STATUS ret = FN_E_INVALID_PROTOCOL;
 
 	
-	if (this->getProtocol() == PROTO_UDP)
+	if (this->getProtocol() == PROTO_UDP && !hasTransportHeader(sizeof(udpPacket)))
+	{
+		ret = FN_E_PACKET_TRUNCATED;
+	}
+	else if (this->getProtocol() == PROTO_UDP)
 	{
-		unsigned char* pData = (m_pPacketData->data) + this->getPacketHeaderLength() - LIBNET_IPV4_H;
+		unsigned char* pData = (m_pPacketData->data) + this->getPacketHeaderLength() - FN_IPV4_H;
 		udpPacket* udp = (udpPacket*)pData;
 
 		tuple.src_ip = this->getSourceIP();
@@ -328,6 +275,7 @@ FN_STATUS fnPacket::getPacketTuple(udp_packet_tuple &tuple) const
 * @return Status of packet info.
 *
 * @retval FN_E_INVALID_PROTOCOL Invalid protocol requested
+* @retval FN_E_PACKET_TRUNCATED The IP or TCP header is incomplete
 * @retval FN_S_OK Data set
 
 */
@@ -336,9 +284,13 @@ FN_STATUS fnPacket::getPacketTuple(tcp_packet_tuple &tuple) const
 	FN_STATUS ret = FN_E_INVALID_PROTOCOL;
 
 	
-	if (this->getProtocol() == PROTO_TCP)
+	if (this->getProtocol() == PROTO_TCP && !hasTransportHeader(sizeof(tcpPacket)))
+	{
+		ret = FN_E_PACKET_TRUNCATED;
+	}
+	else if (this->getProtocol() == PROTO_TCP)
 	{
-		unsigned char* pData = (m_pPacketData->data) + this->getPacketHeaderLength() - LIBNET_IPV4_H;
+		unsigned char* pData = (m_pPacketData->data) + this->getPacketHeaderLength() - FN_IPV4_H;
 		tcpPacket* tcp = (tcpPacket*)pData;
 
 		tuple.src_ip = this->getSourceIP();
@@ -369,16 +321,285 @@ FN_STATUS fnPacket::setPacketTuple(const icmp_packet_tuple &tuple)
 	
 	if (this->getProtocol() == PROTO_ICMP)
 	{
-		m_pPacketData->srcIP.raw = htonl(tuple.src_ip);
-		m_pPacketData->dstIP.raw = htonl(tuple.dest_ip);
+		// the ICMP checksum does not cover the addresses
+		this->setAddresses(tuple.src_ip, tuple.dest_ip, NULL);
+		
+		if (this->isICMPQuery())
+		{
+			unsigned char* pData = (m_pPacketData->data) + this->getPacketHeaderLength() - FN_IPV4_H;
+			icmpPacket* icmp = (icmpPacket*)pData;
+			uint16_t id = htons(tuple.id);
+			
+			icmp->nChecksum = fnChecksumAdjust16(icmp->nChecksum, icmp->nID, id);
+			icmp->nID = id;
+		}
 		
-		this->calcIPchecksum();
 		ret = FN_S_OK;
 	}
 	
 	return ret;
 }
 
+/**
+* @brief Returns the packet quoted by an ICMP error
+* 
+* @detailed The quoted packet is only returned if its IP header and the first
+*			8 bytes of its transport header are present, and it is not a later
+*			fragment (which would carry no transport header).
+* 
+* @return Quoted IP header, NULL if the packet is not an ICMP error or too short
+*/
+rawPacket* fnPacket::getEmbeddedPacket() const
+{
+	rawPacket* pEmbedded = NULL;
+	
+	if (this->isICMPError())
+	{
+		int nOffset = this->getPacketHeaderLength() + sizeof(icmpPacket);
+		
+		if (m_nPacketDataLen >= nOffset + FN_IPV4_H)
+		{
+			rawPacket* pQuoted = (rawPacket*)((unsigned char*)m_pPacketData + nOffset);
+			int nQuotedHeader = (pQuoted->nVersionLength & 0x0F) << 2;
+			
+			if (nQuotedHeader >= FN_IPV4_H &&
+				m_nPacketDataLen >= nOffset + nQuotedHeader + (int)sizeof(udpPacket) &&
+				(ntohs(pQuoted->nFragFlagsOffset) & 0x1FFF) == 0)
+			{
+				pEmbedded = pQuoted;
+			}
+		}
+	}
+	
+	return pEmbedded;
+}
+
+/**
+* @brief Returns if the IP header and a transport header of the given size are present
+* 
+* @detailed Checked against the length of the data actually held, which is less than
+*			the IP total length when the packet was cut short by a capture's snap length.
+* 
+* @param nSize [IN] Length of the transport header
+*/
+bool fnPacket::hasTransportHeader(const int nSize) const
+{
+	int nHeader;
+	
+	if (m_nPacketDataLen < FN_IPV4_H)
+	{
+		return false;
+	}
+	
+	nHeader = this->getPacketHeaderLength();
+	
+	return nHeader >= FN_IPV4_H && m_nPacketDataLen >= nHeader + nSize;
+}
+
+/**
+* @brief Provides the tuple of the packet quoted by an ICMP error
+* 
+* @detailed The tuple is the one of the packet as it was sent, so for an inbound
+*			error its source is the external endpoint of a map.  A quoted ICMP
+*			query is described like a UDP packet with its identifier as the source
+*			port and 0 as the destination port.
+* 
+* @param protocol [OUT] Protocol of the quoted packet
+* @param tuple [OUT] Addresses and ports of the quoted packet
+* 
+* @return Status of packet info.
+*
+* @retval FN_E_INVALID_PROTOCOL Not an ICMP error, or it quotes an untranslated protocol
+* @retval FN_E_PACKET_TRUNCATED The quoted headers are incomplete
+* @retval FN_S_OK Data set
+*/
+FN_STATUS fnPacket::getEmbeddedTuple(uint8_t &protocol, udp_packet_tuple &tuple) const
+{
+	FN_STATUS ret = FN_E_INVALID_PROTOCOL;
+	rawPacket* pEmbedded = this->getEmbeddedPacket();
+	
+	if (pEmbedded != NULL)
+	{
+		unsigned char* pData = pEmbedded->data + ((pEmbedded->nVersionLength & 0x0F) << 2) - FN_IPV4_H;
+		
+		protocol = pEmbedded->nProtocol;
+		tuple.src_ip = ntohl(pEmbedded->srcIP.raw);
+		tuple.dest_ip = ntohl(pEmbedded->dstIP.raw);
+		
+		switch (protocol)
+		{
+			case PROTO_UDP:
+			case PROTO_TCP:
+				// the ports are at the same place in both headers
+				tuple.src_port = ntohs(((udpPacket*)pData)->srcPort);
+				tuple.dest_port = ntohs(((udpPacket*)pData)->dstPort);
+				ret = FN_S_OK;
+				break;
+				
+			case PROTO_ICMP:
+				switch (((icmpPacket*)pData)->nType)
+				{
+					case ICMP_TYPE_ECHO_REQUEST:
+					case ICMP_TYPE_TIMESTAMP:
+						tuple.src_port = ntohs(((icmpPacket*)pData)->nID);
+						tuple.dest_port = 0;
+						ret = FN_S_OK;
+						break;
+						
+					default:
+						break;
+				}
+				break;
+				
+			default:
+				break;
+		}
+	}
+	else if (this->isICMPError())
+	{
+		ret = FN_E_PACKET_TRUNCATED;
+	}
+	
+	return ret;
+}
+
+/**
+* @brief Rewrites the packet quoted by an ICMP error
+* 
+* @detailed The quoted packet gets the addresses and ports of the tuple and the
+*			error is readdressed to the quoted packet's new source, the host that
+*			sent it.  The quoted IP and transport checksums are adjusted like those
+*			of a whole packet (a quoted TCP checksum only if it was quoted), and the
+*			ICMP checksum for every word changed inside the quote.
+* 
+* @param tuple [IN] New addresses and ports of the quoted packet, see getEmbeddedTuple
+* 
+* @return Status of packet info.
+*
+* @retval FN_E_INVALID_PROTOCOL Not an ICMP error
+* @retval FN_E_PACKET_TRUNCATED The quoted headers are incomplete
+* @retval FN_S_OK Data set
+*/
+FN_STATUS fnPacket::setEmbeddedTuple(const udp_packet_tuple &tuple)
+{
+	FN_STATUS ret = FN_E_INVALID_PROTOCOL;
+	rawPacket* pEmbedded = this->getEmbeddedPacket();
+	
+	if (pEmbedded != NULL)
+	{
+		icmpPacket* icmp = (icmpPacket*)((m_pPacketData->data) + this->getPacketHeaderLength() - FN_IPV4_H);
+		int nQuotedHeader = (pEmbedded->nVersionLength & 0x0F) << 2;
+		unsigned char* pData = pEmbedded->data + nQuotedHeader - FN_IPV4_H;
+		uint32_t src = htonl(tuple.src_ip);
+		uint32_t dest = htonl(tuple.dest_ip);
+		uint16_t src_port = htons(tuple.src_port);
+		uint16_t dest_port = htons(tuple.dest_port);
+		uint16_t check = icmp->nChecksum;
+		uint16_t *pCheck = NULL;
+		uint16_t *pSrcPort = NULL;
+		uint16_t *pDestPort = NULL;
+		
+		switch (pEmbedded->nProtocol)
+		{
+			case PROTO_UDP:
+				pSrcPort = &((udpPacket*)pData)->srcPort;
+				pDestPort = &((udpPacket*)pData)->dstPort;
+				
+				// a zero UDP checksum was never computed and stays that way
+				if (((udpPacket*)pData)->nChecksum != 0)
+				{
+					pCheck = &((udpPacket*)pData)->nChecksum;
+				}
+				break;
+				
+			case PROTO_TCP:
+				pSrcPort = &((tcpPacket*)pData)->srcPort;
+				pDestPort = &((tcpPacket*)pData)->dstPort;
+				
+				// errors need only quote 8 bytes of the transport header
+				if (m_nPacketDataLen >= (unsigned char*)(&((tcpPacket*)pData)->nChecksum + 1) - (unsigned char*)m_pPacketData)
+				{
+					pCheck = &((tcpPacket*)pData)->nChecksum;
+				}
+				break;
+				
+			case PROTO_ICMP:
+				pSrcPort = &((icmpPacket*)pData)->nID;
+				break;
+				
+			default:
+				break;
+		}
+		
+		// the quoted transport checksum, its pseudo header covers the addresses
+		if (pCheck != NULL)
+		{
+			uint16_t old = *pCheck;
+			
+			*pCheck = fnChecksumAdjust32(*pCheck, pEmbedded->srcIP.raw, src);
+			*pCheck = fnChecksumAdjust32(*pCheck, pEmbedded->dstIP.raw, dest);
+			*pCheck = fnChecksumAdjust16(*pCheck, *pSrcPort, src_port);
+			*pCheck = fnChecksumAdjust16(*pCheck, *pDestPort, dest_port);
+			
+			if (pEmbedded->nProtocol == PROTO_UDP && *pCheck == 0)
+			{
+				*pCheck = 0xFFFF;
+			}
+			
+			check = fnChecksumAdjust16(check, old, *pCheck);
+		}
+		else if (pEmbedded->nProtocol == PROTO_ICMP)
+		{
+			// a quoted query's checksum covers its identifier only
+			uint16_t *pQueryCheck = &((icmpPacket*)pData)->nChecksum;
+			uint16_t old = *pQueryCheck;
+			
+			*pQueryCheck = fnChecksumAdjust16(*pQueryCheck, *pSrcPort, src_port);
+			check = fnChecksumAdjust16(check, old, *pQueryCheck);
+		}
+		
+		if (pSrcPort != NULL)
+		{
+			check = fnChecksumAdjust16(check, *pSrcPort, src_port);
+			*pSrcPort = src_port;
+		}
+		
+		if (pDestPort != NULL)
+		{
+			check = fnChecksumAdjust16(check, *pDestPort, dest_port);
+			*pDestPort = dest_port;
+		}
+		
+		// the quoted IP header and its checksum
+		{
+			uint16_t old = pEmbedded->nHeaderChecksum;
+			
+			pEmbedded->nHeaderChecksum = fnChecksumAdjust32(pEmbedded->nHeaderChecksum, pEmbedded->srcIP.raw, src);
+			pEmbedded->nHeaderChecksum = fnChecksumAdjust32(pEmbedded->nHeaderChecksum, pEmbedded->dstIP.raw, dest);
+			
+			check = fnChecksumAdjust32(check, pEmbedded->srcIP.raw, src);
+			check = fnChecksumAdjust32(check, pEmbedded->dstIP.raw, dest);
+			check = fnChecksumAdjust16(check, old, pEmbedded->nHeaderChecksum);
+			
+			pEmbedded->srcIP.raw = src;
+			pEmbedded->dstIP.raw = dest;
+		}
+		
+		icmp->nChecksum = check;
+		
+		// ICMP has no pseudo header, only the outer IP checksum follows the new destination
+		this->setAddresses(this->getSourceIP(), tuple.src_ip, NULL);
+		
+		ret = FN_S_OK;
+	}
+	else if (this->isICMPError())
+	{
+		ret = FN_E_PACKET_TRUNCATED;
+	}
+	
+	return ret;
+}
+
 /**
 * @brief Sets source and destination information of packet - UDP version
 * 
@@ -396,19 +617,26 @@ FN_STATUS fnPacket::setPacketTuple(const udp_packet_tuple &tuple)
 	
 	if (this->getProtocol() == PROTO_UDP)
 	{
-		unsigned char* pData = (m_pPacketData->data) + this->getPacketHeaderLength() - LIBNET_IPV4_H;
+		unsigned char* pData = (m_pPacketData->data) + this->getPacketHeaderLength() - FN_IPV4_H;
 		udpPacket* udp = (udpPacket*)pData;
+		uint16_t src_port = htons(tuple.src_port);
+		uint16_t dest_port = htons(tuple.dest_port);
+		uint16_t check = udp->nChecksum;
 
+		this->setAddresses(tuple.src_ip, tuple.dest_ip, &check);
 		
-		m_pPacketData->srcIP.raw = htonl(tuple.src_ip);
-		m_pPacketData->dstIP.raw = htonl(tuple.dest_ip);
+		check = fnChecksumAdjust16(check, udp->srcPort, src_port);
+		check = fnChecksumAdjust16(check, udp->dstPort, dest_port);
 		
-		udp->srcPort = htons(tuple.src_port);
-		udp->dstPort = htons(tuple.dest_port);
+		udp->srcPort = src_port;
+		udp->dstPort = dest_port;
 		
-		
-		this->calcUDPchecksum();
-		this->calcIPchecksum();
+		// A zero checksum means the sender did not compute one, so leave it that way.
+		// A computed checksum of zero is sent as all ones.
+		if (udp->nChecksum != 0)
+		{
+			udp->nChecksum = (check != 0) ? check : 0xFFFF;
+		}
 		
 		ret = FN_S_OK;
 	}
@@ -434,19 +662,20 @@ FN_STATUS fnPacket::setPacketTuple(const tcp_packet_tuple &tuple)
 	
 	if (this->getProtocol() == PROTO_TCP)
 	{
-		unsigned char* pData = (m_pPacketData->data) + this->getPacketHeaderLength() - LIBNET_IPV4_H;
+		unsigned char* pData = (m_pPacketData->data) + this->getPacketHeaderLength() - FN_IPV4_H;
 		tcpPacket* tcp = (tcpPacket*)pData;
+		uint16_t src_port = htons(tuple.src_port);
+		uint16_t dest_port = htons(tuple.dest_port);
+		uint16_t check = tcp->nChecksum;
 
+		this->setAddresses(tuple.src_ip, tuple.dest_ip, &check);
 		
-		m_pPacketData->srcIP.raw = htonl(tuple.src_ip);
-		m_pPacketData->dstIP.raw = htonl(tuple.dest_ip);
-		
-		tcp->srcPort = htons(tuple.src_port);
-		tcp->dstPort = htons(tuple.dest_port);
-		
+		check = fnChecksumAdjust16(check, tcp->srcPort, src_port);
+		check = fnChecksumAdjust16(check, tcp->dstPort, dest_port);
 		
-		this->calcTCPchecksum();
-		this->calcIPchecksum();
+		tcp->srcPort = src_port;
+		tcp->dstPort = dest_port;
+		tcp->nChecksum = check;
 		
 		ret = FN_S_OK;
 	}
@@ -468,6 +697,102 @@ const uint8_t fnPacket::getProtocol() const
 	return m_pPacketData->nProtocol;
 }
 
+/**
+* @brief Returns the TCP flags (TCP_FLAG_*)
+* 
+* @return TCP flags, 0 for packets of other protocols or without a whole TCP header
+*/
+const uint8_t fnPacket::getTCPFlags() const
+{
+	uint8_t flags = 0;
+	
+	if (this->getProtocol() == PROTO_TCP && hasTransportHeader(sizeof(tcpPacket)))
+	{
+		unsigned char* pData = (m_pPacketData->data) + this->getPacketHeaderLength() - FN_IPV4_H;
+		tcpPacket* tcp = (tcpPacket*)pData;
+		
+		flags = (uint8_t)(ntohs(tcp->nHeaderLenFlags) & 0xFF);
+	}
+	
+	return flags;
+}
+
+/**
+* @brief Returns the ICMP message type (ICMP_TYPE_*)
+* 
+* @return ICMP type, 0 for packets of other protocols or without a whole ICMP header
+*/
+const uint8_t fnPacket::getICMPType() const
+{
+	uint8_t type = 0;
+	
+	if (this->getProtocol() == PROTO_ICMP && hasTransportHeader(sizeof(icmpPacket)))
+	{
+		unsigned char* pData = (m_pPacketData->data) + this->getPacketHeaderLength() - FN_IPV4_H;
+		
+		type = ((icmpPacket*)pData)->nType;
+	}
+	
+	return type;
+}
+
+/**
+* @brief Returns if the packet is an ICMP query (echo or timestamp) or its reply
+* 
+* @detailed Only these messages carry the identifier used to map them.  A packet
+*			cut short of its ICMP header is neither a query nor an error.
+*/
+const bool fnPacket::isICMPQuery() const
+{
+	bool ret = false;
+	
+	if (this->getProtocol() == PROTO_ICMP && hasTransportHeader(sizeof(icmpPacket)))
+	{
+		switch (this->getICMPType())
+		{
+			case ICMP_TYPE_ECHO_REQUEST:
+			case ICMP_TYPE_ECHO_REPLY:
+			case ICMP_TYPE_TIMESTAMP:
+			case ICMP_TYPE_TIMESTAMP_REPLY:
+				ret = true;
+				break;
+			
+			default:
+				break;
+		}
+	}
+	
+	return ret;
+}
+
+/**
+* @brief Returns if the packet is an ICMP error (destination unreachable, time
+*		 exceeded or parameter problem)
+* 
+* @detailed These messages quote the header of the packet that caused them.
+*/
+const bool fnPacket::isICMPError() const
+{
+	bool ret = false;
+	
+	if (this->getProtocol() == PROTO_ICMP && hasTransportHeader(sizeof(icmpPacket)))
+	{
+		switch (this->getICMPType())
+		{
+			case ICMP_TYPE_DEST_UNREACH:
+			case ICMP_TYPE_TIME_EXCEEDED:
+			case ICMP_TYPE_PARAM_PROBLEM:
+				ret = true;
+				break;
+			
+			default:
+				break;
+		}
+	}
+	
+	return ret;
+}
+
 /**
 * @brief Returns the IP source address in host byte order
 * 
@@ -489,36 +814,62 @@ const uint32_t fnPacket::getDestinationIP() const
 }
 
 /**
-* @brief Returns the interface the packet was received on
+* @brief Returns the index of the interface the packet was received on
 * 
-* @param in [OUT] interface name
-*
+* @return interface index, 0 if unknown
 */		
-void fnPacket::getInboundInterface(std::string & in) const
+const uint32_t fnPacket::getInboundIfIndex() const
 {
-	in = m_strInboundInterface;
+	return m_nInboundIfIndex;
 }
 
 /**
-* @brief Returns the interface the packet will be sent out of
+* @brief Returns the index of the interface the packet will be sent out of
 * 
-* @param out [OUT] interface name
-*
+* @return interface index, 0 if unknown
 */	
-void fnPacket::getOutboundInterface(std::string & out) const
+const uint32_t fnPacket::getOutboundIfIndex() const
 {
-	out = m_strOutboundInterface;
+	return m_nOutboundIfIndex;
 }
 
 /**
 * @brief Sets the interface the packet will be sent out of
 * 
-* @param out [IN] interface name
+* @param ifindex [IN] interface index
 *
 */	
-void fnPacket::setOutboundInterface(const std::string & out)
+void fnPacket::setOutboundIfIndex(const uint32_t ifindex)
+{
+	m_nOutboundIfIndex = ifindex;
+}
+
+/**
+* @brief Returns the index of the interface the kernel routed the packet to
+* 
+* @detailed Unlike getOutboundIfIndex this is not changed by setOutboundIfIndex.
+* 
+* @return interface index, 0 if the packet was queued before routing
+*/	
+const uint32_t fnPacket::getRoutedIfIndex() const
+{
+	return m_nRoutedIfIndex;
+}
+
+/**
+* @brief Returns the packet, starting with its IP header
+*/	
+const unsigned char* fnPacket::getData() const
+{
+	return (const unsigned char*)m_pPacketData;
+}
+
+/**
+* @brief Returns the length of the packet as queued
+*/	
+const int fnPacket::getLength() const
 {
-	m_strOutboundInterface = out;
+	return m_nPacketDataLen;
 }
 
 /**
@@ -556,111 +907,54 @@ inline short fnPacket::getPacketHeaderLength() const
 
 
 /**
-* @brief Calculate the IP Header checksum
+* @brief Rewrites the IP addresses of the packet
 * 
+* @detailed The header checksum and, if given, the transport checksum (whose pseudo
+*			header includes the addresses) are adjusted for the changed words only, so the
+*			cost does not depend on the size of the packet.
+* 
+* @param src_ip [IN] New source address in host byte order
+* @param dest_ip [IN] New destination address in host byte order
+* @param pCheck [IN/OUT] Transport checksum to adjust, NULL if none
 */
-void fnPacket::calcIPchecksum()
+void fnPacket::setAddresses(const uint32_t src_ip, const uint32_t dest_ip, uint16_t *pCheck)
 {
-	uint32_t sum = 0;
-	uint16_t hdrlen = (m_pPacketData->nVersionLength & 0x0F) << 2;
-	unsigned char*	data = (unsigned char*)m_pPacketData;
+	uint32_t src = htonl(src_ip);
+	uint32_t dest = htonl(dest_ip);
+	uint16_t check = m_pPacketData->nHeaderChecksum;
 	
-//	printf("Old Checksum: 0x%02X\n",m_pPacketData->nHeaderChecksum);
+	check = fnChecksumAdjust32(check, m_pPacketData->srcIP.raw, src);
+	check = fnChecksumAdjust32(check, m_pPacketData->dstIP.raw, dest);
+	m_pPacketData->nHeaderChecksum = check;
 	
-	// Reset checksum prior to calculation
-	m_pPacketData->nHeaderChecksum = 0;
-    
-	// make 16 bit words out of every two adjacent 8 bit words in the packet
-	// and add them up
-	for (uint16_t i = 0; i < hdrlen ;i=i+2)
+	if (pCheck != NULL)
 	{
-		uint16_t w = ((data[i]<<8)&0xFF00)+(data[i+1]&0xFF);
-		sum = sum + (uint32_t) w;	
+		*pCheck = fnChecksumAdjust32(*pCheck, m_pPacketData->srcIP.raw, src);
+		*pCheck = fnChecksumAdjust32(*pCheck, m_pPacketData->dstIP.raw, dest);
 	}
 	
-	// take only 16 bits out of the 32 bit sum and add up the carries
-	while (sum >> 16)
-	  sum = (sum & 0xFFFF) + (sum >> 16);
-
-	// one's complement and we have a new checksum
-	m_pPacketData->nHeaderChecksum = htons(~sum);
-	
-//	printf("New Checksum: 0x%02X\n",m_pPacketData->nHeaderChecksum);
-
-}
-
-/**
-* @brief Calculate the UDP Header checksum
-* 
-*/
-void fnPacket::calcUDPchecksum()
-{
-	
-	if (this->getProtocol() == PROTO_UDP)
-	{
-		uint32_t sum = 0;
-		unsigned char* pData = (m_pPacketData->data) + this->getPacketHeaderLength() - LIBNET_IPV4_H;
-		udpPacket* udp = (udpPacket*)pData;
-		uint16_t len = ntohs(udp->nLength);
-
-//		printf("\tOriginal UDP checksum: 0x%X\n",udp->nChecksum);
-
-		// clear the existing checksum
-		udp->nChecksum = 0;
-		
-		for (uint16_t i = 0; i< len; i+=2)
-		{
-				sum += pData[i] << 8 & 0xFF00;
-				
-				if (i+1 < len)
-				{
-					sum += pData[i+1] & 0xFF;
-				}
-		}
-		
-		sum += PROTO_UDP;
-		sum += len;
-		sum += m_pPacketData->dstIP.octet[0]*256 + m_pPacketData->dstIP.octet[1];
-		sum += m_pPacketData->dstIP.octet[2]*256 + m_pPacketData->dstIP.octet[3];
-		sum += m_pPacketData->srcIP.octet[0]*256 + m_pPacketData->srcIP.octet[1];
-		sum += m_pPacketData->srcIP.octet[2]*256 + m_pPacketData->srcIP.octet[3];
-		
-		while (sum>>16)
-			sum = (sum & 0xFFFF)+(sum >> 16);
-			
-		udp->nChecksum = htons(~sum);
-		
-//		printf("\tNew UDP checksum: 0x%X\n",udp->nChecksum);
-	}
-}
-
-/**
-* @brief Calculate the TCP Header checksum
-* 
-*/
-void fnPacket::calcTCPchecksum()
-{
-	// TODO write this function
+	m_pPacketData->srcIP.raw = src;
+	m_pPacketData->dstIP.raw = dest;
 }
 
 /**
 * @brief Utility function to dump a region of memory
 */
-void fnPacket::dumpMem(unsigned char* p,int len)
+void fnPacket::dumpMem(const unsigned char* p,int len) const
 {
-	printf("\t\t------------------------------------------------");
+	FN_TRACE("\t\t------------------------------------------------");
 	for (int i = 0 ; i < len; i++ )
 	{
 		if (i%16==0)
 		{
-			printf("\n\t\t");
+			FN_TRACE("\n\t\t");
 		}
 		
-		printf( "%02X:", *(p+i));
+		FN_TRACE( "%02X:", *(p+i));
 	}
 	
-	printf("\n");
-	printf("\t\t------------------------------------------------\n");
+	FN_TRACE("\n");
+	FN_TRACE("\t\t------------------------------------------------\n");
 
 }
 
@@ -38,6 +38,21 @@ extern "C" {
 #define PROTO_TCP 6
 #define PROTO_UDP 17
 
+#define FN_IPV4_H 20	///< IPv4 header without options
+
+#define ICMP_TYPE_ECHO_REPLY 0
+#define ICMP_TYPE_DEST_UNREACH 3
+#define ICMP_TYPE_ECHO_REQUEST 8
+#define ICMP_TYPE_TIME_EXCEEDED 11
+#define ICMP_TYPE_PARAM_PROBLEM 12
+#define ICMP_TYPE_TIMESTAMP 13
+#define ICMP_TYPE_TIMESTAMP_REPLY 14
+
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_SYN 0x02
+#define TCP_FLAG_RST 0x04
+#define TCP_FLAG_ACK 0x10
+
 typedef union _ipAddr
 {
 	uint32_t	raw;
@@ -70,14 +85,26 @@ typedef struct _udpPacket
 	unsigned char	data[];
 } udpPacket;
 
+typedef struct _icmpPacket
+{
+	uint8_t nType;
+	uint8_t nCode;
+	uint16_t nChecksum;
+	uint16_t nID;		// query messages only
+	uint16_t nSequence;
+
+	unsigned char	data[];
+} icmpPacket;
+
 typedef struct _tcpPacket
 {
 	uint16_t srcPort;
 	uint16_t dstPort;
 	uint32_t nSeqNum;
 	uint32_t nAckId;
-	uint32_t nHeaderLenFlags; // Combined header length, Reserved, and flag bits
+	uint16_t nHeaderLenFlags; // Combined header length, Reserved, and flag bits
 	uint16_t nWindowSize;
+	uint16_t nChecksum;
 	uint16_t nUrgPtr;
 	
 	unsigned char	data[];
@@ -89,6 +116,7 @@ class fnPacket
 	public:
 	
 		fnPacket(struct nfq_data *nfa);
+		fnPacket(unsigned char *pData, int nLength, uint32_t nInboundIfIndex, uint32_t nID, uint32_t nRoutedIfIndex = 0);
 		~fnPacket();
 		
 		const int getNetfilterID() const;
@@ -98,6 +126,10 @@ class fnPacket
 		const uint16_t getFragmentID() const;
 		
 		const uint8_t getProtocol() const;
+		const uint8_t getTCPFlags() const;
+		const uint8_t getICMPType() const;
+		const bool isICMPQuery() const;
+		const bool isICMPError() const;
 		
 		FN_STATUS getPacketTuple(icmp_packet_tuple &tuple) const;
 		FN_STATUS getPacketTuple(udp_packet_tuple &tuple) const;
@@ -106,33 +138,43 @@ class fnPacket
 		FN_STATUS setPacketTuple(const icmp_packet_tuple &tuple);
 		FN_STATUS setPacketTuple(const udp_packet_tuple &tuple);
 		FN_STATUS setPacketTuple(const tcp_packet_tuple &tuple);
+		
+		FN_STATUS getEmbeddedTuple(uint8_t &protocol, udp_packet_tuple &tuple) const;
+		FN_STATUS setEmbeddedTuple(const udp_packet_tuple &tuple);
 
 		
-		void getInboundInterface(std::string & in) const;
-		void getOutboundInterface(std::string & out) const;
-		void setOutboundInterface(const std::string & out);
+		const uint32_t getInboundIfIndex() const;
+		const uint32_t getOutboundIfIndex() const;
+		const uint32_t getRoutedIfIndex() const;
+		void setOutboundIfIndex(const uint32_t ifindex);
+		
+		const unsigned char* getData() const;
+		const int getLength() const;
 		
 		FN_STATUS send();
 
 		
-		void dump();
+		void dump() const;
 		
 		
 	protected:
 		struct nfq_data* m_nfData;
 		rawPacket* m_pPacketData;
 		int m_nPacketDataLen;
-		std::string	m_strInboundInterface;
-		std::string	m_strOutboundInterface;
+		uint32_t	m_nID;	///< netfilter packet id, looked up once
+		uint32_t	m_nInboundIfIndex;
+		uint32_t	m_nOutboundIfIndex;
+		uint32_t	m_nRoutedIfIndex;	///< egress chosen by the kernel before queueing, 0 if none yet
+		
 		
+		void setAddresses(const uint32_t src_ip, const uint32_t dest_ip, uint16_t *pCheck);
 		
-		void calcIPchecksum();
-		void calcUDPchecksum();
-		void calcTCPchecksum();
+		rawPacket* getEmbeddedPacket() const;
+		bool hasTransportHeader(const int nSize) const;
 
 	
 	private:
-		void dumpMem(unsigned char* p,int len);
+		void dumpMem(const unsigned char* p,int len) const;
 		short getPacketHeaderLength() const;
 
 
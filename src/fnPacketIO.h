@@ -0,0 +1,60 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+
+#ifndef FN_FNPACKETIO_H // one-time include
+#define FN_FNPACKETIO_H
+
+#include "fn_error.h"
+#include "fnPacket.h"
+#include "fnTrace.h"
+
+/**
+* Receives the verdict fnCore::processPacket reaches for a packet.
+*/
+class fnPacketSink
+{
+	public:
+		virtual ~fnPacketSink() {}
+
+		/// The rewritten packet continues on its way
+		virtual FN_STATUS accept(fnPacket &packet) = 0;
+		/// The packet is discarded
+		virtual FN_STATUS drop(fnPacket &packet) = 0;
+		/// The rewritten packet has to be sent out of its outbound interface by us
+		virtual FN_STATUS transmit(fnPacket &packet) = 0;
+};
+
+/**
+* Feeds packets to fnCore::processPacket, together with the sink for their verdicts.
+* Sources are either live (a netfilter queue) or offline (capture files).
+*/
+class fnPacketSource
+{
+	public:
+		virtual ~fnPacketSource() {}
+
+		/// Processes packets until the source is exhausted or fails
+		virtual FN_STATUS run(fnTraceRing *pTrace) = 0;
+};
+
+#endif
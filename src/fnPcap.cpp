@@ -0,0 +1,438 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+/**
+* @file fnPcap.cpp
+* @author Jeremy Beker
+* @version
+*
+* @overview Minimal reader and writer of classic pcap files, used to replay captures
+*/
+
+#include <stddef.h>
+#include <string.h>
+
+#include "fnPcap.h"
+
+#define PCAP_MAGIC_USEC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_VLAN 0x8100
+
+#define IPV4_HEADER_MIN 20
+#define IPV4_OFFSET_MASK 0x1FFF
+
+typedef struct _pcap_file_header
+{
+	uint32_t	magic;
+	uint16_t	version_major;
+	uint16_t	version_minor;
+	int32_t		thiszone;
+	uint32_t	sigfigs;
+	uint32_t	snaplen;
+	uint32_t	linktype;
+} pcap_file_header;
+
+typedef struct _pcap_record_header
+{
+	uint32_t	ts_sec;
+	uint32_t	ts_frac;	///< microseconds or nanoseconds, depending on the magic
+	uint32_t	caplen;
+	uint32_t	len;
+} pcap_record_header;
+
+/**
+* @brief Constructor for fnPcapReader class
+*/
+fnPcapReader::fnPcapReader()
+{
+	m_pFile = NULL;
+	m_bSwapped = false;
+	m_bNanoseconds = false;
+	m_nLinkType = 0;
+	m_nShort = 0;
+}
+
+/**
+* @brief Destructor for fnPcapReader class
+*/
+fnPcapReader::~fnPcapReader()
+{
+	close();
+}
+
+/**
+* @brief Opens a capture file and checks its header
+*
+* @param pPath [IN] File name
+*
+* @return Status of open
+*
+* @retval FN_E_FAIL File could not be opened
+* @retval FN_E_INVALID_CAPTURE Not a pcap file, or a link type that is not supported
+* @retval FN_S_OK File ready for next
+*/
+FN_STATUS fnPcapReader::open(const char *pPath)
+{
+	pcap_file_header header;
+
+	close();
+
+	m_pFile = fopen(pPath, "rb");
+
+	if (m_pFile == NULL)
+	{
+		return FN_E_FAIL;
+	}
+
+	if (fread(&header, sizeof(header), 1, m_pFile) != 1)
+	{
+		return FN_E_INVALID_CAPTURE;
+	}
+
+	m_bSwapped = false;
+	m_nShort = 0;
+
+	if (header.magic != PCAP_MAGIC_USEC && header.magic != PCAP_MAGIC_NSEC)
+	{
+		m_bSwapped = true;
+		header.magic = swap(header.magic);
+	}
+
+	if (header.magic == PCAP_MAGIC_USEC)
+	{
+		m_bNanoseconds = false;
+	}
+	else if (header.magic == PCAP_MAGIC_NSEC)
+	{
+		m_bNanoseconds = true;
+	}
+	else
+	{
+		return FN_E_INVALID_CAPTURE;
+	}
+
+	m_nLinkType = swap(header.linktype) & 0x0FFFFFFF;	// upper bits carry FCS flags
+
+	switch (m_nLinkType)
+	{
+		case FN_LINKTYPE_ETHERNET:
+		case FN_LINKTYPE_RAW:
+		case FN_LINKTYPE_LINUX_SLL:
+		case FN_LINKTYPE_IPV4:
+			break;
+
+		default:
+			return FN_E_INVALID_CAPTURE;
+	}
+
+	return FN_S_OK;
+}
+
+/**
+* @brief Closes the capture file
+*/
+void fnPcapReader::close()
+{
+	if (m_pFile != NULL)
+	{
+		fclose(m_pFile);
+		m_pFile = NULL;
+	}
+}
+
+/**
+* @brief Converts a header field to host byte order
+*/
+uint32_t fnPcapReader::swap(uint32_t value) const
+{
+	return m_bSwapped ? __builtin_bswap32(value) : value;
+}
+
+/**
+* @brief Returns the length of the link layer header in front of an IPv4 packet
+*
+* @return Header length, or -1 if the frame does not carry IPv4
+*/
+int fnPcapReader::linkHeaderLength(const unsigned char *pFrame, int nLength) const
+{
+	int nOffset;
+
+	switch (m_nLinkType)
+	{
+		case FN_LINKTYPE_ETHERNET:
+			nOffset = 12;
+
+			// a single 802.1Q tag is skipped
+			if (nLength >= nOffset + 2 && ((pFrame[nOffset] << 8) | pFrame[nOffset + 1]) == ETHERTYPE_VLAN)
+			{
+				nOffset += 4;
+			}
+			break;
+
+		case FN_LINKTYPE_LINUX_SLL:
+			nOffset = 14;
+			break;
+
+		default:
+			// raw frames are IP, check the version below
+			return (nLength > 0 && (pFrame[0] >> 4) == 4) ? 0 : -1;
+	}
+
+	if (nLength < nOffset + 2 || ((pFrame[nOffset] << 8) | pFrame[nOffset + 1]) != ETHERTYPE_IPV4)
+	{
+		return -1;
+	}
+
+	return nOffset + 2;
+}
+
+/**
+* @brief Returns if a packet holds its whole IP header and, on a first fragment, its
+*        UDP, TCP or ICMP header
+*
+* @param pPacket [IN] Packet, starting at its IP header
+* @param nLength [IN] Captured length of the packet
+*/
+bool fnPcapReader::hasHeaders(const unsigned char *pPacket, int nLength) const
+{
+	int nHeader;
+	int nTransport;
+
+	if (nLength < IPV4_HEADER_MIN)
+	{
+		return false;
+	}
+
+	nHeader = (pPacket[0] & 0x0F) * 4;
+
+	if (nHeader < IPV4_HEADER_MIN || nLength < nHeader)
+	{
+		return false;
+	}
+
+	// later fragments carry no transport header
+	if ((((pPacket[6] << 8) | pPacket[7]) & IPV4_OFFSET_MASK) != 0)
+	{
+		return true;
+	}
+
+	switch (pPacket[9])
+	{
+		case 1:		// ICMP
+		case 17:	// UDP
+			nTransport = 8;
+			break;
+
+		case 6:		// TCP
+			nTransport = 20;
+			break;
+
+		default:
+			nTransport = 0;
+			break;
+	}
+
+	return nLength >= nHeader + nTransport;
+}
+
+/**
+* @brief Returns the number of records skipped because they were too short for their headers
+*/
+uint64_t fnPcapReader::getShortCount() const
+{
+	return m_nShort;
+}
+
+/**
+* @brief Reads the next IPv4 packet
+*
+* @param pBuffer [OUT] Receives the packet, starting at its IP header
+* @param nSize [IN] Size of pBuffer
+* @param nLength [OUT] Length of the packet, truncated to nSize
+* @param nTimestamp [OUT] Capture time in nanoseconds since the epoch
+*
+* @return Status of read
+*
+* @retval FN_E_INVALID_CAPTURE File is damaged
+* @retval FN_S_END_OF_CAPTURE No more packets
+* @retval FN_S_OK Packet read
+*/
+FN_STATUS fnPcapReader::next(unsigned char *pBuffer, int nSize, int &nLength, uint64_t &nTimestamp)
+{
+	pcap_record_header record;
+
+	if (m_pFile == NULL)
+	{
+		return FN_E_INVALID_CAPTURE;
+	}
+
+	for (;;)
+	{
+		uint32_t nCaptured;
+		int nHeader;
+
+		if (fread(&record, sizeof(record), 1, m_pFile) != 1)
+		{
+			return FN_S_END_OF_CAPTURE;
+		}
+
+		nCaptured = swap(record.caplen);
+
+		if (nCaptured > sizeof(m_frame))
+		{
+			return FN_E_INVALID_CAPTURE;
+		}
+
+		if (fread(m_frame, 1, nCaptured, m_pFile) != nCaptured)
+		{
+			return FN_S_END_OF_CAPTURE;
+		}
+
+		nHeader = linkHeaderLength(m_frame, (int)nCaptured);
+
+		if (nHeader < 0)
+		{
+			continue;
+		}
+
+		nLength = (int)nCaptured - nHeader;
+
+		if (nLength > nSize)
+		{
+			nLength = nSize;
+		}
+
+		if (!hasHeaders(m_frame + nHeader, nLength))
+		{
+			m_nShort++;
+			continue;
+		}
+
+		memcpy(pBuffer, m_frame + nHeader, nLength);
+
+		nTimestamp = (uint64_t)swap(record.ts_sec) * 1000000000ULL;
+		nTimestamp += (uint64_t)swap(record.ts_frac) * (m_bNanoseconds ? 1 : 1000);
+
+		return FN_S_OK;
+	}
+}
+
+/**
+* @brief Constructor for fnPcapWriter class
+*/
+fnPcapWriter::fnPcapWriter()
+{
+	m_pFile = NULL;
+}
+
+/**
+* @brief Destructor for fnPcapWriter class
+*/
+fnPcapWriter::~fnPcapWriter()
+{
+	close();
+}
+
+/**
+* @brief Creates a capture file and writes its header
+*
+* @param pPath [IN] File name
+*
+* @retval FN_E_FAIL File could not be created
+* @retval FN_S_OK File ready for write
+*/
+FN_STATUS fnPcapWriter::open(const char *pPath)
+{
+	pcap_file_header header;
+
+	close();
+
+	m_pFile = fopen(pPath, "wb");
+
+	if (m_pFile == NULL)
+	{
+		return FN_E_FAIL;
+	}
+
+	header.magic = PCAP_MAGIC_NSEC;
+	header.version_major = 2;
+	header.version_minor = 4;
+	header.thiszone = 0;
+	header.sigfigs = 0;
+	header.snaplen = FN_PCAP_SNAPLEN;
+	header.linktype = FN_LINKTYPE_RAW;
+
+	if (fwrite(&header, sizeof(header), 1, m_pFile) != 1)
+	{
+		close();
+		return FN_E_FAIL;
+	}
+
+	return FN_S_OK;
+}
+
+/**
+* @brief Closes the capture file
+*/
+void fnPcapWriter::close()
+{
+	if (m_pFile != NULL)
+	{
+		fclose(m_pFile);
+		m_pFile = NULL;
+	}
+}
+
+/**
+* @brief Appends a packet
+*
+* @param pData [IN] Packet, starting at its IP header
+* @param nLength [IN] Length of the packet
+* @param nTimestamp [IN] Time stamp in nanoseconds since the epoch
+*
+* @retval FN_E_FAIL File not open or write failed
+* @retval FN_S_OK Packet written
+*/
+FN_STATUS fnPcapWriter::write(const unsigned char *pData, int nLength, uint64_t nTimestamp)
+{
+	pcap_record_header record;
+
+	if (m_pFile == NULL || nLength < 0)
+	{
+		return FN_E_FAIL;
+	}
+
+	record.ts_sec = (uint32_t)(nTimestamp / 1000000000ULL);
+	record.ts_frac = (uint32_t)(nTimestamp % 1000000000ULL);
+	record.caplen = (uint32_t)nLength;
+	record.len = (uint32_t)nLength;
+
+	if (fwrite(&record, sizeof(record), 1, m_pFile) != 1 ||
+		fwrite(pData, 1, nLength, m_pFile) != (size_t)nLength)
+	{
+		return FN_E_FAIL;
+	}
+
+	return FN_S_OK;
+}
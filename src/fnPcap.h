@@ -0,0 +1,87 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#ifndef FN_FNPCAP_H // one-time include
+#define FN_FNPCAP_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "fn_error.h"
+
+#define FN_PCAP_SNAPLEN 65536
+
+#define FN_LINKTYPE_ETHERNET 1
+#define FN_LINKTYPE_RAW 101
+#define FN_LINKTYPE_LINUX_SLL 113
+#define FN_LINKTYPE_IPV4 228
+
+/**
+* Reads the IPv4 packets of a classic pcap file (microsecond or nanosecond stamps,
+* either byte order).  Link layer headers are stripped, frames that do not carry
+* IPv4 or were cut short of their IP or transport header are skipped.
+*/
+class fnPcapReader
+{
+	public:
+		fnPcapReader();
+		~fnPcapReader();
+
+		FN_STATUS open(const char *pPath);
+		void close();
+
+		FN_STATUS next(unsigned char *pBuffer, int nSize, int &nLength, uint64_t &nTimestamp);
+		uint64_t getShortCount() const;
+
+	protected:
+		uint32_t swap(uint32_t value) const;
+		int linkHeaderLength(const unsigned char *pFrame, int nLength) const;
+		bool hasHeaders(const unsigned char *pPacket, int nLength) const;
+
+	private:
+		FILE*		m_pFile;
+		bool		m_bSwapped;	///< file written on a host of the other byte order
+		bool		m_bNanoseconds;
+		uint32_t	m_nLinkType;
+		uint64_t	m_nShort;	///< records skipped for missing headers
+		unsigned char	m_frame[FN_PCAP_SNAPLEN];
+};
+
+/**
+* Writes raw IPv4 packets (LINKTYPE_RAW) to a classic pcap file.
+*/
+class fnPcapWriter
+{
+	public:
+		fnPcapWriter();
+		~fnPcapWriter();
+
+		FN_STATUS open(const char *pPath);
+		void close();
+
+		FN_STATUS write(const unsigned char *pData, int nLength, uint64_t nTimestamp);
+
+	private:
+		FILE*		m_pFile;
+};
+
+#endif
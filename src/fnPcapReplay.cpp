@@ -0,0 +1,294 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+/**
+* @file fnPcapReplay.cpp
+* @author Jeremy Beker
+* @version
+*
+* @overview Replays capture files through fnCore
+*/
+
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "fnPcapReplay.h"
+#include "fnCore.h"
+#include "fnLog.h"
+#include "fnState.h"
+
+/**
+* @brief Constructor for fnPcapReplay class
+*
+* @param nInternalIfIndex [IN] Interface index inside packets are presented on
+* @param nExternalIfIndex [IN] Interface index outside packets are presented on
+*/
+fnPcapReplay::fnPcapReplay(uint32_t nInternalIfIndex, uint32_t nExternalIfIndex)
+{
+	for (int side = 0; side < REPLAY_SIDE_COUNT; side++)
+	{
+		m_bPending[side] = false;
+		m_nLengths[side] = 0;
+		m_nTimestamps[side] = 0;
+	}
+
+	m_nIfIndexes[REPLAY_INSIDE] = nInternalIfIndex;
+	m_nIfIndexes[REPLAY_OUTSIDE] = nExternalIfIndex;
+	m_nNow = 0;
+	m_nPackets = 0;
+	m_nAccepted = 0;
+	m_nDropped = 0;
+	m_nTransmitted = 0;
+	m_fElapsed = 0;
+}
+
+/**
+* @brief Destructor for fnPcapReplay class
+*/
+fnPcapReplay::~fnPcapReplay()
+{
+}
+
+/**
+* @brief Opens the capture file replayed as arriving on one side of the NAT
+*
+* @retval FN_E_FAIL File could not be opened
+* @retval FN_E_INVALID_CAPTURE File is not a supported capture
+* @retval FN_S_OK File opened
+*/
+FN_STATUS fnPcapReplay::openInput(REPLAY_SIDE side, const std::string &path)
+{
+	FN_STATUS ret = m_readers[side].open(path.c_str());
+
+	if (FAILED(ret))
+	{
+		FN_ERROR("can't replay %s\n", path.c_str());
+	}
+
+	return ret;
+}
+
+/**
+* @brief Creates the capture file receiving the packets leaving one side of the NAT
+*
+* @retval FN_E_FAIL File could not be created
+* @retval FN_S_OK File created
+*/
+FN_STATUS fnPcapReplay::openOutput(REPLAY_SIDE side, const std::string &path)
+{
+	FN_STATUS ret = m_writers[side].open(path.c_str());
+
+	if (FAILED(ret))
+	{
+		FN_ERROR("can't create %s\n", path.c_str());
+	}
+
+	return ret;
+}
+
+/**
+* @brief Reads the next packet of a side unless one is already waiting
+*/
+FN_STATUS fnPcapReplay::fill(REPLAY_SIDE side)
+{
+	FN_STATUS ret = FN_S_OK;
+
+	if (!m_bPending[side])
+	{
+		ret = m_readers[side].next(m_buffers[side], sizeof(m_buffers[side]), m_nLengths[side], m_nTimestamps[side]);
+		m_bPending[side] = (ret == FN_S_OK);
+	}
+
+	return ret;
+}
+
+/**
+* @brief Replays the inputs
+*
+* @detailed Packets of both inputs are merged by time stamp and processed as fast as
+* possible.  fnState is switched to the capture's clock, and maps are expired whenever
+* the time stamps enter a new second, before the packet that got there is processed.
+*
+* @param pTrace [IN] Trace ring, NULL when not tracing
+*
+* @return Status of the replay
+*
+* @retval FN_E_INVALID_CAPTURE An input is damaged
+* @retval FN_S_OK Both inputs replayed
+*/
+FN_STATUS fnPcapReplay::run(fnTraceRing *pTrace)
+{
+	fnCore *pCore = fnCore::getInstance();
+	fnState *pState = fnState::getInstance();
+	struct timespec start, end;
+	time_t last = 0;
+	uint32_t nID = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (;;)
+	{
+		REPLAY_SIDE side;
+
+		for (int s = 0; s < REPLAY_SIDE_COUNT; s++)
+		{
+			if (FAILED(fill((REPLAY_SIDE)s)))
+			{
+				return FN_E_INVALID_CAPTURE;
+			}
+		}
+
+		if (!m_bPending[REPLAY_INSIDE] && !m_bPending[REPLAY_OUTSIDE])
+		{
+			break;
+		}
+
+		if (!m_bPending[REPLAY_OUTSIDE] ||
+			(m_bPending[REPLAY_INSIDE] && m_nTimestamps[REPLAY_INSIDE] <= m_nTimestamps[REPLAY_OUTSIDE]))
+		{
+			side = REPLAY_INSIDE;
+		}
+		else
+		{
+			side = REPLAY_OUTSIDE;
+		}
+
+		m_bPending[side] = false;
+		m_nNow = m_nTimestamps[side];
+		m_nPackets++;
+
+		if (nID == 0)
+		{
+			// the maps start out on the time of the first packet
+			pState->setClock(this);
+		}
+		else if (now() != last)
+		{
+			pState->expireMaps(now());
+		}
+
+		last = now();
+
+		fnPacket packet(m_buffers[side], m_nLengths[side], m_nIfIndexes[side], ++nID);
+
+		pCore->processPacket(packet, *this, pTrace);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	m_fElapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	return FN_S_OK;
+}
+
+/**
+* @brief Returns the time stamp of the packet being replayed, in seconds
+*/
+time_t fnPcapReplay::now()
+{
+	return (time_t)(m_nNow / 1000000000ULL);
+}
+
+/**
+* @brief Prints the packet counts and rate of the last run
+*/
+void fnPcapReplay::report() const
+{
+	printf("replayed %llu packets in %.3fs (%.0f packets/s): %llu accepted, %llu transmitted, %llu dropped\n",
+		(unsigned long long)m_nPackets, m_fElapsed, m_fElapsed > 0 ? m_nPackets / m_fElapsed : 0.0,
+		(unsigned long long)m_nAccepted, (unsigned long long)m_nTransmitted, (unsigned long long)m_nDropped);
+
+	for (int s = 0; s < REPLAY_SIDE_COUNT; s++)
+	{
+		if (m_readers[s].getShortCount() > 0)
+		{
+			printf("skipped %llu %s records too short for their headers\n",
+				(unsigned long long)m_readers[s].getShortCount(), s == REPLAY_INSIDE ? "inside" : "outside");
+		}
+	}
+}
+
+/**
+* @brief Writes a packet to the output of the side it leaves the NAT on
+*
+* @detailed Packets without an outbound interface cross over to the other side.
+*/
+FN_STATUS fnPcapReplay::write(fnPacket &packet)
+{
+	REPLAY_SIDE side;
+
+	if (packet.getOutboundIfIndex() == m_nIfIndexes[REPLAY_INSIDE])
+	{
+		side = REPLAY_INSIDE;
+	}
+	else if (packet.getOutboundIfIndex() == m_nIfIndexes[REPLAY_OUTSIDE])
+	{
+		side = REPLAY_OUTSIDE;
+	}
+	else if (packet.getInboundIfIndex() == m_nIfIndexes[REPLAY_INSIDE])
+	{
+		side = REPLAY_OUTSIDE;
+	}
+	else
+	{
+		side = REPLAY_INSIDE;
+	}
+
+	return m_writers[side].write(packet.getData(), packet.getLength(), m_nNow);
+}
+
+/**
+* @brief Records the rewritten packet as leaving the NAT
+*/
+FN_STATUS fnPcapReplay::accept(fnPacket &packet)
+{
+	m_nAccepted++;
+
+	write(packet);
+
+	return FN_S_OK;
+}
+
+/**
+* @brief Counts a dropped packet
+*/
+FN_STATUS fnPcapReplay::drop(fnPacket &packet)
+{
+	m_nDropped++;
+
+	return FN_S_OK;
+}
+
+/**
+* @brief Records the rewritten packet as leaving the NAT
+*
+* @detailed There is no raw socket in a replay, packets the core would send itself are
+* written to the output like accepted ones.
+*/
+FN_STATUS fnPcapReplay::transmit(fnPacket &packet)
+{
+	m_nTransmitted++;
+
+	write(packet);
+
+	return FN_S_OK;
+}
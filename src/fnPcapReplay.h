@@ -0,0 +1,85 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#ifndef FN_FNPCAPREPLAY_H // one-time include
+#define FN_FNPCAPREPLAY_H
+
+#include <stdint.h>
+#include <string>
+
+#include "fnPacketIO.h"
+#include "fnClock.h"
+#include "fnPcap.h"
+
+typedef enum _REPLAY_SIDE
+{
+	REPLAY_INSIDE,
+	REPLAY_OUTSIDE,
+	REPLAY_SIDE_COUNT,
+} REPLAY_SIDE;
+
+/**
+* Offline packet source and sink: packets captured on the inside and outside of the
+* NAT are fed to fnCore in time stamp order, and the rewritten packets are written
+* to a capture file per side instead of being returned to the kernel.  Map lifetimes
+* run on the capture time stamps, so expiry happens as it did when the traffic was
+* captured however fast it is replayed.
+*/
+class fnPcapReplay : public fnPacketSource, public fnPacketSink, public fnClock
+{
+	public:
+		fnPcapReplay(uint32_t nInternalIfIndex, uint32_t nExternalIfIndex);
+		virtual ~fnPcapReplay();
+
+		FN_STATUS openInput(REPLAY_SIDE side, const std::string &path);
+		FN_STATUS openOutput(REPLAY_SIDE side, const std::string &path);
+
+		virtual FN_STATUS run(fnTraceRing *pTrace);
+		void report() const;
+
+		virtual FN_STATUS accept(fnPacket &packet);
+		virtual FN_STATUS drop(fnPacket &packet);
+		virtual FN_STATUS transmit(fnPacket &packet);
+
+		virtual time_t now();
+
+	protected:
+		FN_STATUS fill(REPLAY_SIDE side);
+		FN_STATUS write(fnPacket &packet);
+
+	private:
+		fnPcapReader	m_readers[REPLAY_SIDE_COUNT];
+		fnPcapWriter	m_writers[REPLAY_SIDE_COUNT];
+		unsigned char	m_buffers[REPLAY_SIDE_COUNT][FN_PCAP_SNAPLEN] __attribute__((aligned(8)));	///< IP headers must be aligned
+		bool		m_bPending[REPLAY_SIDE_COUNT];	///< a packet of the side waits in m_buffers
+		int		m_nLengths[REPLAY_SIDE_COUNT];
+		uint64_t	m_nTimestamps[REPLAY_SIDE_COUNT];
+		uint32_t	m_nIfIndexes[REPLAY_SIDE_COUNT];
+		uint64_t	m_nNow;		///< time stamp of the packet being processed
+		uint64_t	m_nPackets;
+		uint64_t	m_nAccepted;
+		uint64_t	m_nDropped;
+		uint64_t	m_nTransmitted;
+		double		m_fElapsed;	///< wall clock seconds spent in run
+};
+
+#endif
@@ -0,0 +1,211 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+/**
+* @file fnPortPool.cpp
+* @author Jeremy Beker
+* @version
+*
+* @overview Bitmap allocator for external ports
+*/
+
+#include <stddef.h>
+#include <string.h>
+
+#include "fnPortPool.h"
+
+// Port bit i of a word is port (word * 64 + i), so even ports sit on even bits
+static const uint64_t s_classMask[PORT_CLASS_COUNT] =
+{
+	0xFFFFFFFFFFFFFFFFULL,
+	0x5555555555555555ULL,
+	0xAAAAAAAAAAAAAAAAULL,
+};
+
+/**
+* @brief Constructor for fnPortPool class
+*
+* @param low [IN] Lowest port handed out
+* @param high [IN] Highest port handed out
+*/
+fnPortPool::fnPortPool(uint16_t low, uint16_t high)
+{
+	setRange(low, high);
+}
+
+/**
+* @brief Destructor for fnPortPool class
+*/
+fnPortPool::~fnPortPool()
+{
+}
+
+/**
+* @brief Resets the pool so that exactly the ports in [low, high] are free
+*
+* @detailed Port 0 is never handed out, since allocate uses it to report exhaustion.
+*
+* @param low [IN] Lowest port handed out
+* @param high [IN] Highest port handed out
+*/
+void fnPortPool::setRange(uint16_t low, uint16_t high)
+{
+	if (low == 0)
+	{
+		low = 1;
+	}
+
+	m_nLow = low;
+	m_nHigh = high;
+	m_nFree = 0;
+
+	memset(m_free, 0, sizeof(m_free));
+	memset(m_summary, 0, sizeof(m_summary));
+	memset(m_top, 0, sizeof(m_top));
+
+	for (unsigned int port = low; port <= high; port++)
+	{
+		m_free[port >> 6] |= 1ULL << (port & 63);
+		m_nFree++;
+	}
+
+	for (unsigned int word = 0; word < FN_PORT_WORDS; word++)
+	{
+		updateSummary(word);
+	}
+}
+
+/**
+* @brief Recomputes the summary bits of one port word
+*/
+void fnPortPool::updateSummary(unsigned int word)
+{
+	unsigned int s = word >> 6;
+	uint64_t bit = 1ULL << (word & 63);
+
+	for (unsigned int cls = 0; cls < PORT_CLASS_COUNT; cls++)
+	{
+		if (m_free[word] & s_classMask[cls])
+		{
+			m_summary[cls][s] |= bit;
+		}
+		else
+		{
+			m_summary[cls][s] &= ~bit;
+		}
+
+		if (m_summary[cls][s])
+		{
+			m_top[cls] |= (uint16_t)(1 << s);
+		}
+		else
+		{
+			m_top[cls] &= (uint16_t)~(1 << s);
+		}
+	}
+}
+
+/**
+* @brief Claims a specific port
+*
+* @param port [IN] Port wanted
+*
+* @return true if the port was free and is now taken
+*/
+bool fnPortPool::reserve(uint16_t port)
+{
+	if (!isFree(port))
+	{
+		return false;
+	}
+
+	m_free[port >> 6] &= ~(1ULL << (port & 63));
+	m_nFree--;
+	updateSummary(port >> 6);
+
+	return true;
+}
+
+/**
+* @brief Claims the lowest free port of a class
+*
+* @param cls [IN] Any port, or only even or odd ports
+*
+* @return The port taken, or 0 if no port of the class is free
+*/
+uint16_t fnPortPool::allocate(PORT_CLASS cls)
+{
+	unsigned int s;
+	unsigned int word;
+	uint16_t port;
+
+	if (m_top[cls] == 0)
+	{
+		return 0;
+	}
+
+	s = __builtin_ctz(m_top[cls]);
+	word = (s << 6) + __builtin_ctzll(m_summary[cls][s]);
+	port = (uint16_t)((word << 6) + __builtin_ctzll(m_free[word] & s_classMask[cls]));
+
+	m_free[word] &= ~(1ULL << (port & 63));
+	m_nFree--;
+	updateSummary(word);
+
+	return port;
+}
+
+/**
+* @brief Returns a port to the pool
+*
+* @detailed Ports outside of the configured range are ignored, so releasing a port that
+*			was never allocated (e.g. one used through port overloading) is harmless.
+*
+* @param port [IN] Port to be freed
+*/
+void fnPortPool::release(uint16_t port)
+{
+	if (port < m_nLow || port > m_nHigh || isFree(port))
+	{
+		return;
+	}
+
+	m_free[port >> 6] |= 1ULL << (port & 63);
+	m_nFree++;
+	updateSummary(port >> 6);
+}
+
+/**
+* @brief Returns if a port is free
+*/
+bool fnPortPool::isFree(uint16_t port) const
+{
+	return (m_free[port >> 6] >> (port & 63)) & 1;
+}
+
+/**
+* @brief Returns the number of free ports
+*/
+unsigned int fnPortPool::available() const
+{
+	return m_nFree;
+}
@@ -0,0 +1,72 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#ifndef FN_FNPORTPOOL_H // one-time include
+#define FN_FNPORTPOOL_H
+
+#include <stdint.h>
+
+#define FN_PORT_WORDS 1024		///< 65536 ports, one bit each
+#define FN_PORT_SUMMARY_WORDS 16	///< one bit per port word
+
+typedef enum _PORT_CLASS
+{
+	PORT_CLASS_ANY,
+	PORT_CLASS_EVEN,
+	PORT_CLASS_ODD,
+	PORT_CLASS_COUNT,
+} PORT_CLASS;
+
+/**
+* Bitmap of free ports.  Each port word has a bit in a summary word per port class
+* (any/even/odd) and each summary word a bit in a top level word, so the lowest free
+* port of a class is found with three find-first-set operations no matter how full
+* the pool is.
+*/
+class fnPortPool
+{
+	public:
+		fnPortPool(uint16_t low = 1024, uint16_t high = 65535);
+		~fnPortPool();
+
+		void setRange(uint16_t low, uint16_t high);
+
+		bool reserve(uint16_t port);
+		uint16_t allocate(PORT_CLASS cls = PORT_CLASS_ANY);
+		void release(uint16_t port);
+
+		bool isFree(uint16_t port) const;
+		unsigned int available() const;
+
+	protected:
+		void updateSummary(unsigned int word);
+
+	private:
+		uint64_t	m_free[FN_PORT_WORDS];	///< bit set = port free
+		uint64_t	m_summary[PORT_CLASS_COUNT][FN_PORT_SUMMARY_WORDS];
+		uint16_t	m_top[PORT_CLASS_COUNT];
+		uint16_t	m_nLow;
+		uint16_t	m_nHigh;
+		unsigned int	m_nFree;
+};
+
+#endif
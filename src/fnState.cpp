@@ -30,75 +30,135 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include <arpa/inet.h>
 #include <stddef.h>
+#include <string.h>
+#include <time.h>
 #include "fnState.h"
 #include "fnOptions.h"
+#include "fnLog.h"
 
 // Ensure that the singleton instance always starts out as NULL.
 fnState* fnState::s_Instance = NULL;
 
+// Time base used unless a packet source supplies its own
+static fnWallClock s_wallClock;
+
 /**
 * @brief Constructor for fnState class
 * 
-* @detailed Populates free port lists
-* 
-* @post
-* - m_availUDPPorts is populated
-* - m_availTCPPorts is populated
+* @detailed The shards are created by initialize, once the options are known.
 */
 fnState::fnState()
 {
-	for (unsigned short i=0;i< 1024;i++)
+	m_pShards = NULL;
+	m_nShards = 0;
+	m_pClock = &s_wallClock;
+	m_lastExpiry = 0;
+	memset((void*)m_portShards, 0, sizeof(m_portShards));
+	pthread_mutex_init(&m_portLock, NULL);
+}
+
+/**
+* @brief Applies the configuration to the state tables
+* 
+* @detailed Must be called once the options have been parsed and before any maps are created.
+* 
+* @return Success or failure
+* 
+* @retval FN_S_OK success
+*/
+FN_STATUS fnState::initialize()
+{
+	fnOptions *pOptions = fnOptions::getInstance();
+	uint16_t low;
+	uint16_t high;
+	
+	unsigned int max_maps;
+	unsigned int shards;
+	
+	pOptions->getPortRange(low, high);
+	pOptions->getMaxMaps(max_maps);
+	pOptions->getShards(shards);
+	
+	m_portsUDP.setRange(low, high);
+	m_portsTCP.setRange(low, high);
+	m_idsICMP.setRange(1, 65535);
+	
+	m_pShards = new state_shard[shards];
+	m_nShards = shards;
+	
+	// the limit is split evenly, the hash spreads endpoints evenly enough for that
+	for (unsigned int n = 0; n < m_nShards; n++)
 	{
-		m_mapUDPPorts[i] = false;
-		m_mapTCPPorts[i] = false;
+		m_pShards[n].pool.setLimit((max_maps + shards - 1) / shards);
+		m_pShards[n].wheel.rebase(now());
 	}
 	
-	for (unsigned short i=1024;i< 65535 ;i++)
+	return FN_S_OK;
+}
+
+/**
+* @brief Replaces the clock map activity and lifetimes are measured with
+* 
+* @detailed Must be called before any map is created, the timer wheels are moved to the
+*			new clock's current time.  The clock has to outlive its use by fnState.
+* 
+* @param pClock [IN] New time base, NULL for the wall clock
+*/
+void fnState::setClock(fnClock *pClock)
+{
+	m_pClock = (pClock != NULL) ? pClock : &s_wallClock;
+	m_lastExpiry = 0;
+	
+	for (unsigned int n = 0; n < m_nShards; n++)
 	{
-		m_mapUDPPorts[i] = true;
-		m_mapTCPPorts[i] = true;
+		if (!m_pShards[n].wheel.rebase(now()))
+		{
+			FN_WARN("fnState::setClock: shard %u already holds maps\n", n);
+		}
 	}
-	
-	// TODO: remove reserved ports from configuration
+}
 
+/**
+* @brief Returns the current time of the state's clock
+*/
+time_t fnState::now() const
+{
+	return m_pClock->now();
 }
 
 /**
 * @brief Destructor for fnState class
 * 
-* @detailed Deletes all of the map entries that have been created
+* @detailed Returns all of the map entries that have been created to the pool, which
+*			frees them along with its slabs
 * 
 * @post
-* - m_mapsUDP is empty
-* - m_mapsTCP is empty
-* - m_mapsICMP is empty
+* - the shards are freed
+* - getInstance creates a new instance
 */
 fnState::~fnState()
 {
- 	for(std::list<nat_map_entry *>::iterator i=m_mapsUDP.begin();
-		i != m_mapsUDP.end(); i++ )
+	for (unsigned int n = 0; n < m_nShards; n++)
 	{
-		nat_map_entry * pEntry = *i;
-		m_mapsUDP.erase(i);
-		delete pEntry;
-	}
-
-	for(std::list<nat_map_entry *>::iterator i=m_mapsTCP.begin();
-		i != m_mapsTCP.end(); i++ )
-	{
-		nat_map_entry * pEntry = *i;
-		m_mapsTCP.erase(i);
-		delete pEntry;
+		nat_map_entry *pEntry = m_pShards[n].wheel.removeAll();
+		
+		while (pEntry != NULL)
+		{
+			nat_map_entry *pNext = pEntry->timer_next;
+			m_pShards[n].pool.release(pEntry);
+			pEntry = pNext;
+		}
 	}
-	for(std::list<nat_map_entry *>::iterator i=m_mapsICMP.begin();
-		i != m_mapsICMP.end(); i++ )
+	
+	delete [] m_pShards;
+	
+	pthread_mutex_destroy(&m_portLock);
+	
+	// a later getInstance starts over with empty tables
+	if (s_Instance == this)
 	{
-		nat_map_entry * pEntry = *i;
-		m_mapsICMP.erase(i);
-		delete pEntry;
+		s_Instance = NULL;
 	}
-
-
 }
 
 /**
@@ -124,30 +184,52 @@ fnState* fnState::getInstance()
 }
 
 /**
-* @brief Returns a free UDP port based on configuration rules
+* @brief Returns a free external port based on configuration rules
+* 
+* @detailed Based on the rules specified by the user, return the next available port
+*			from the pool of the protocol
 * 
-* @detailed Based on the rules specified by the user, return the next available UDP port
+* @param protocol [IN] PROTO_UDP, PROTO_TCP or PROTO_ICMP
+* @param old [IN] Internal port (ICMP query identifier) of the flow
 * 
-* @return A UDP port number
+* @return A port number, 0 if none are available
 */
-unsigned short fnState::getFreeUDPPort(const unsigned short old)
+unsigned short fnState::getFreePort(const uint8_t protocol, const unsigned short old)
 {
 	fnOptions *pOptions = fnOptions::getInstance();
-	unsigned short ret;
+	fnPortPool *pPool = &m_portsUDP;
+	unsigned short ret = 0;
 	PORT_ASSIGNMENT_METHOD port_method;
 	PORT_PARITY parity_method;
 	
 	pOptions->getPortAssigmentMethod(port_method);
 	pOptions->getPortParity(parity_method);
+	
+	if (protocol == PROTO_TCP)
+	{
+		pPool = &m_portsTCP;
+	}
+	else if (protocol == PROTO_ICMP)
+	{
+		// replies carry nothing but the identifier, so it can never be shared
+		pPool = &m_idsICMP;
+		parity_method = PARITY_DISABLED;
+		
+		if (port_method == PORT_OVERLOAD)
+		{
+			port_method = PORT_PRESERVE;
+		}
+	}
+
+	pthread_mutex_lock(&m_portLock);
 
 	switch(port_method)
 	{
 		// if we can preserve the old port number, do so, otherwise fall through
 		case PORT_PRESERVE:
 		{
-			if (m_mapUDPPorts[old])
+			if (pPool->reserve(old))
 			{
-				m_mapUDPPorts[old] = false;
 				ret = old;
 				break;
 			}
@@ -155,24 +237,14 @@ unsigned short fnState::getFreeUDPPort(const unsigned short old)
 		
 		case PORT_NONE:
 		{
-			unsigned short base = 0;
-			unsigned short inc = 1;
+			PORT_CLASS cls = PORT_CLASS_ANY;
 			
 			if (parity_method == PARITY_ENABLED)
 			{
-				base = old%2?1:0;  // old is even, set base to 0, otherwise 1
-				inc = 2;
+				cls = old%2 ? PORT_CLASS_ODD : PORT_CLASS_EVEN;  // keep the parity of the old port
 			}
 		
-			for (unsigned short i=base;i< 65535 ;i+=inc)
-			{
-				if (m_mapUDPPorts[i])
-				{
-					m_mapUDPPorts[i] = false;
-					ret = i;
-					break;
-				}
-			}
+			ret = pPool->allocate(cls);
 			break;
 		}
 	
@@ -181,575 +253,1097 @@ unsigned short fnState::getFreeUDPPort(const unsigned short old)
 			break;
 	}
 
+	pthread_mutex_unlock(&m_portLock);
+
 	return ret;
 }
 
 /**
-* @brief Returns a free TCP port based on configuration rules
-* 
-* @detailed Based on the rules specified by the user, return the next available TCP port
+* @brief Returns an external port to the pool of its protocol
 * 
-* @return A TCP port number
+* @param protocol [IN] IP protocol of the map that held the port
+* @param port [IN] Port to be freed
 */
-unsigned short fnState::getFreeTCPPort()
+void fnState::releasePort(uint8_t protocol, uint16_t port)
 {
-	for (unsigned short i=0;i< 65535 ;i++)
+	pthread_mutex_lock(&m_portLock);
+	
+	if (protocol == PROTO_TCP)
 	{
-		if (m_mapTCPPorts[i])
-		{
-			m_mapTCPPorts[i] = false;
-			return i;
-		}
+		m_portsTCP.release(port);
+	}
+	else if (protocol == PROTO_ICMP)
+	{
+		m_idsICMP.release(port);
+	}
+	else
+	{
+		m_portsUDP.release(port);
 	}
 	
-	return 0;
+	pthread_mutex_unlock(&m_portLock);
 }
 
 /**
-* @brief getOutBoundMap returns an existing outbound map - UDP version
+* @brief Returns the shard that holds the maps of an internal endpoint
 * 
-* @detailed getOutBoundMap takes a packet that is being investigated and returns an
-*			outbound map (if it exists) that can be used to transform the packet.
-* 
-* @param udp [IN] Packet to be sent
-* @param map [OUT] Resultant map to be filled in
+* @detailed All of an endpoint's maps share a shard whatever the mapping method, so
+*			reusing or preserving its external port never crosses shards.
 * 
-* @return Status of map search
+* @param src_ip [IN] Internal address
+* @param src_port [IN] Internal port
 * 
-* @retval FN_E_NO_MAP_FOUND No existing maps were found
-* @retval FN_E_INVALID_PROTOCOL Invalid protocol
-* @retval FN_S_OK Map found and copied to out param
+* @return Index into m_pShards
 */
-FN_STATUS fnState::getOutBoundMap(const udp_packet_tuple& udp, nat_map_entry& map)
+unsigned int fnState::shardFor(uint32_t src_ip, uint16_t src_port) const
 {
-	FN_STATUS ret = FN_E_NO_MAP_FOUND;
-	fnOptions *pOptions = fnOptions::getInstance();
-	std::list<nat_map_entry *>::iterator iterEntry;
+	uint64_t h = (((uint64_t)src_ip << 16) | src_port) * 0x9e3779b97f4a7c15ULL;
 	
-	for(std::list<nat_map_entry *>::iterator i=m_mapsUDP.begin();
-		i != m_mapsUDP.end() && ret == FN_E_NO_MAP_FOUND;
-		i++ )
-	{
-		nat_map_entry * pEntry = *i;
-		
-		if (pEntry->protocol != PROTO_UDP)
-		{
-			ret = FN_E_INVALID_PROTOCOL;
-		}
-		else
-		{
-			MAPPING_METHOD method;
-			pOptions->getMappingMethod(method);
-			
-			switch (method)
-			{
-				case MAP_INDEPENDENT:
-				{
-					if (pEntry->inside_udp.src_ip == udp.src_ip && 
-						pEntry->inside_udp.src_port == udp.src_port)
-					{
-						//printf("fnState::getOutBoundMap: Found existing map\n");
-		
-						duplicateMap(*pEntry,map);
-		
-						map.inside_udp.dest_ip = udp.dest_ip;
-						map.inside_udp.dest_port = udp.dest_port;
-		
-						map.outside_udp.dest_ip = udp.dest_ip;
-						map.outside_udp.dest_port = udp.dest_port;
-		
-						iterEntry = i;
-		
-						ret = FN_S_OK;
-					}
-				}
-				break;
-				
-				case MAP_ADDRESS_DEPENDENT:
-				{
-					if (pEntry->inside_udp.src_ip == udp.src_ip && 
-						pEntry->inside_udp.src_port == udp.src_port &&
-						pEntry->outside_udp.dest_ip == udp.dest_ip)
-					{
-						//printf("fnState::getOutBoundMap: Found existing map\n");
-		
-						duplicateMap(*pEntry,map);
-		
-						map.inside_udp.dest_ip = udp.dest_ip;
-						map.inside_udp.dest_port = udp.dest_port;
-		
-						map.outside_udp.dest_ip = udp.dest_ip;
-						map.outside_udp.dest_port = udp.dest_port;
-		
-						iterEntry = i;
-
-						ret = FN_S_OK;
-					}
-				}
-				break;
-
-				case MAP_ADDRESS_PORT_DEPENDENT:
-				{
-					if (pEntry->inside_udp.src_ip == udp.src_ip && 
-						pEntry->inside_udp.src_port == udp.src_port &&
-						pEntry->outside_udp.dest_ip == udp.dest_ip &&
-						pEntry->outside_udp.dest_port == udp.dest_port)
-					{
-						//printf("fnState::getOutBoundMap: Found existing map\n");
-		
-						duplicateMap(*pEntry,map);
-		
-						map.inside_udp.dest_ip = udp.dest_ip;
-						map.inside_udp.dest_port = udp.dest_port;
-		
-						map.outside_udp.dest_ip = udp.dest_ip;
-						map.outside_udp.dest_port = udp.dest_port;
-		
-						iterEntry = i;
+	return (unsigned int)((h >> 32) % m_nShards);
+}
 
-						ret = FN_S_OK;
-					}
-				}
-				break;
-				default:
-					break;		
-			}
-			
-		}
-	
-	}
-	
-	// Check timestamp on map if we found one.
+/**
+* @brief Returns the row of m_portShards used for a protocol
+*/
+unsigned int fnState::protocolSlot(uint8_t protocol)
+{
+	unsigned int ret = 0;
 	
-	if (SUCCEEDED(ret))
+	switch (protocol)
 	{
-		time_t current;
-		time_t max;
-		MAPPING_REFRESH_METHOD method;
-			
-		// get current time
-		current = time(NULL);
-
-		// get max lifetime and refresh method from options
-		pOptions->getMappingLifetime(max);
-		pOptions->getMapRefreshMethod(method);
-
-		// if map age is less than max 
-
-		//printf ("time difference: %d\n", (int)(current - map.activity));
-
-		if (current - map.activity < max)
-		{
-			// if  mode is update on outbound, update timestamp
-			if (method == REFRESH_BOTH || method == REFRESH_OUT)
-			{
-				//printf("fnState::getOutBoundMap: map timestamp updated\n");
-				map.activity = current;	
-			}
-			else
-			{
-				//printf("fnState::getOutBoundMap: map timestamp NOT updated\n");
-			}
-		}
-		else
-		{
-			printf("fnState::getOutBoundMap: map expired\n");
-			// free up port
-			m_mapUDPPorts[map.outside_udp.src_port] = true;
+		case PROTO_TCP:
+			ret = 1;
+			break;
 		
-			// delete map, change return code
-			m_mapsUDP.erase(iterEntry);
-			ret = FN_E_NO_MAP_FOUND;
-		}
+		case PROTO_ICMP:
+			ret = 2;
+			break;
+		
+		default:
+			break;
 	}
 	
 	return ret;
 }
 
 /**
-* @brief getOutBoundMap returns an existing outbound map - TCP version
+* @brief getOutBoundMap returns an existing outbound map - UDP version
 * 
 * @detailed getOutBoundMap takes a packet that is being investigated and returns an
 *			outbound map (if it exists) that can be used to transform the packet.
 * 
 * @param udp [IN] Packet to be sent
-* @param map [OUT] Resultant map to be filled in
+* @param map [OUT] Handle to the stored map and the translated tuple
 * 
 * @return Status of map search
 * 
 * @retval FN_E_NO_MAP_FOUND No existing maps were found
 * @retval FN_E_INVALID_PROTOCOL Invalid protocol
-* @retval FN_S_OK Map found and copied to out param
+* @retval FN_S_OK Map found, map filled in
 */
-FN_STATUS fnState::getOutBoundMap(const tcp_packet_tuple& udp, nat_map_entry& map)
+FN_STATUS fnState::getOutBoundMap(const udp_packet_tuple& udp, nat_map_view& map)
 {
-	FN_STATUS ret = FN_E_NO_MAP_FOUND;
-	
-	return ret;
+	return findOutBoundMap(PROTO_UDP, udp, 0, map);
 }
 
 /**
-* @brief getOutBoundMap returns an existing outbound map - ICMP version
+* @brief getOutBoundMap returns an existing outbound map - TCP version
 * 
 * @detailed getOutBoundMap takes a packet that is being investigated and returns an
 *			outbound map (if it exists) that can be used to transform the packet.
+*			The packet's flags advance the connection state of the map; a reset
+*			removes the map once the view has been filled in, leaving map.entry NULL.
 * 
-* @param udp [IN] Packet to be sent
-* @param map [OUT] Resultant map to be filled in
+* @param tcp [IN] Packet to be sent
+* @param flags [IN] TCP flags of the packet
+* @param map [OUT] Handle to the stored map and the translated tuple
 * 
 * @return Status of map search
 * 
 * @retval FN_E_NO_MAP_FOUND No existing maps were found
 * @retval FN_E_INVALID_PROTOCOL Invalid protocol
-* @retval FN_S_OK Map found and copied to out param
+* @retval FN_S_OK Map found, map filled in
 */
-FN_STATUS fnState::getOutBoundMap(const icmp_packet_tuple& udp, nat_map_entry& map)
+FN_STATUS fnState::getOutBoundMap(const tcp_packet_tuple& tcp, const uint8_t flags, nat_map_view& map)
 {
-	FN_STATUS ret = FN_E_NO_MAP_FOUND;
+	udp_packet_tuple tuple;
 	
-	return ret;
+	tuple.src_ip = tcp.src_ip;
+	tuple.dest_ip = tcp.dest_ip;
+	tuple.src_port = tcp.src_port;
+	tuple.dest_port = tcp.dest_port;
+	
+	return findOutBoundMap(PROTO_TCP, tuple, flags, map);
 }
 
 /**
-* @brief getInBoundMap generates a map to transform an inbound packet - UDP version
+* @brief getOutBoundMap returns an existing outbound map - ICMP version
 * 
-* @detailed Generate a new map based upon an existing map to transform the 
-*			inbound packet to an internal packet.
+* @detailed getOutBoundMap takes a query that is being investigated and returns an
+*			outbound map (if it exists) that can be used to transform the packet.
+*			The query identifier is mapped like a source port.
 * 
-* @param udp [IN] Packet to be sent
-* @param map [OUT] Resultant map to be filled in
+* @param icmp [IN] Packet to be sent
+* @param map [OUT] Handle to the stored map and the translated tuple
 * 
 * @return Status of map search
 * 
 * @retval FN_E_NO_MAP_FOUND No existing maps were found
 * @retval FN_E_INVALID_PROTOCOL Invalid protocol
-* @retval FN_S_OK Map found and copied to out param
+* @retval FN_S_OK Map found, map filled in
 */
-FN_STATUS fnState::getInBoundMap(const udp_packet_tuple& udp, nat_map_entry& map)
+FN_STATUS fnState::getOutBoundMap(const icmp_packet_tuple& icmp, nat_map_view& map)
 {
-	FN_STATUS ret = FN_E_NO_MAP_FOUND;
-	fnOptions *pOptions = fnOptions::getInstance();
-	std::list<nat_map_entry *>::iterator iterEntry;
-
-
-
-	for(std::list<nat_map_entry *>::iterator i=m_mapsUDP.begin();
-		i != m_mapsUDP.end() && ret == FN_E_NO_MAP_FOUND;
-		i++ )
-	{
-		// TODO make compare based on filter configuration
-		
-		nat_map_entry * pEntry = *i;
-
-		if (pEntry->protocol != PROTO_UDP)
-		{
-			ret = FN_E_FAIL;
-		}
-		else
-		{
-			FILTER_METHOD method;
-			pOptions->getFilterMethod(method);
-
-			switch (method)
-			{
-				case FILTER_INDEPENDENT:
-				{
-					// Endpoint-Independant Filtering
-					if (pEntry->outside_udp.src_ip == udp.dest_ip && 
-						pEntry->outside_udp.src_port == udp.dest_port)
-					{
-						//printf("fnState::getInBoundMap: Found existing map\n");
-
-						duplicateMap(*pEntry,map);
-
-						// Update map entry with specific info
-				
-						// Swap interfaces
-						map.out_interface = pEntry->in_interface;
-						map.in_interface = pEntry->out_interface;
-				
-						// The new destination should be the original src
-						map.inside_udp.dest_ip = map.inside_udp.src_ip;
-						map.inside_udp.dest_port = map.inside_udp.src_port;
-					
-						// New source should be the actual source of the packet
-						map.inside_udp.src_ip = udp.src_ip;
-						map.inside_udp.src_port = udp.src_port;
-	
-						iterEntry = i;
-						
-						ret = FN_S_OK;
-					}
-				}
-				break;
-				
-				case FILTER_ADDRESS_DEPENDENT:
-				{
-					if (pEntry->outside_udp.src_ip == udp.dest_ip && 
-						pEntry->outside_udp.src_port == udp.dest_port &&
-						pEntry->outside_udp.dest_ip == udp.src_ip)
-					{
-						//printf("fnState::getInBoundMap: Found existing map\n");
-
-						duplicateMap(*pEntry,map);
-
-						// Update map entry with specific info
-				
-						// Swap interfaces
-						map.out_interface = pEntry->in_interface;
-						map.in_interface = pEntry->out_interface;
-				
-						// The new destination should be the original src
-						map.inside_udp.dest_ip = map.inside_udp.src_ip;
-						map.inside_udp.dest_port = map.inside_udp.src_port;
-					
-						// New source should be the actual source of the packet
-						map.inside_udp.src_ip = udp.src_ip;
-						map.inside_udp.src_port = udp.src_port;
-	
-						iterEntry = i;
-							
-						ret = FN_S_OK;
-					}
-				}
-				break;
-				
-				case FILTER_ADDRESS_PORT_DEPENDENT:
-				{
-					// Endpoint-Independant Filtering
-					if (pEntry->outside_udp.src_ip == udp.dest_ip && 
-						pEntry->outside_udp.src_port == udp.dest_port &&
-						pEntry->outside_udp.dest_ip == udp.src_ip &&
-						pEntry->outside_udp.dest_port == udp.src_port)
-					{
-						//printf("fnState::getInBoundMap: Found existing map\n");
-
-						duplicateMap(*pEntry,map);
-
-						// Update map entry with specific info
-				
-						// Swap interfaces
-						map.out_interface = pEntry->in_interface;
-						map.in_interface = pEntry->out_interface;
-				
-						// The new destination should be the original src
-						map.inside_udp.dest_ip = map.inside_udp.src_ip;
-						map.inside_udp.dest_port = map.inside_udp.src_port;
-					
-						// New source should be the actual source of the packet
-						map.inside_udp.src_ip = udp.src_ip;
-						map.inside_udp.src_port = udp.src_port;
-	
-						iterEntry = i;
-						
-						ret = FN_S_OK;
-					}
-				}
-				break;
-				
-				default:
-					break;
-			}	
-		}
+	FN_STATUS ret;
+	udp_packet_tuple tuple;
 	
-	}
-	
-	// Check timestamp on map if we found one.
+	tuple.src_ip = icmp.src_ip;
+	tuple.dest_ip = icmp.dest_ip;
+	tuple.src_port = icmp.id;
+	tuple.dest_port = 0;
 	
-	if (SUCCEEDED(ret))
-	{
-		time_t current;
-		time_t max;
-		MAPPING_REFRESH_METHOD method;
-			
-		// get current time
-		current = time(NULL);
-
-		// get max lifetime and refresh method from options
-		pOptions->getMappingLifetime(max);
-		pOptions->getMapRefreshMethod(method);
-
-	//	printf ("time difference: %d max: %d\n", (int)(current - map.activity),(int)max);
-
-
-		// if map age is less than max 
-		if (current - map.activity < max)
-		{
-			// if  mode is update on outbound, update timestamp
-			if (method == REFRESH_BOTH || method == REFRESH_IN)
-			{
-				//printf("fnState::getInBoundMap: map timestamp updated\n");
-				map.activity = current;	
-			}
-			else
-			{
-				//printf("fnState::getInBoundMap: map timestamp NOT updated\n");
-			}
-		}
-		else
-		{
-			//printf("fnState::getInBoundMap: map expired\n");
-			// free up port
-			m_mapUDPPorts[map.outside_udp.src_port] = true;
-		
-			// delete map, change return code
-			m_mapsUDP.erase(iterEntry);
-			ret = FN_E_NO_MAP_FOUND;
-		}
-	}
+	// the translated identifier lands in map.udp.src_port, which is map.icmp.id
+	ret = findOutBoundMap(PROTO_ICMP, tuple, 0, map);
 	
 	return ret;
 }
 
 /**
-* @brief getInBoundMap generates a map to transform an inbound packet - TCP version
+* @brief getInBoundMap generates a map to transform an inbound packet - UDP version
 * 
 * @detailed Generate a new map based upon an existing map to transform the 
 *			inbound packet to an internal packet.
 * 
 * @param udp [IN] Packet to be sent
-* @param map [OUT] Resultant map to be filled in
+* @param map [OUT] Handle to the stored map and the translated tuple
 * 
 * @return Status of map search
 * 
 * @retval FN_E_NO_MAP_FOUND No existing maps were found
 * @retval FN_E_INVALID_PROTOCOL Invalid protocol
-* @retval FN_S_OK Map found and copied to out param
+* @retval FN_S_OK Map found, map filled in
 */
-FN_STATUS fnState::getInBoundMap(const tcp_packet_tuple& udp, nat_map_entry& map)
+FN_STATUS fnState::getInBoundMap(const udp_packet_tuple& udp, nat_map_view& map)
 {
-	FN_STATUS ret = FN_E_NO_MAP_FOUND;
-	
-	return ret;
+	return findInBoundMap(PROTO_UDP, udp, 0, map);
 }
 
 /**
-* @brief getInBoundMap generates a map to transform an inbound packet - ICMP version
+* @brief getInBoundMap generates a map to transform an inbound packet - TCP version
 * 
 * @detailed Generate a new map based upon an existing map to transform the 
-*			inbound packet to an internal packet.
+*			inbound packet to an internal packet.  The packet's flags advance the
+*			connection state of the map; a reset removes the map once the view has
+*			been filled in, leaving map.entry NULL.
 * 
-* @param udp [IN] Packet to be sent
-* @param map [OUT] Resultant map to be filled in
+* @param tcp [IN] Packet to be sent
+* @param flags [IN] TCP flags of the packet
+* @param map [OUT] Handle to the stored map and the translated tuple
 * 
 * @return Status of map search
 * 
 * @retval FN_E_NO_MAP_FOUND No existing maps were found
 * @retval FN_E_INVALID_PROTOCOL Invalid protocol
-* @retval FN_S_OK Map found and copied to out param
+* @retval FN_S_OK Map found, map filled in
 */
-FN_STATUS fnState::getInBoundMap(const icmp_packet_tuple& udp, nat_map_entry& map)
+FN_STATUS fnState::getInBoundMap(const tcp_packet_tuple& tcp, const uint8_t flags, nat_map_view& map)
 {
-	FN_STATUS ret = FN_E_NO_MAP_FOUND;
+	udp_packet_tuple tuple;
 	
-	return ret;
+	tuple.src_ip = tcp.src_ip;
+	tuple.dest_ip = tcp.dest_ip;
+	tuple.src_port = tcp.src_port;
+	tuple.dest_port = tcp.dest_port;
+	
+	return findInBoundMap(PROTO_TCP, tuple, flags, map);
 }
 
 /**
-* @brief createOutBoundMap generates a map to transform based on a new packet
+* @brief getInBoundMap generates a map to transform an inbound packet - ICMP version
 * 
-* @detailed Generate a new map based upon an outbound packet to transform the 
-*			inside packet to an outside packet.
+* @detailed Generate a new map based upon an existing map to transform the 
+*			inbound query reply to an internal packet.  The query identifier is
+*			looked up like a destination port.
 * 
-* @param packet [IN] Packet to be sent
-* @param map [OUT] Resultant map to be filled in
+* @param icmp [IN] Packet to be sent
+* @param map [OUT] Handle to the stored map and the translated tuple
 * 
 * @return Status of map search
 * 
+* @retval FN_E_NO_MAP_FOUND No existing maps were found
 * @retval FN_E_INVALID_PROTOCOL Invalid protocol
-* @retval FN_S_OK Map found and copied to out param
+* @retval FN_S_OK Map found, map filled in
 */
-
-FN_STATUS fnState::createOutBoundMap(const fnPacket& packet, nat_map_entry& map)
+FN_STATUS fnState::getInBoundMap(const icmp_packet_tuple& icmp, nat_map_view& map)
 {
-	FN_STATUS ret = FN_E_UNDEFINED;
+	FN_STATUS ret;
+	udp_packet_tuple tuple;
 	
-	fnOptions *pOptions = fnOptions::getInstance();
-	nat_map_entry *pEntry = new nat_map_entry;
+	tuple.src_ip = icmp.src_ip;
+	tuple.dest_ip = icmp.dest_ip;
+	tuple.src_port = 0;
+	tuple.dest_port = icmp.id;
+	
+	ret = findInBoundMap(PROTO_ICMP, tuple, 0, map);
 	
-	switch (packet.getProtocol())
+	if (SUCCEEDED(ret))
 	{
+		// the internal identifier was written as the destination port
+		uint16_t id = map.udp.dest_port;
 		
-		case PROTO_UDP:
-		{
-			// Copy in known information
-			pEntry->protocol = PROTO_UDP;
-			packet.getPacketTuple(pEntry->inside_udp);
-			packet.getInboundInterface(pEntry->in_interface);
-			
-			// Copy over destination
+		map.icmp.id = id;
+		map.icmp.reserved = 0;
+	}
+	
+	return ret;
+}
+
+/**
+* @brief getInBoundErrorMap finds the map of a packet quoted by an inbound ICMP error
+* 
+* @detailed The quoted packet left through a map, so its source is the map's external
+*			endpoint and it is looked up like a packet coming back from its destination.
+*			Filtering applies to that destination, not to the router reporting the
+*			error.  Errors neither refresh the map nor advance its TCP state.
+* 
+* @param protocol [IN] Protocol of the quoted packet
+* @param embedded [IN] Tuple of the quoted packet, see fnPacket::getEmbeddedTuple
+* @param map [OUT] Handle to the stored map and the tuple to rewrite the quoted packet to
+* 
+* @return Status of map search
+* 
+* @retval FN_E_NO_MAP_FOUND No existing maps were found
+* @retval FN_E_INVALID_PROTOCOL Invalid protocol
+* @retval FN_S_OK Map found, map filled in
+*/
+FN_STATUS fnState::getInBoundErrorMap(const uint8_t protocol, const udp_packet_tuple& embedded, nat_map_view& map)
+{
+	FN_STATUS ret = FN_E_INVALID_PROTOCOL;
+	udp_packet_tuple tuple;
+	
+	tuple.src_ip = embedded.dest_ip;
+	tuple.src_port = embedded.dest_port;
+	tuple.dest_ip = embedded.src_ip;
+	tuple.dest_port = embedded.src_port;
+	
+	switch (protocol)
+	{
+		case PROTO_UDP:
+		case PROTO_TCP:
+		case PROTO_ICMP:
+			ret = findInBoundMap(protocol, tuple, 0, map, false);
+			break;
+			
+		default:
+			break;
+	}
+	
+	if (SUCCEEDED(ret))
+	{
+		// turn the reply tuple around, the quoted packet went from the internal host
+		tuple = map.udp;
+		map.udp.src_ip = tuple.dest_ip;
+		map.udp.src_port = tuple.dest_port;
+		map.udp.dest_ip = tuple.src_ip;
+		map.udp.dest_port = tuple.src_port;
+	}
+	
+	return ret;
+}
+
+/**
+* @brief findOutBoundMap looks up the outbound map of a UDP, TCP or ICMP query flow
+* 
+* @detailed UDP and TCP maps share the tuple layout, so both are handled through
+*			their UDP members; the view's tcp member reads the same storage.  ICMP
+*			query maps keep the identifier in the source port and 0 as the remote port.
+* 
+* @param protocol [IN] PROTO_UDP, PROTO_TCP or PROTO_ICMP
+* @param tuple [IN] Addresses and ports of the packet
+* @param flags [IN] TCP flags of the packet, 0 for UDP
+* @param map [OUT] Handle to the stored map and the translated tuple
+* 
+* @return Status of map search
+* 
+* @retval FN_E_NO_MAP_FOUND No existing maps were found
+* @retval FN_S_OK Map found, map filled in
+*/
+FN_STATUS fnState::findOutBoundMap(const uint8_t protocol, const udp_packet_tuple& tuple, const uint8_t flags, nat_map_view& map)
+{
+	FN_STATUS ret = FN_E_NO_MAP_FOUND;
+	fnOptions *pOptions = fnOptions::getInstance();
+	MAPPING_METHOD map_method;
+	nat_map_key key;
+	nat_map_entry * pEntry;
+	unsigned int nShard = shardFor(tuple.src_ip, tuple.src_port);
+	state_shard &shard = m_pShards[nShard];
+	
+	pOptions->getMappingMethod(map_method);
+	makeOutboundKey(protocol, tuple.src_ip, tuple.src_port, tuple.dest_ip, tuple.dest_port, map_method, key);
+	
+	pthread_mutex_lock(&shard.lock);
+	
+	pEntry = shard.indexOutbound.find(key);
+	
+	if (pEntry != NULL)
+	{
+		//printf("fnState::getOutBoundMap: Found existing map\n");
+		ret = useOutBoundMap(nShard, pEntry, protocol, tuple, flags, map);
+	}
+	
+	pthread_mutex_unlock(&shard.lock);
+	
+	return ret;
+}
+
+/**
+* @brief useOutBoundMap checks an outbound map found for a packet and accounts the packet to it
+* 
+* @detailed Fills in the view, then removes the map if its lifetime has run out, or
+*			refreshes it and advances its TCP state.  Shared by every path that finds
+*			an existing outbound map, so none of them can revive an expired map or
+*			skip the connection tracking.  The caller holds the shard's lock.
+* 
+* @param nShard [IN] Shard holding the entry
+* @param pEntry [IN] Map found for the packet
+* @param protocol [IN] PROTO_UDP, PROTO_TCP or PROTO_ICMP
+* @param tuple [IN] Addresses and ports of the packet
+* @param flags [IN] TCP flags of the packet, 0 for UDP
+* @param map [OUT] Handle to the stored map and the translated tuple
+* 
+* @retval FN_E_NO_MAP_FOUND The map had expired and was removed
+* @retval FN_S_OK Map in use, map filled in
+*/
+FN_STATUS fnState::useOutBoundMap(unsigned int nShard, nat_map_entry *pEntry, const uint8_t protocol,
+	const udp_packet_tuple& tuple, const uint8_t flags, nat_map_view& map)
+{
+	FN_STATUS ret = FN_S_OK;
+	fnOptions *pOptions = fnOptions::getInstance();
+	time_t current;
+	MAPPING_REFRESH_METHOD method;
+	
+	map.entry = pEntry;
+	map.out_ifindex = pEntry->out_ifindex;
+	
+	// Translated source, original destination
+	map.udp.src_ip = pEntry->outside_udp.src_ip;
+	map.udp.src_port = pEntry->outside_udp.src_port;
+	map.udp.dest_ip = tuple.dest_ip;
+	map.udp.dest_port = tuple.dest_port;
+	
+	// get current time
+	current = now();
+
+	// get refresh method from options
+	pOptions->getMapRefreshMethod(method);
+
+	// if map age is less than max 
+
+	//printf ("time difference: %d\n", (int)(current - pEntry->activity));
+
+	if (current - pEntry->activity < getLifetime(pEntry))
+	{
+		// if  mode is update on outbound, update timestamp
+		if (method == REFRESH_BOTH || method == REFRESH_OUT)
+		{
+			//printf("fnState::getOutBoundMap: map timestamp updated\n");
+			// the timer wheel picks up the new deadline when the entry's slot comes due
+			pEntry->activity = (uint32_t)current;
+		}
+		
+		if (protocol == PROTO_TCP)
+		{
+			trackTCP(nShard, pEntry, flags, true, map);
+		}
+	}
+	else
+	{
+		FN_DEBUG("fnState::getOutBoundMap: map expired\n");
+		// free up port, delete map, change return code
+		map.entry = NULL;
+		removeMap(nShard, pEntry);
+		ret = FN_E_NO_MAP_FOUND;
+	}
+	
+	return ret;
+}
+
+/**
+* @brief findInBoundMap looks up the map an inbound UDP, TCP or ICMP query packet belongs to
+* 
+* @detailed UDP and TCP maps share the tuple layout, so both are handled through
+*			their UDP members; the view's tcp member reads the same storage.  ICMP
+*			query maps keep the identifier in the source port and 0 as the remote port.
+*			An expired map the filter allows is removed and the search goes on with
+*			the next one on the same external port.
+* 
+* @param protocol [IN] PROTO_UDP, PROTO_TCP or PROTO_ICMP
+* @param tuple [IN] Addresses and ports of the packet
+* @param flags [IN] TCP flags of the packet, 0 for UDP
+* @param map [OUT] Handle to the stored map and the translated tuple
+* @param bRefresh [IN] false to leave the map's activity and TCP state alone
+* 
+* @return Status of map search
+* 
+* @retval FN_E_NO_MAP_FOUND No existing maps were found, or the filter rejected the packet
+* @retval FN_S_OK Map found, map filled in
+*/
+FN_STATUS fnState::findInBoundMap(const uint8_t protocol, const udp_packet_tuple& tuple, const uint8_t flags, nat_map_view& map, const bool bRefresh)
+{
+	FN_STATUS ret = FN_E_NO_MAP_FOUND;
+	fnOptions *pOptions = fnOptions::getInstance();
+	FILTER_METHOD filter_method;
+	nat_map_key key;
+	uint64_t shards;
+
+	pOptions->getFilterMethod(filter_method);
+	makeInboundKey(protocol, tuple.dest_port, key);
+
+	// Only the shards that hold maps on this port need to be searched, normally just one
+	shards = __atomic_load_n(&m_portShards[protocolSlot(protocol)][tuple.dest_port], __ATOMIC_ACQUIRE);
+
+	while (shards != 0 && ret != FN_S_OK)
+	{
+		unsigned int nShard = __builtin_ctzll(shards);
+		state_shard &shard = m_pShards[nShard];
+		nat_map_entry * pEntry;
+		
+		shards &= shards - 1;
+		
+		pthread_mutex_lock(&shard.lock);
+
+		// Every map on this external endpoint is a candidate, normally there is only one
+		pEntry = shard.indexInbound.find(key);
+		
+		while (pEntry != NULL)
+		{
+			nat_map_entry *pNext = pEntry->inbound_next;
+			bool bAllowed = false;
+			time_t current;
+			MAPPING_REFRESH_METHOD method;
+			
+			if (pEntry->outside_udp.src_ip != tuple.dest_ip)
+			{
+				pEntry = pNext;
+				continue;
+			}
+			
+			switch (filter_method)
+			{
+				case FILTER_INDEPENDENT:
+					// Endpoint-Independant Filtering
+					bAllowed = true;
+					break;
+				
+				case FILTER_ADDRESS_DEPENDENT:
+					bAllowed = (pEntry->outside_udp.dest_ip == tuple.src_ip);
+					break;
+				
+				case FILTER_ADDRESS_PORT_DEPENDENT:
+					bAllowed = (pEntry->outside_udp.dest_ip == tuple.src_ip &&
+						pEntry->outside_udp.dest_port == tuple.src_port);
+					break;
+				
+				default:
+					break;
+			}
+			
+			if (!bAllowed)
+			{
+				pEntry = pNext;
+				continue;
+			}
+			
+			// get current time
+			current = now();
+			
+			if (current - pEntry->activity >= getLifetime(pEntry))
+			{
+				//printf("fnState::getInBoundMap: map expired\n");
+				// free up port, delete map, and keep looking: a later map may still allow the packet
+				removeMap(nShard, pEntry);
+				pEntry = pNext;
+				continue;
+			}
+			
+			//printf("fnState::getInBoundMap: Found existing map\n");
+
+			map.entry = pEntry;
+			
+			// Goes back out the interface the map was created on
+			map.out_ifindex = pEntry->in_ifindex;
+	
+			// The new destination should be the original src
+			map.udp.dest_ip = pEntry->inside_udp.src_ip;
+			map.udp.dest_port = pEntry->inside_udp.src_port;
+		
+			// New source should be the actual source of the packet
+			map.udp.src_ip = tuple.src_ip;
+			map.udp.src_port = tuple.src_port;
+			
+			// get refresh method from options
+			pOptions->getMapRefreshMethod(method);
+
+			// if  mode is update on inbound, update timestamp
+			if (bRefresh && (method == REFRESH_BOTH || method == REFRESH_IN))
+			{
+				// the timer wheel picks up the new deadline when the entry's slot comes due
+				pEntry->activity = (uint32_t)current;
+			}
+			
+			if (bRefresh && protocol == PROTO_TCP)
+			{
+				trackTCP(nShard, pEntry, flags, false, map);
+			}
+			
+			ret = FN_S_OK;
+			break;
+		}
+		
+		pthread_mutex_unlock(&shard.lock);
+	}
+	
+	return ret;
+}
+
+/**
+* @brief trackTCP advances the connection state of a TCP map for a packet
+* 
+* @detailed The state is kept per map, so with endpoint independent mapping the
+*			connections of one internal endpoint are tracked together.  A map whose
+*			lifetime changes is rescheduled, and a reset removes it right away.  Only
+*			a reset exchanged with the remote endpoint the map was created for counts,
+*			so under independent filtering another host cannot close the map with a
+*			forged one.  The caller holds the shard's lock.
+* 
+* @param nShard [IN] Shard holding the entry
+* @param pEntry [IN] Map the packet belongs to
+* @param flags [IN] TCP flags of the packet
+* @param bOutbound [IN] true if the packet came from the inside
+* @param map [IN/OUT] View of the packet, entry is cleared if the map is removed
+* 
+*/
+void fnState::trackTCP(unsigned int nShard, nat_map_entry *pEntry, const uint8_t flags, const bool bOutbound, nat_map_view& map)
+{
+	uint8_t state = pEntry->tcp_state;
+	
+	if (flags & TCP_FLAG_RST)
+	{
+		// the view holds the remote endpoint as destination outbound and as source inbound
+		const tcp_packet_tuple &remote = pEntry->outside_tcp;
+		
+		if (bOutbound ? (map.tcp.dest_ip == remote.dest_ip && map.tcp.dest_port == remote.dest_port)
+			: (map.tcp.src_ip == remote.dest_ip && map.tcp.src_port == remote.dest_port))
+		{
+			state = TCP_CLOSED;
+		}
+	}
+	else if (flags & TCP_FLAG_SYN)
+	{
+		if (bOutbound && !(flags & TCP_FLAG_ACK))
+		{
+			// a new connection, unless this is a retransmission on a live one
+			if (state != TCP_ESTABLISHED)
+			{
+				state = TCP_SYN_SENT;
+				pEntry->tcp_fin = 0;
+			}
+		}
+		else if (state == TCP_SYN_SENT)
+		{
+			// answered, or a simultaneous open
+			state = TCP_ESTABLISHED;
+		}
+	}
+	else if ((flags & TCP_FLAG_FIN) && state != TCP_TIME_WAIT)
+	{
+		pEntry->tcp_fin |= bOutbound ? TCP_FIN_OUT : TCP_FIN_IN;
+		state = (pEntry->tcp_fin == (TCP_FIN_OUT | TCP_FIN_IN)) ? TCP_TIME_WAIT : TCP_FIN_WAIT;
+	}
+	
+	if (state == TCP_CLOSED)
+	{
+		map.entry = NULL;
+		removeMap(nShard, pEntry);
+	}
+	else if (state != pEntry->tcp_state)
+	{
+		pEntry->tcp_state = state;
+		m_pShards[nShard].wheel.schedule(pEntry, pEntry->activity + getLifetime(pEntry));
+	}
+}
+
+/**
+* @brief getLifetime returns how long a map may stay idle
+* 
+* @param pEntry [IN] Map entry
+* 
+* @return The lifetime of the entry's protocol and, for TCP, connection state
+*/
+time_t fnState::getLifetime(const nat_map_entry *pEntry)
+{
+	fnOptions *pOptions = fnOptions::getInstance();
+	time_t lifetime;
+	
+	if (pEntry->protocol == PROTO_TCP)
+	{
+		pOptions->getTCPLifetime((TCP_STATE)pEntry->tcp_state, lifetime);
+	}
+	else if (pEntry->protocol == PROTO_ICMP)
+	{
+		pOptions->getICMPLifetime(lifetime);
+	}
+	else
+	{
+		pOptions->getMappingLifetime(lifetime);
+	}
+	
+	return lifetime;
+}
+
+/**
+* @brief createOutBoundMap generates a map to transform based on a new packet
+* 
+* @detailed Generate a new map based upon an outbound packet to transform the 
+*			inside packet to an outside packet.  If a matching map already exists
+*			(created by another queue thread since the caller's lookup) it is used
+*			like getOutBoundMap would, or replaced if it has expired.
+*			TCP maps are only created by a connection's initial SYN and ICMP maps
+*			by an echo or timestamp request.
+* 
+* @param packet [IN] Packet to be sent
+* @param map [OUT] Handle to the stored map and the translated tuple
+* 
+* @return Status of map search
+* 
+* @retval FN_E_INVALID_PROTOCOL Invalid protocol
+* @retval FN_E_NO_MAP_FOUND A TCP packet other than an initial SYN, or an ICMP
+*			message other than a query request
+* @retval FN_E_PACKET_TRUNCATED The packet is cut short of its headers
+* @retval FN_E_NO_PORT_AVAILABLE The external port pool is exhausted
+* @retval FN_E_MAP_TABLE_FULL The configured maximum number of maps exist
+* @retval FN_S_OK Map found, map filled in
+*/
+
+FN_STATUS fnState::createOutBoundMap(const fnPacket& packet, nat_map_view& map)
+{
+	FN_STATUS ret = FN_E_UNDEFINED;
+	
+	fnOptions *pOptions = fnOptions::getInstance();
+	nat_map_entry *pEntry;
+	MAPPING_METHOD method;
+	nat_map_key key;
+	uint8_t protocol = packet.getProtocol();
+	
+	switch (protocol)
+	{
+		
+		case PROTO_UDP:
+		case PROTO_TCP:
+		case PROTO_ICMP:
+		{
+			udp_packet_tuple tuple;	// every map is kept through its UDP members, see findOutBoundMap
+			unsigned short port;
+			uint32_t ifindex;
+			unsigned int nShard;
+			nat_map_entry *pHead;
+			
+			if (protocol == PROTO_TCP)
+			{
+				tcp_packet_tuple tcp;
+				
+				if ((packet.getTCPFlags() & (TCP_FLAG_SYN | TCP_FLAG_ACK | TCP_FLAG_RST)) != TCP_FLAG_SYN)
+				{
+					ret = FN_E_NO_MAP_FOUND;
+					break;
+				}
+				
+				if (FAILED(packet.getPacketTuple(tcp)))
+				{
+					ret = FN_E_PACKET_TRUNCATED;
+					break;
+				}
+				
+				tuple.src_ip = tcp.src_ip;
+				tuple.dest_ip = tcp.dest_ip;
+				tuple.src_port = tcp.src_port;
+				tuple.dest_port = tcp.dest_port;
+			}
+			else if (protocol == PROTO_ICMP)
+			{
+				icmp_packet_tuple icmp;
+				uint8_t type = packet.getICMPType();
+				
+				if (type != ICMP_TYPE_ECHO_REQUEST && type != ICMP_TYPE_TIMESTAMP)
+				{
+					ret = FN_E_NO_MAP_FOUND;
+					break;
+				}
+				
+				if (FAILED(packet.getPacketTuple(icmp)))
+				{
+					ret = FN_E_PACKET_TRUNCATED;
+					break;
+				}
+				
+				tuple.src_ip = icmp.src_ip;
+				tuple.dest_ip = icmp.dest_ip;
+				tuple.src_port = icmp.id;
+				tuple.dest_port = 0;
+			}
+			else if (FAILED(packet.getPacketTuple(tuple)))
+			{
+				ret = FN_E_PACKET_TRUNCATED;
+				break;
+			}
+			
+			nShard = shardFor(tuple.src_ip, tuple.src_port);
+			state_shard &shard = m_pShards[nShard];
+			
+			pthread_mutex_lock(&shard.lock);
+			
+			// Another queue thread may have created the map since our lookup
+			pOptions->getMappingMethod(method);
+			makeOutboundKey(protocol, tuple.src_ip, tuple.src_port, tuple.dest_ip, tuple.dest_port, method, key);
+			pEntry = shard.indexOutbound.find(key);
+			if (pEntry != NULL && SUCCEEDED(useOutBoundMap(nShard, pEntry, protocol, tuple, packet.getTCPFlags(), map)))
+			{
+				pthread_mutex_unlock(&shard.lock);
+				ret = FN_S_OK;
+				break;
+			}
+			
+			port = getFreePort(protocol, tuple.src_port);
+			if (port == 0)
+			{
+				FN_WARN("fnState::createOutBoundMap: no free ports for protocol %d\n", protocol);
+				pthread_mutex_unlock(&shard.lock);
+				ret = FN_E_NO_PORT_AVAILABLE;
+				break;
+			}
+			
+			pEntry = shard.pool.allocate();
+			if (pEntry == NULL)
+			{
+				FN_WARN("fnState::createOutBoundMap: map table full\n");
+				releasePort(protocol, port);
+				pthread_mutex_unlock(&shard.lock);
+				ret = FN_E_MAP_TABLE_FULL;
+				break;
+			}
+			
+			// Copy in known information
+			pEntry->protocol = protocol;
+			pEntry->tcp_state = TCP_SYN_SENT;
+			pEntry->tcp_fin = 0;
+			pEntry->inside_udp = tuple;
+			pEntry->in_ifindex = packet.getInboundIfIndex();
+			
+			// Copy over destination
 			pEntry->outside_udp.dest_port = pEntry->inside_udp.dest_port;
 			pEntry->outside_udp.dest_ip = pEntry->inside_udp.dest_ip;
 			
 			// Set new information
-			pOptions->getExternalInterface(pEntry->out_interface);
+			pOptions->getExternalIfIndex(ifindex);
+			pEntry->out_ifindex = ifindex;
 			pOptions->getExternalIP(pEntry->outside_udp.src_ip);
-			pEntry->outside_udp.src_port = getFreeUDPPort(pEntry->inside_udp.src_port);
+			pEntry->outside_udp.src_port = port;
 			
-			pEntry->activity = time(NULL);
-
-			m_mapsUDP.push_front(pEntry);
-			duplicateMap(*pEntry,map);
+			pEntry->activity = (uint32_t)now();
+			
+			pEntry->timer_next = NULL;
+			pEntry->timer_pprev = NULL;
+			shard.wheel.schedule(pEntry, pEntry->activity + getLifetime(pEntry));
+			
+			shard.indexOutbound.insert(key, pEntry);
+			
+			// newest map goes to the front of the chain for its external port
+			makeInboundKey(protocol, pEntry->outside_udp.src_port, key);
+			pHead = shard.indexInbound.find(key);
+			pEntry->inbound_next = pHead;
+			shard.indexInbound.insert(key, pEntry);
+			
+			if (pHead == NULL)
+			{
+				// first map of this shard on the port, let inbound lookups find the shard
+				__sync_fetch_and_or(&m_portShards[protocolSlot(protocol)][port], 1ULL << nShard);
+			}
+			
+			map.entry = pEntry;
+			map.out_ifindex = pEntry->out_ifindex;
+			map.udp = pEntry->outside_udp;
+			
+			pthread_mutex_unlock(&shard.lock);
 			ret = FN_S_OK;
 			
 		}
 		break;
 			
-		case PROTO_TCP:
-		case PROTO_ICMP:
-
 		default:
 			ret = FN_E_INVALID_PROTOCOL;
-			printf("Unsupported protocol: %d\n",packet.getProtocol());
+			FN_DEBUG("Unsupported protocol: %d\n",packet.getProtocol());
 			break;
 	}		
 	
+	return ret;
+}
+
+/**
+* @brief expireMaps reclaims every map that has been idle for longer than its lifetime
+* 
+* @detailed Advances the timer wheel of each shard to the current time.  Refreshing a map
+*			only moves its activity timestamp, so entries that come due but were used since
+*			they were scheduled are put back on the wheel at their new deadline instead of
+*			being freed.  Every queue thread calls this; only the first call in a given
+*			second does any work.
+* 
+* @param now [IN] Current time
+* 
+*/
+void fnState::expireMaps(time_t now)
+{
+	time_t last = __atomic_load_n(&m_lastExpiry, __ATOMIC_RELAXED);
 	
+	if (last != now && __sync_bool_compare_and_swap(&m_lastExpiry, last, now))
+	{
+		for (unsigned int n = 0; n < m_nShards; n++)
+		{
+			state_shard &shard = m_pShards[n];
+			nat_map_entry *pEntry;
+			
+			pthread_mutex_lock(&shard.lock);
+			
+			pEntry = shard.wheel.advance(now);
+			
+			while (pEntry != NULL)
+			{
+				nat_map_entry *pNext = pEntry->timer_next;
+				time_t lifetime = getLifetime(pEntry);
+				
+				pEntry->timer_next = NULL;
+				
+				if (pEntry->activity + lifetime > now)
+				{
+					shard.wheel.schedule(pEntry, pEntry->activity + lifetime);
+				}
+				else
+				{
+					removeMap(n, pEntry);
+				}
+				
+				pEntry = pNext;
+			}
+			
+			pthread_mutex_unlock(&shard.lock);
+		}
+	}
+}
+
+/**
+* @brief makeOutboundKey builds the outbound index key for a flow
+* 
+* @detailed Only the fields the mapping method compares are filled in, so every flow
+*			that should share a map produces the same key.
+* 
+* @param protocol [IN] IP protocol of the flow
+* @param src_ip [IN] Internal source address
+* @param src_port [IN] Internal source port
+* @param dest_ip [IN] Remote address
+* @param dest_port [IN] Remote port
+* @param method [IN] Mapping method in use
+* @param key [OUT] Resultant key
+* 
+*/
+void fnState::makeOutboundKey(uint16_t protocol, uint32_t src_ip, uint16_t src_port,
+	uint32_t dest_ip, uint16_t dest_port, MAPPING_METHOD method, nat_map_key &key)
+{
+	key.protocol = protocol;
+	key.reserved = 0;
+	key.local_ip = src_ip;
+	key.local_port = src_port;
+	key.remote_ip = 0;
+	key.remote_port = 0;
 	
-	return ret;
+	switch (method)
+	{
+		case MAP_ADDRESS_PORT_DEPENDENT:
+			key.remote_port = dest_port;
+			// fall through
+			
+		case MAP_ADDRESS_DEPENDENT:
+			key.remote_ip = dest_ip;
+			break;
+		
+		case MAP_INDEPENDENT:
+		default:
+			break;
+	}
 }
 
 /**
-* @brief duplicateMap copies a map entry to a new structure
+* @brief makeInboundKey builds the inbound index key for an external port
 * 
-* @detailed Generate a new map based upon an outbound packet to transform the 
-*			inside packet to an outside packet.
+* @detailed The external address is left out so that a shard has a key for a port
+*			exactly when it holds maps on it; lookups compare the address while walking
+*			the chain.
+* 
+* @param protocol [IN] IP protocol of the flow
+* @param ext_port [IN] External (translated) port
+* @param key [OUT] Resultant key
+* 
+*/
+void fnState::makeInboundKey(uint16_t protocol, uint16_t ext_port, nat_map_key &key)
+{
+	key.protocol = protocol;
+	key.reserved = 0;
+	key.local_ip = 0;
+	key.local_port = ext_port;
+	key.remote_ip = 0;
+	key.remote_port = 0;
+}
+
+/**
+* @brief removeMap removes a map entry from all of the lookup structures and frees it
 * 
-* @param src [IN] Map to be copied
-* @param dest [OUT] copy of src
+* @detailed The entry is dropped from the outbound index, unlinked from the chain
+*			of maps sharing its external port, taken off the timer wheel and its
+*			port is returned to the pool.  The caller holds the shard's lock.
+* 
+* @param nShard [IN] Shard holding the entry
+* @param pEntry [IN] Map entry to be removed, invalid on return
 * 
 */
+void fnState::removeMap(unsigned int nShard, nat_map_entry *pEntry)
+{
+	fnOptions *pOptions = fnOptions::getInstance();
+	state_shard &shard = m_pShards[nShard];
+	MAPPING_METHOD method;
+	nat_map_key key;
+	nat_map_entry *pHead;
+	
+	pOptions->getMappingMethod(method);
+	makeOutboundKey(pEntry->protocol, pEntry->inside_udp.src_ip, pEntry->inside_udp.src_port,
+		pEntry->inside_udp.dest_ip, pEntry->inside_udp.dest_port, method, key);
+	shard.indexOutbound.remove(key);
+	
+	makeInboundKey(pEntry->protocol, pEntry->outside_udp.src_port, key);
+	pHead = shard.indexInbound.find(key);
+	
+	if (pHead == pEntry)
+	{
+		if (pEntry->inbound_next != NULL)
+		{
+			shard.indexInbound.insert(key, pEntry->inbound_next);
+		}
+		else
+		{
+			// last map of this shard on the port
+			shard.indexInbound.remove(key);
+			__sync_fetch_and_and(&m_portShards[protocolSlot(pEntry->protocol)][pEntry->outside_udp.src_port],
+				~(1ULL << nShard));
+		}
+	}
+	else
+	{
+		while (pHead != NULL && pHead->inbound_next != pEntry)
+		{
+			pHead = pHead->inbound_next;
+		}
+		
+		if (pHead != NULL)
+		{
+			pHead->inbound_next = pEntry->inbound_next;
+		}
+	}
+	
+	pEntry->inbound_next = NULL;
+	
+	releasePort(pEntry->protocol, pEntry->outside_udp.src_port);
+	
+	shard.wheel.cancel(pEntry);
+	shard.pool.release(pEntry);
+}
 
-void fnState::duplicateMap(const nat_map_entry &src, nat_map_entry &dest)
+/**
+* @brief Starts loading the index slot a packet's map lookup will read
+* 
+* @detailed Called for a whole batch of packets before any of them is processed, so
+*			the cache misses of the lookups overlap instead of being taken one after
+*			another.  Takes no locks; see fnMapIndex::prefetch.
+* 
+* @param packet [IN] Packet about to be processed
+* @param bOutbound [IN] true if the packet came from the inside
+*/
+void fnState::prefetchMap(const fnPacket& packet, const bool bOutbound) const
 {
-	dest.in_interface = src.in_interface;
-	dest.out_interface = src.out_interface;
-	dest.protocol = src.protocol;
-	dest.activity = src.activity;
+	uint8_t protocol = packet.getProtocol();
+	udp_packet_tuple tuple;
+	nat_map_key key;
 	
-	switch (src.protocol)
+	switch (protocol)
 	{
 		case PROTO_UDP:
-			dest.inside_udp.src_ip = src.inside_udp.src_ip;
-			dest.inside_udp.src_port = src.inside_udp.src_port;
-			dest.inside_udp.dest_ip = src.inside_udp.dest_ip;
-			dest.inside_udp.dest_port = src.inside_udp.dest_port;
-
-			dest.outside_udp.src_ip = src.outside_udp.src_ip;
-			dest.outside_udp.src_port = src.outside_udp.src_port;
-			dest.outside_udp.dest_ip = src.outside_udp.dest_ip;
-			dest.outside_udp.dest_port = src.outside_udp.dest_port;
+			if (FAILED(packet.getPacketTuple(tuple)))
+			{
+				return;
+			}
 			break;
-			
+		
 		case PROTO_TCP:
+		{
+			tcp_packet_tuple tcp;
+			
+			if (FAILED(packet.getPacketTuple(tcp)))
+			{
+				return;
+			}
+			
+			tuple.src_ip = tcp.src_ip;
+			tuple.dest_ip = tcp.dest_ip;
+			tuple.src_port = tcp.src_port;
+			tuple.dest_port = tcp.dest_port;
+			break;
+		}
+		
 		case PROTO_ICMP:
-
+		{
+			icmp_packet_tuple icmp;
+			
+			if (!packet.isICMPQuery() || FAILED(packet.getPacketTuple(icmp)))
+			{
+				return;
+			}
+			
+			// the identifier stands in for the internal port going out and the external one coming in
+			tuple.src_ip = icmp.src_ip;
+			tuple.dest_ip = icmp.dest_ip;
+			tuple.src_port = bOutbound ? icmp.id : 0;
+			tuple.dest_port = bOutbound ? 0 : icmp.id;
+			break;
+		}
+		
 		default:
-			printf("fnState::duplicateMap: Invalid Map\n");
+			return;
+	}
 	
+	if (bOutbound)
+	{
+		MAPPING_METHOD map_method;
+		
+		fnOptions::getInstance()->getMappingMethod(map_method);
+		makeOutboundKey(protocol, tuple.src_ip, tuple.src_port, tuple.dest_ip, tuple.dest_port, map_method, key);
+		
+		m_pShards[shardFor(tuple.src_ip, tuple.src_port)].indexOutbound.prefetch(key);
+	}
+	else
+	{
+		uint64_t shards = __atomic_load_n(&m_portShards[protocolSlot(protocol)][tuple.dest_port], __ATOMIC_RELAXED);
+		
+		makeInboundKey(protocol, tuple.dest_port, key);
+		
+		if (shards != 0)
+		{
+			m_pShards[__builtin_ctzll(shards)].indexInbound.prefetch(key);
+		}
 	}
-
 }
-
-
-
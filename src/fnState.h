@@ -23,30 +23,66 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #ifndef FN_FNSTATE_H // one-time include
 #define FN_FNSTATE_H
 
-#include <list>
-#include <vector>
-#include <map>
+#include <time.h>
+#include <pthread.h>
 
 #include "fnPacket.h"
+#include "fnOptions.h"
+#include "fnClock.h"
+#include "fnMapIndex.h"
+#include "fnTimerWheel.h"
+#include "fnPortPool.h"
+#include "fnMapPool.h"
 #include "fn_error.h"
 #include "structures.h"
 
 
+#define FN_STATE_MAX_SHARDS 64	///< width of the port to shard masks
+
+#define TCP_FIN_OUT 0x01	///< FIN seen from the inside
+#define TCP_FIN_IN 0x02		///< FIN seen from the outside
+
+/**
+* One partition of the map tables.  A map lives in the shard picked by a hash of its
+* internal endpoint, and everything in a shard is protected by the shard's lock.
+*/
+typedef struct _state_shard
+{
+	_state_shard() : wheel(time(NULL)) { pthread_mutex_init(&lock, NULL); }
+	~_state_shard() { pthread_mutex_destroy(&lock); }
+	
+	pthread_mutex_t	lock;
+	fnMapPool	pool;	///< Storage for the shard's map entries
+	fnTimerWheel	wheel;	///< Owns every live map entry of the shard and schedules its expiry
+	fnMapIndex	indexOutbound;	///< Outbound maps keyed by the fields the mapping method compares
+	fnMapIndex	indexInbound;	///< Head of the chain of the shard's maps sharing an external port
+} state_shard;
+
 class fnState
 {
    public:
         static fnState* getInstance();
         ~fnState();
         
-        FN_STATUS getOutBoundMap(const udp_packet_tuple& udp, nat_map_entry& map);
-        FN_STATUS getOutBoundMap(const tcp_packet_tuple& tcp, nat_map_entry& map);
-        FN_STATUS getOutBoundMap(const icmp_packet_tuple& icmp, nat_map_entry& map);
+        FN_STATUS initialize();
+        
+        void setClock(fnClock *pClock);
+        time_t now() const;
         
-        FN_STATUS createOutBoundMap(const fnPacket& packet, nat_map_entry& map);
+        FN_STATUS getOutBoundMap(const udp_packet_tuple& udp, nat_map_view& map);
+        FN_STATUS getOutBoundMap(const tcp_packet_tuple& tcp, const uint8_t flags, nat_map_view& map);
+        FN_STATUS getOutBoundMap(const icmp_packet_tuple& icmp, nat_map_view& map);
         
-        FN_STATUS getInBoundMap(const udp_packet_tuple& udp, nat_map_entry& map);
-        FN_STATUS getInBoundMap(const tcp_packet_tuple& tcp, nat_map_entry& map);
-        FN_STATUS getInBoundMap(const icmp_packet_tuple& icmp, nat_map_entry& map);
+        FN_STATUS createOutBoundMap(const fnPacket& packet, nat_map_view& map);
+        
+        FN_STATUS getInBoundMap(const udp_packet_tuple& udp, nat_map_view& map);
+        FN_STATUS getInBoundMap(const tcp_packet_tuple& tcp, const uint8_t flags, nat_map_view& map);
+        FN_STATUS getInBoundMap(const icmp_packet_tuple& icmp, nat_map_view& map);
+        FN_STATUS getInBoundErrorMap(const uint8_t protocol, const udp_packet_tuple& embedded, nat_map_view& map);
+        
+        void expireMaps(time_t now);
+        
+        void prefetchMap(const fnPacket& packet, const bool bOutbound) const;
 
 	
     protected:
@@ -55,17 +91,38 @@ class fnState
 	
 	private:
 	
-		unsigned short getFreeTCPPort();
-		unsigned short getFreeUDPPort(const unsigned short old);
+		unsigned short getFreePort(const uint8_t protocol, const unsigned short old);
+		void releasePort(uint8_t protocol, uint16_t port);
+		
+		unsigned int shardFor(uint32_t src_ip, uint16_t src_port) const;
+		static unsigned int protocolSlot(uint8_t protocol);
 		
-		void duplicateMap(const nat_map_entry &src, nat_map_entry &dest);
+		static void makeOutboundKey(uint16_t protocol, uint32_t src_ip, uint16_t src_port,
+			uint32_t dest_ip, uint16_t dest_port, MAPPING_METHOD method, nat_map_key &key);
+		static void makeInboundKey(uint16_t protocol, uint16_t ext_port, nat_map_key &key);
+		void removeMap(unsigned int nShard, nat_map_entry *pEntry);
+		
+		FN_STATUS findOutBoundMap(const uint8_t protocol, const udp_packet_tuple& tuple, const uint8_t flags, nat_map_view& map);
+		FN_STATUS useOutBoundMap(unsigned int nShard, nat_map_entry *pEntry, const uint8_t protocol,
+			const udp_packet_tuple& tuple, const uint8_t flags, nat_map_view& map);
+		FN_STATUS findInBoundMap(const uint8_t protocol, const udp_packet_tuple& tuple, const uint8_t flags, nat_map_view& map, const bool bRefresh = true);
+		void trackTCP(unsigned int nShard, nat_map_entry *pEntry, const uint8_t flags, const bool bOutbound, nat_map_view& map);
+		static time_t getLifetime(const nat_map_entry *pEntry);
 	
-		std::list<nat_map_entry*> m_mapsUDP;
-		std::list<nat_map_entry*> m_mapsTCP;
-		std::list<nat_map_entry*> m_mapsICMP;
+		state_shard *m_pShards;
+		unsigned int m_nShards;
+		
+		/// Per protocol and external port, the shards holding maps on that port.  Written
+		/// with atomic operations under the owning shard's lock, read without any lock.
+		volatile uint64_t m_portShards[3][65536];
+		
+		fnClock *m_pClock; ///< Time base of map activity and lifetimes
+		volatile time_t m_lastExpiry; ///< Last second the shards were expired for
 		
-		std::map<unsigned short,bool> m_mapUDPPorts;
-		std::map<unsigned short,bool> m_mapTCPPorts;
+		pthread_mutex_t m_portLock; ///< Guards the port pools, shared by every shard
+		fnPortPool m_portsUDP;
+		fnPortPool m_portsTCP;
+		fnPortPool m_idsICMP; ///< ICMP query identifiers
 
 };
 
@@ -0,0 +1,393 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+/**
+* @file fnStateBench.cpp
+* @author Jeremy Beker
+* @version
+*
+* @overview Scaling benchmark of the fnState map tables, from thousands to millions of maps
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/wait.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+namespace po = boost::program_options;
+
+#include "fnLog.h"
+#include "fnOptions.h"
+#include "fnPacket.h"
+#include "fnState.h"
+
+#define BENCH_EXTERNAL_IP "203.0.113.1"
+#define BENCH_INTERNAL_NET 0x0A000000	///< 10.0.0.0/8, internal hosts
+#define BENCH_REMOTE_NET 0xC6120000		///< 198.18.0.0/15, remote endpoints
+#define BENCH_FLOWS_PER_HOST 32
+#define BENCH_MAPS_PER_REMOTE 16
+#define BENCH_LIFETIME 600
+
+static const uint16_t s_remotePorts[] = { 53, 123, 443, 3478, 4500, 5060 };
+
+typedef struct _bench_config
+{
+	std::vector<unsigned int>	sizes;
+	unsigned int	lookups;
+	std::string		mapMethod;
+	std::string		filterMethod;
+	std::string		portAssign;
+} bench_config;
+
+/**
+* Both directions of one map, as fnState sees them
+*/
+typedef struct _bench_flow
+{
+	udp_packet_tuple	outbound;
+	udp_packet_tuple	inbound;
+} bench_flow;
+
+/**
+* @brief Returns a monotonic time stamp in nanoseconds
+*/
+static inline uint64_t nanoseconds()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+* @brief Returns the resident set size of the process in bytes
+*/
+static uint64_t residentBytes()
+{
+	unsigned long size = 0;
+	unsigned long resident = 0;
+	FILE *pFile = fopen("/proc/self/statm", "r");
+
+	if (pFile != NULL)
+	{
+		if (fscanf(pFile, "%lu %lu", &size, &resident) != 2)
+		{
+			resident = 0;
+		}
+
+		fclose(pFile);
+	}
+
+	return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+/**
+* @brief Small fast generator, so picking flows costs little next to the lookups
+*/
+static inline uint32_t xorshift(uint32_t &state)
+{
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+
+	return state;
+}
+
+/**
+* @brief Writes one UDP flow's endpoints into a packet buffer
+*
+* @detailed Internal hosts each hold BENCH_FLOWS_PER_HOST flows on scattered ports.
+*			Half of the flows go to the most popular 1% of the remote addresses, the
+*			rest are spread over all of them.
+*/
+static void buildPacket(unsigned char *pBuffer, unsigned int i, unsigned int nHosts, unsigned int nRemotes, uint32_t &random)
+{
+	unsigned int host = i % nHosts;
+	unsigned int k = i / nHosts;
+	uint32_t src_ip = htonl(BENCH_INTERNAL_NET + 1 + host);
+	uint32_t dest_ip;
+	unsigned int remote = xorshift(random);
+
+	if (remote & 1)
+	{
+		remote = (remote >> 1) % (nRemotes / 100 + 1);
+	}
+	else
+	{
+		remote = (remote >> 1) % nRemotes;
+	}
+
+	dest_ip = htonl(BENCH_REMOTE_NET + 1 + remote);
+
+	memcpy(pBuffer + 12, &src_ip, 4);
+	memcpy(pBuffer + 16, &dest_ip, 4);
+	*(uint16_t*)(pBuffer + 20) = htons((uint16_t)(1024 + (k * 1009 + host * 131) % 64512));
+	*(uint16_t*)(pBuffer + 22) = htons(s_remotePorts[xorshift(random) % (sizeof(s_remotePorts) / sizeof(s_remotePorts[0]))]);
+}
+
+/**
+* @brief Configures fnOptions and fnState for a table of up to nMaps maps
+*/
+static FN_STATUS setup(const bench_config &config, unsigned int nMaps)
+{
+	char maxMaps[16];
+	char lifetime[16];
+	const char *args[] =
+	{
+		"state_bench", "--external_ip", BENCH_EXTERNAL_IP,
+		"--map_method", config.mapMethod.c_str(), "--filter_method", config.filterMethod.c_str(),
+		"--port_assign", config.portAssign.c_str(), "--map_lifetime", lifetime, "--verbose", "0",
+		"--max_maps", maxMaps,
+	};
+
+	// shards get an even share of the limit, leave room for the hash not being perfectly even
+	snprintf(maxMaps, sizeof(maxMaps), "%u", nMaps * 2 + 1024);
+	snprintf(lifetime, sizeof(lifetime), "%u", BENCH_LIFETIME);
+
+	if (FAILED(fnOptions::getInstance()->initialize(sizeof(args) / sizeof(args[0]), (char**)args)))
+	{
+		return FN_E_FAIL;
+	}
+
+	return fnState::getInstance()->initialize();
+}
+
+/**
+* @brief Measures one table size and prints its JSON object
+*
+* @detailed Creates nMaps maps, looks random ones up in both directions and then
+*			expires them all at once.  Lookups refresh the maps as the configured
+*			refresh method says, like they do for real packets.
+*
+* @return 0 if every map could be created and found again
+*/
+static int runSize(const bench_config &config, unsigned int nMaps)
+{
+	fnState *pState;
+	std::vector<bench_flow> flows(nMaps);
+	unsigned int nHosts = nMaps / BENCH_FLOWS_PER_HOST + 1;
+	unsigned int nRemotes = nMaps / BENCH_MAPS_PER_REMOTE + 1;
+	unsigned char buffer[28] __attribute__((aligned(8)));
+	uint32_t random = 2463534242U;
+	unsigned int nFailed = 0;
+	unsigned int nMissed = 0;
+	uint64_t rssBefore;
+	uint64_t rssAfter;
+	uint64_t start;
+	uint64_t createNs;
+	uint64_t outboundNs;
+	uint64_t inboundNs;
+	uint64_t expireNs;
+
+	if (FAILED(setup(config, nMaps)))
+	{
+		printf("    {\"maps\": %u, \"error\": \"can't configure the state tables\"}", nMaps);
+		fflush(stdout);
+		return 1;
+	}
+
+	pState = fnState::getInstance();
+
+	memset(buffer, 0, sizeof(buffer));
+	buffer[0] = 0x45;
+	*(uint16_t*)(buffer + 2) = htons(sizeof(buffer));
+	buffer[8] = 64;
+	buffer[9] = PROTO_UDP;
+	*(uint16_t*)(buffer + 24) = htons(8);
+
+	rssBefore = residentBytes();
+
+	start = nanoseconds();
+
+	for (unsigned int i = 0; i < nMaps; i++)
+	{
+		nat_map_view map;
+
+		buildPacket(buffer, i, nHosts, nRemotes, random);
+
+		fnPacket packet(buffer, sizeof(buffer), FN_REPLAY_INTERNAL_IFINDEX, i);
+
+		if (FAILED(pState->createOutBoundMap(packet, map)))
+		{
+			nFailed++;
+			continue;
+		}
+
+		packet.getPacketTuple(flows[i].outbound);
+
+		flows[i].inbound.src_ip = flows[i].outbound.dest_ip;
+		flows[i].inbound.src_port = flows[i].outbound.dest_port;
+		flows[i].inbound.dest_ip = map.udp.src_ip;
+		flows[i].inbound.dest_port = map.udp.src_port;
+	}
+
+	createNs = nanoseconds() - start;
+	rssAfter = residentBytes();
+
+	start = nanoseconds();
+
+	for (unsigned int n = 0; n < config.lookups; n++)
+	{
+		nat_map_view map;
+
+		if (FAILED(pState->getOutBoundMap(flows[xorshift(random) % nMaps].outbound, map)))
+		{
+			nMissed++;
+		}
+	}
+
+	outboundNs = nanoseconds() - start;
+	start = nanoseconds();
+
+	for (unsigned int n = 0; n < config.lookups; n++)
+	{
+		nat_map_view map;
+
+		if (FAILED(pState->getInBoundMap(flows[xorshift(random) % nMaps].inbound, map)))
+		{
+			nMissed++;
+		}
+	}
+
+	inboundNs = nanoseconds() - start;
+
+	// every map is due once its lifetime has passed without traffic
+	start = nanoseconds();
+	pState->expireMaps(time(NULL) + BENCH_LIFETIME + 1);
+	expireNs = nanoseconds() - start;
+
+	printf("    {\"maps\": %u, \"hosts\": %u, \"remotes\": %u, \"create_failed\": %u, \"lookups_missed\": %u, "
+		"\"create_ns\": %.1f, \"outbound_lookup_ns\": %.1f, \"inbound_lookup_ns\": %.1f, \"expire_ns\": %.1f, "
+		"\"creates_per_sec\": %.0f, \"outbound_lookups_per_sec\": %.0f, \"inbound_lookups_per_sec\": %.0f, "
+		"\"expiries_per_sec\": %.0f, \"rss_bytes\": %llu, \"rss_bytes_per_map\": %.1f}",
+		nMaps, nHosts, nRemotes, nFailed, nMissed,
+		(double)createNs / nMaps, (double)outboundNs / config.lookups,
+		(double)inboundNs / config.lookups, (double)expireNs / nMaps,
+		nMaps * 1e9 / createNs, config.lookups * 1e9 / outboundNs,
+		config.lookups * 1e9 / inboundNs, nMaps * 1e9 / expireNs,
+		(unsigned long long)rssAfter, (double)(rssAfter - rssBefore) / nMaps);
+
+	fflush(stdout);
+
+	return (nFailed == 0 && nMissed == 0) ? 0 : 1;
+}
+
+/**
+* @brief State scaling benchmark entry point
+*
+* @detailed Every table size is measured in its own child process, so the resident
+*			memory of one size is not hidden by memory freed by the previous one.
+*			Results are printed as a single JSON document.
+*/
+int main(int argc, char* argv[])
+{
+	bench_config config;
+	int ret = 0;
+
+	po::options_description opts("State benchmark");
+	opts.add_options()
+		("help", "This help")
+		("sizes", po::value< std::vector<unsigned int> >(&config.sizes)->multitoken(), "Numbers of maps measured [1000 10000 100000 1000000 10000000]")
+		("lookups", po::value<unsigned int>(&config.lookups)->default_value(1000000), "Lookups timed in each direction")
+		("map_method", po::value<std::string>(&config.mapMethod)->default_value("ind"), "Mapping Method [ind|addr|port]")
+		("filter_method", po::value<std::string>(&config.filterMethod)->default_value("port"), "Filter Method [ind|addr|port]")
+		("port_assign", po::value<std::string>(&config.portAssign)->default_value("over"), "Port Assignment Method [pres|over|none]")
+		;
+
+	try
+	{
+		po::variables_map vm;
+		po::store(po::parse_command_line(argc, argv, opts), vm);
+		po::notify(vm);
+
+		if (vm.count("help"))
+		{
+			std::cout << opts << "\n";
+			return 0;
+		}
+	}
+	catch (std::exception &e)
+	{
+		printf("%s\n", e.what());
+		return 1;
+	}
+
+	if (config.sizes.empty())
+	{
+		for (unsigned int size = 1000; size <= 10000000; size *= 10)
+		{
+			config.sizes.push_back(size);
+		}
+	}
+
+	if (config.lookups == 0)
+	{
+		config.lookups = 1;
+	}
+
+	printf("{\n  \"benchmark\": \"fnState\",\n");
+
+	// the figures only mean something for an optimized build without debug logging
+#ifdef __OPTIMIZE__
+	printf("  \"optimized\": true, \"log_level\": %d,\n", FN_LOG_MAX_LEVEL);
+#else
+	printf("  \"optimized\": false, \"log_level\": %d,\n", FN_LOG_MAX_LEVEL);
+#endif
+	printf("  \"map_method\": \"%s\", \"filter_method\": \"%s\", \"port_assign\": \"%s\", \"lookups\": %u,\n",
+		config.mapMethod.c_str(), config.filterMethod.c_str(), config.portAssign.c_str(), config.lookups);
+	printf("  \"results\": [\n");
+
+	for (unsigned int s = 0; s < config.sizes.size(); s++)
+	{
+		pid_t pid;
+		int status = 0;
+
+		fflush(stdout);
+		pid = fork();
+
+		if (pid == 0)
+		{
+			_exit(config.sizes[s] ? runSize(config, config.sizes[s]) : 1);
+		}
+
+		if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			fprintf(stderr, "%u maps: failed\n", config.sizes[s]);
+			ret = 1;
+		}
+
+		printf("%s\n", (s + 1 < config.sizes.size()) ? "," : "");
+	}
+
+	printf("  ]\n}\n");
+
+	return ret;
+}
@@ -0,0 +1,298 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+/**
+* @file fnTimerWheel.cpp
+* @author Jeremy Beker
+* @version
+*
+* @overview Timer wheel used by fnState to expire map entries
+*/
+
+#include <stddef.h>
+#include <string.h>
+
+#include "fnTimerWheel.h"
+
+#define ROOT_SIZE (1 << FN_WHEEL_ROOT_BITS)
+#define ROOT_MASK (ROOT_SIZE - 1)
+#define LEVEL_SIZE (1 << FN_WHEEL_LEVEL_BITS)
+#define LEVEL_MASK (LEVEL_SIZE - 1)
+
+// Number of low bits of a timestamp consumed below the given upper level (1 based)
+#define LEVEL_SHIFT(n) (FN_WHEEL_ROOT_BITS + ((n) - 1) * FN_WHEEL_LEVEL_BITS)
+
+/**
+* @brief Constructor for fnTimerWheel class
+*
+* @param now [IN] Current time, the first tick processed by advance
+*/
+fnTimerWheel::fnTimerWheel(time_t now)
+{
+	memset(m_root, 0, sizeof(m_root));
+	memset(m_levels, 0, sizeof(m_levels));
+	m_now = now;
+	m_nCount = 0;
+}
+
+/**
+* @brief Destructor for fnTimerWheel class
+*
+* @detailed The wheel does not own the entries, callers should drain it with removeAll first
+*/
+fnTimerWheel::~fnTimerWheel()
+{
+}
+
+/**
+* @brief Returns the slot list an expiry time belongs in, relative to the current tick
+*/
+nat_map_entry** fnTimerWheel::slotFor(time_t expires)
+{
+	time_t delta = expires - m_now;
+
+	if (delta < 0)
+	{
+		// already due, fire on the next tick processed
+		return &m_root[m_now & ROOT_MASK];
+	}
+
+	if (delta < ROOT_SIZE)
+	{
+		return &m_root[expires & ROOT_MASK];
+	}
+
+	for (unsigned int level = 1; level < FN_WHEEL_LEVELS; level++)
+	{
+		if (delta < ((time_t)1 << LEVEL_SHIFT(level + 1)) || level == FN_WHEEL_LEVELS - 1)
+		{
+			if (delta >= ((time_t)1 << LEVEL_SHIFT(level + 1)))
+			{
+				// beyond the horizon, park it in the furthest slot and re-check when it cascades
+				expires = m_now + ((time_t)1 << LEVEL_SHIFT(level + 1)) - 1;
+			}
+
+			return &m_levels[level - 1][(expires >> LEVEL_SHIFT(level)) & LEVEL_MASK];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+* @brief Links an entry into the slot for its timer_expires
+*/
+void fnTimerWheel::link(nat_map_entry *pEntry)
+{
+	nat_map_entry **ppSlot = slotFor(pEntry->timer_expires);
+
+	pEntry->timer_next = *ppSlot;
+
+	if (*ppSlot != NULL)
+	{
+		(*ppSlot)->timer_pprev = &pEntry->timer_next;
+	}
+
+	*ppSlot = pEntry;
+	pEntry->timer_pprev = ppSlot;
+}
+
+/**
+* @brief Schedules (or reschedules) an entry
+*
+* @param pEntry [IN] Map entry
+* @param expires [IN] Time at which the entry should be returned by advance
+*/
+void fnTimerWheel::schedule(nat_map_entry *pEntry, time_t expires)
+{
+	cancel(pEntry);
+
+	pEntry->timer_expires = expires;
+	link(pEntry);
+	m_nCount++;
+}
+
+/**
+* @brief Removes an entry from the wheel
+*
+* @detailed Entries that are not scheduled are ignored.
+*
+* @param pEntry [IN] Map entry
+*/
+void fnTimerWheel::cancel(nat_map_entry *pEntry)
+{
+	if (pEntry->timer_pprev != NULL)
+	{
+		*pEntry->timer_pprev = pEntry->timer_next;
+
+		if (pEntry->timer_next != NULL)
+		{
+			pEntry->timer_next->timer_pprev = pEntry->timer_pprev;
+		}
+
+		pEntry->timer_next = NULL;
+		pEntry->timer_pprev = NULL;
+		m_nCount--;
+	}
+}
+
+/**
+* @brief Redistributes one slot of an upper level into the levels below it
+*
+* @param level [IN] Upper level (1 based) whose current slot is emptied
+*/
+void fnTimerWheel::cascade(unsigned int level)
+{
+	unsigned int index = (m_now >> LEVEL_SHIFT(level)) & LEVEL_MASK;
+	nat_map_entry *pEntry = m_levels[level - 1][index];
+
+	m_levels[level - 1][index] = NULL;
+
+	while (pEntry != NULL)
+	{
+		nat_map_entry *pNext = pEntry->timer_next;
+
+		link(pEntry);
+		pEntry = pNext;
+	}
+}
+
+/**
+* @brief Processes every tick up to and including now
+*
+* @param now [IN] Current time
+*
+* @return Chain of due entries linked through timer_next.  The entries are no longer
+*		  scheduled; callers either reschedule or dispose of them.
+*/
+nat_map_entry* fnTimerWheel::advance(time_t now)
+{
+	nat_map_entry *pExpired = NULL;
+
+	while (m_now <= now)
+	{
+		unsigned int index = m_now & ROOT_MASK;
+		nat_map_entry *pEntry;
+
+		if (index == 0)
+		{
+			// root wrapped, pull down the next slot of each level that wrapped too
+			for (unsigned int level = 1; level < FN_WHEEL_LEVELS; level++)
+			{
+				cascade(level);
+
+				if (((m_now >> LEVEL_SHIFT(level)) & LEVEL_MASK) != 0)
+				{
+					break;
+				}
+			}
+		}
+
+		pEntry = m_root[index];
+		m_root[index] = NULL;
+
+		while (pEntry != NULL)
+		{
+			nat_map_entry *pNext = pEntry->timer_next;
+
+			pEntry->timer_pprev = NULL;
+			pEntry->timer_next = pExpired;
+			pExpired = pEntry;
+			m_nCount--;
+
+			pEntry = pNext;
+		}
+
+		m_now++;
+	}
+
+	return pExpired;
+}
+
+/**
+* @brief Unschedules every entry
+*
+* @return Chain of all entries that were scheduled, linked through timer_next
+*/
+nat_map_entry* fnTimerWheel::removeAll()
+{
+	nat_map_entry *pAll = NULL;
+
+	for (unsigned int i = 0; i < ROOT_SIZE; i++)
+	{
+		while (m_root[i] != NULL)
+		{
+			nat_map_entry *pEntry = m_root[i];
+
+			cancel(pEntry);
+			pEntry->timer_next = pAll;
+			pAll = pEntry;
+		}
+	}
+
+	for (unsigned int level = 0; level < FN_WHEEL_LEVELS - 1; level++)
+	{
+		for (unsigned int i = 0; i < LEVEL_SIZE; i++)
+		{
+			while (m_levels[level][i] != NULL)
+			{
+				nat_map_entry *pEntry = m_levels[level][i];
+
+				cancel(pEntry);
+				pEntry->timer_next = pAll;
+				pAll = pEntry;
+			}
+		}
+	}
+
+	return pAll;
+}
+
+/**
+* @brief Moves the wheel to a new current time
+*
+* @detailed Only possible while nothing is scheduled, used when the wheel has to
+*			follow a clock other than the one it was created with.
+*
+* @param now [IN] Current time, the next tick processed by advance
+*
+* @return false if entries are scheduled and the wheel was left alone
+*/
+bool fnTimerWheel::rebase(time_t now)
+{
+	if (m_nCount != 0)
+	{
+		return false;
+	}
+
+	m_now = now;
+
+	return true;
+}
+
+/**
+* @brief Returns the number of scheduled entries
+*/
+unsigned int fnTimerWheel::size() const
+{
+	return m_nCount;
+}
@@ -0,0 +1,65 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#ifndef FN_FNTIMERWHEEL_H // one-time include
+#define FN_FNTIMERWHEEL_H
+
+#include <time.h>
+
+#include "structures.h"
+
+#define FN_WHEEL_ROOT_BITS 8	///< 256 one second slots in the first level
+#define FN_WHEEL_LEVEL_BITS 6	///< 64 slots in each of the upper levels
+#define FN_WHEEL_LEVELS 4		///< 256s, 4.5h, 12d and 2.1y horizons
+
+/**
+* Hierarchical timing wheel with one second resolution.  Map entries are linked
+* into their slot through their timer_next/timer_pprev fields, so scheduling and
+* cancelling are constant time and need no allocation.
+*/
+class fnTimerWheel
+{
+	public:
+		fnTimerWheel(time_t now);
+		~fnTimerWheel();
+
+		void schedule(nat_map_entry *pEntry, time_t expires);
+		void cancel(nat_map_entry *pEntry);
+		nat_map_entry* advance(time_t now);
+		nat_map_entry* removeAll();
+		bool rebase(time_t now);
+
+		unsigned int size() const;
+
+	protected:
+		void link(nat_map_entry *pEntry);
+		void cascade(unsigned int level);
+		nat_map_entry** slotFor(time_t expires);
+
+	private:
+		nat_map_entry*	m_root[1 << FN_WHEEL_ROOT_BITS];
+		nat_map_entry*	m_levels[FN_WHEEL_LEVELS - 1][1 << FN_WHEEL_LEVEL_BITS];
+		time_t			m_now;		///< next tick to be processed
+		unsigned int	m_nCount;
+};
+
+#endif
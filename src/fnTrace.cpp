@@ -0,0 +1,360 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+
+/**
+* @file fnTrace.cpp
+* @author Jeremy Beker
+* @version
+*
+* @overview Per queue trace rings and the thread writing them out
+*/
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fnTrace.h"
+#include "fnCore.h"
+#include "fnLog.h"
+
+// Ensure that the singleton instance always starts out as NULL.
+fnTrace* fnTrace::s_Instance = NULL;
+
+/**
+* @brief Constructor for fnTraceRing class
+*
+* @param nSize [IN] Number of events, rounded up to a power of two
+*/
+fnTraceRing::fnTraceRing(unsigned int nSize)
+{
+	uint32_t size = 1;
+
+	while (size < nSize)
+	{
+		size <<= 1;
+	}
+
+	m_pEvents = new trace_event[size];
+	m_nMask = size - 1;
+	m_nHead = 0;
+	m_nTail = 0;
+	m_nDropped = 0;
+}
+
+/**
+* @brief Destructor for fnTraceRing class
+*/
+fnTraceRing::~fnTraceRing()
+{
+	delete [] m_pEvents;
+}
+
+/**
+* @brief Adds an event, called by the queue thread only
+*
+* @param event [IN] Event to be recorded
+*
+* @return false if the ring was full and the event was dropped
+*/
+bool fnTraceRing::push(const trace_event &event)
+{
+	uint32_t head = m_nHead;
+
+	if (head - __atomic_load_n(&m_nTail, __ATOMIC_ACQUIRE) > m_nMask)
+	{
+		__atomic_store_n(&m_nDropped, m_nDropped + 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	m_pEvents[head & m_nMask] = event;
+	__atomic_store_n(&m_nHead, head + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/**
+* @brief Takes the oldest event, called by the writer thread only
+*
+* @param event [OUT] Oldest event
+*
+* @return false if the ring was empty
+*/
+bool fnTraceRing::pop(trace_event &event)
+{
+	uint32_t tail = m_nTail;
+
+	if (tail == __atomic_load_n(&m_nHead, __ATOMIC_ACQUIRE))
+	{
+		return false;
+	}
+
+	event = m_pEvents[tail & m_nMask];
+	__atomic_store_n(&m_nTail, tail + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/**
+* @brief Returns the number of events dropped because the ring was full
+*/
+uint64_t fnTraceRing::dropped() const
+{
+	return __atomic_load_n(&m_nDropped, __ATOMIC_RELAXED);
+}
+
+/**
+* @brief Constructor for fnTrace class
+*/
+fnTrace::fnTrace()
+{
+	m_pFile = NULL;
+	m_bRunning = false;
+}
+
+/**
+* @brief Destructor for fnTrace class
+*/
+fnTrace::~fnTrace()
+{
+	stop();
+}
+
+/**
+* @brief The getInstance function provides access to the singleton instance of the class
+*
+* @detailed This class is defined as a singleton so there is exactly one instance of the class throughout the calling program.  This class
+*           should never be created by the calling program through new.  It should only be accessed by the getInstance method to get
+*           a pointer to the singleton instance.
+*
+* @post
+* - A non-null pointer to the singleton instance is returned
+*
+* @return A non-null pointer to the singleton instance
+*/
+fnTrace* fnTrace::getInstance()
+{
+	if ( s_Instance == NULL )
+	{
+		s_Instance = new fnTrace();
+	}
+
+	return s_Instance;
+}
+
+/**
+* @brief Opens the trace file, creates the rings and starts the writer thread
+*
+* @param strPath [IN] File the events are written to, truncated first
+* @param nRings [IN] Number of rings, one per queue thread
+*
+* @return Status of start
+*
+* @retval FN_E_FAIL File or thread could not be created, tracing stays off
+* @retval FN_S_OK Tracing
+*/
+FN_STATUS fnTrace::start(const std::string &strPath, unsigned int nRings)
+{
+	FN_STATUS ret = FN_S_OK;
+
+	m_pFile = fopen(strPath.c_str(), "w");
+
+	if (m_pFile == NULL)
+	{
+		FN_ERROR("can't open trace file %s: %s\n", strPath.c_str(), strerror(errno));
+		ret = FN_E_FAIL;
+	}
+	else
+	{
+		for (unsigned int n = 0; n < nRings; n++)
+		{
+			m_rings.push_back(new fnTraceRing());
+			m_reported.push_back(0);
+		}
+
+		m_bRunning = true;
+
+		if (pthread_create(&m_thread, NULL, writerThread, this) != 0)
+		{
+			FN_ERROR("can't start trace writer\n");
+			m_bRunning = false;
+			ret = FN_E_FAIL;
+		}
+	}
+
+	if (FAILED(ret))
+	{
+		stop();
+	}
+
+	return ret;
+}
+
+/**
+* @brief Stops the writer thread after it has written every event recorded so far
+*
+* @detailed The queue threads must no longer push events.
+*/
+void fnTrace::stop()
+{
+	if (m_bRunning)
+	{
+		__atomic_store_n(&m_bRunning, false, __ATOMIC_RELEASE);
+		pthread_join(m_thread, NULL);
+	}
+
+	if (m_pFile != NULL)
+	{
+		fclose(m_pFile);
+		m_pFile = NULL;
+	}
+
+	for (unsigned int n = 0; n < m_rings.size(); n++)
+	{
+		delete m_rings[n];
+	}
+
+	m_rings.clear();
+	m_reported.clear();
+}
+
+/**
+* @brief Returns the ring of a queue thread
+*
+* @param n [IN] Index of the queue thread
+*
+* @return The ring, NULL if tracing is off
+*/
+fnTraceRing* fnTrace::getRing(unsigned int n)
+{
+	return (n < m_rings.size()) ? m_rings[n] : NULL;
+}
+
+/**
+* @brief Writer thread entry point
+*
+* @param arg [IN] fnTrace instance
+*/
+void* fnTrace::writerThread(void *arg)
+{
+	((fnTrace*)arg)->run();
+
+	return NULL;
+}
+
+/**
+* @brief Writer loop, drains the rings until stopped and then once more
+*/
+void fnTrace::run()
+{
+	while (__atomic_load_n(&m_bRunning, __ATOMIC_ACQUIRE))
+	{
+		if (drain() == 0)
+		{
+			fflush(m_pFile);
+			usleep(10000);
+		}
+	}
+
+	drain();
+	fflush(m_pFile);
+}
+
+/**
+* @brief Writes out every event currently in the rings, and any new drops
+*
+* @return Number of events written
+*/
+unsigned int fnTrace::drain()
+{
+	unsigned int nWritten = 0;
+	trace_event event;
+
+	for (unsigned int n = 0; n < m_rings.size(); n++)
+	{
+		uint64_t dropped;
+
+		while (m_rings[n]->pop(event))
+		{
+			write(n, event);
+			nWritten++;
+		}
+
+		dropped = m_rings[n]->dropped();
+
+		if (dropped != m_reported[n])
+		{
+			fprintf(m_pFile, "q%u dropped %llu events (%llu in total)\n", n,
+				(unsigned long long)(dropped - m_reported[n]), (unsigned long long)dropped);
+			m_reported[n] = dropped;
+		}
+	}
+
+	return nWritten;
+}
+
+/**
+* @brief Formats one event
+*
+* @param nRing [IN] Index of the queue thread that recorded it
+* @param event [IN] Event
+*/
+void fnTrace::write(unsigned int nRing, const trace_event &event)
+{
+	static const char *s_verdicts[] = { "accept", "drop", "resend" };
+	char src[INET_ADDRSTRLEN];
+	char dest[INET_ADDRSTRLEN];
+	uint32_t addr;
+
+	fprintf(m_pFile, "%llu.%06llu q%u #%u ",
+		(unsigned long long)(event.time / 1000000000ULL),
+		(unsigned long long)(event.time % 1000000000ULL) / 1000, nRing, event.packet);
+
+	switch (event.type)
+	{
+		case TRACE_EVENT_PACKET:
+		case TRACE_EVENT_MAP:
+			addr = htonl(event.tuple.src_ip);
+			inet_ntop(AF_INET, &addr, src, sizeof(src));
+			addr = htonl(event.tuple.dest_ip);
+			inet_ntop(AF_INET, &addr, dest, sizeof(dest));
+
+			fprintf(m_pFile, "%s proto %u %s:%u -> %s:%u if %u\n",
+				(event.type == TRACE_EVENT_PACKET) ? "packet" : "map", event.protocol,
+				src, event.tuple.src_port, dest, event.tuple.dest_port, event.ifindex);
+			break;
+
+		case TRACE_EVENT_STATE:
+			fprintf(m_pFile, "state %s\n", fnCore::getStateName((CORE_PCL_STATES)event.value));
+			break;
+
+		case TRACE_EVENT_VERDICT:
+			fprintf(m_pFile, "verdict %s\n",
+				(event.value <= TRACE_VERDICT_RESEND) ? s_verdicts[event.value] : "?");
+			break;
+
+		default:
+			fprintf(m_pFile, "unknown event %u\n", event.type);
+			break;
+	}
+}
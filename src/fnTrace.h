@@ -0,0 +1,136 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+
+#ifndef FN_FNTRACE_H // one-time include
+#define FN_FNTRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <string>
+#include <vector>
+
+#include "fn_error.h"
+#include "structures.h"
+
+#define FN_TRACE_RING_SIZE 65536	///< events buffered per queue, a power of two
+
+typedef enum _TRACE_EVENT_TYPE
+{
+	TRACE_EVENT_PACKET,	///< packet received, original tuple
+	TRACE_EVENT_STATE,	///< state machine entered value (a CORE_PCL_STATES)
+	TRACE_EVENT_MAP,	///< map applied, translated tuple
+	TRACE_EVENT_VERDICT,	///< verdict value (a TRACE_VERDICT)
+} TRACE_EVENT_TYPE;
+
+typedef enum _TRACE_VERDICT
+{
+	TRACE_VERDICT_ACCEPT,
+	TRACE_VERDICT_DROP,
+	TRACE_VERDICT_RESEND,	///< sent from user space, original dropped
+} TRACE_VERDICT;
+
+/**
+* One trace record.  Only raw values are stored; formatting happens on the writer thread.
+*/
+typedef struct _trace_event
+{
+	uint64_t	time;		///< CLOCK_MONOTONIC nanoseconds
+	uint32_t	packet;		///< netfilter packet id
+	uint8_t		type;		///< TRACE_EVENT_TYPE
+	uint8_t		value;		///< state or verdict
+	uint8_t		protocol;
+	uint8_t		reserved;
+	udp_packet_tuple	tuple;	///< addresses and ports, host byte order
+	uint32_t	ifindex;	///< receiving interface of a TRACE_EVENT_PACKET, egress of a TRACE_EVENT_MAP
+} trace_event;
+
+static_assert(sizeof(trace_event) == 32, "trace_event should stay at half a cache line");
+
+/**
+* Single producer, single consumer ring of trace events.  The queue thread pushes and the
+* writer thread pops; neither ever waits for the other.  A push into a full ring is
+* counted as dropped and discarded.
+*/
+class fnTraceRing
+{
+	public:
+		fnTraceRing(unsigned int nSize = FN_TRACE_RING_SIZE);
+		~fnTraceRing();
+
+		bool push(const trace_event &event);
+		bool pop(trace_event &event);
+		uint64_t dropped() const;
+
+	private:
+		trace_event*	m_pEvents;
+		uint32_t		m_nMask;
+
+		// producer and consumer indexes on their own cache lines, each written by one thread
+		volatile uint32_t	m_nHead __attribute__((aligned(64)));	///< next slot pushed
+		volatile uint64_t	m_nDropped;
+		volatile uint32_t	m_nTail __attribute__((aligned(64)));	///< next slot popped
+};
+
+/**
+* Writes the events of every queue's ring to the --trace_file from a background thread.
+*/
+class fnTrace
+{
+	public:
+		static fnTrace* getInstance();
+		~fnTrace();
+
+		FN_STATUS start(const std::string &strPath, unsigned int nRings);
+		void stop();
+
+		fnTraceRing* getRing(unsigned int n);
+
+		static inline uint64_t now()
+		{
+			struct timespec ts;
+
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		}
+
+	protected:
+		fnTrace(); ///< Protected constructor prevents creation of object my non-members
+		static fnTrace* s_Instance; ///< The singleton instance
+
+		static void* writerThread(void *arg);
+		void run();
+		unsigned int drain();
+		void write(unsigned int nRing, const trace_event &event);
+
+	private:
+		FILE*	m_pFile;
+		std::vector<fnTraceRing*>	m_rings;
+		std::vector<uint64_t>	m_reported;	///< dropped counts already written, per ring
+		pthread_t	m_thread;
+		volatile bool	m_bRunning;
+};
+
+#endif
@@ -0,0 +1,223 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+/**
+* @file fnTransmit.cpp
+* @author Jeremy Beker
+* @version
+*
+* @overview Raw socket transmit path for rewritten packets
+*/
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "fnLog.h"
+#include "fnTransmit.h"
+
+// Ensure that the singleton instance always starts out as NULL.
+fnTransmit* fnTransmit::s_Instance = NULL;
+
+/**
+* @brief Constructor for fnTransmit class
+*/
+fnTransmit::fnTransmit()
+{
+	m_nSockets = 0;
+	pthread_mutex_init(&m_lock, NULL);
+}
+
+/**
+* @brief Destructor for fnTransmit class
+*
+* @detailed Closes every socket that was opened
+*/
+fnTransmit::~fnTransmit()
+{
+	for (unsigned int n = 0; n < m_nSockets; n++)
+	{
+		close(m_sockets[n].fd);
+	}
+
+	pthread_mutex_destroy(&m_lock);
+}
+
+/**
+* @brief The getInstance function provides access to the singleton instance of the class
+*
+* @detailed This class is defined as a singleton so there is exactly one instance of the class throughout the calling program.  This class
+*           should never be created by the calling program through new.  It should only be accessed by the getInstance method to get
+*           a pointer to the singleton instance.
+*
+* @post
+* - A non-null pointer to the singleton instance is returned
+*
+* @return A non-null pointer to the singleton instance
+*/
+fnTransmit* fnTransmit::getInstance()
+{
+	if ( s_Instance == NULL )
+	{
+		s_Instance = new fnTransmit();
+	}
+
+	return s_Instance;
+}
+
+/**
+* @brief Opens a raw socket bound to an interface
+*
+* @detailed IPPROTO_RAW sockets take the IP header from the buffer (IP_HDRINCL is
+*			implied), so the packet goes out exactly as it was rewritten.
+*
+* @param ifindex [IN] Interface index
+*
+* @return The socket, or -1 on failure
+*/
+int fnTransmit::openSocket(uint32_t ifindex)
+{
+	int fd = -1;
+	char ifname[IF_NAMESIZE];
+
+	if (if_indextoname(ifindex, ifname) == NULL)
+	{
+		FN_ERROR("Unknown outbound interface %u\n", ifindex);
+	}
+	else
+	{
+		fd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+
+		if (fd < 0)
+		{
+			FN_ERROR("fnTransmit: socket: %s\n", strerror(errno));
+		}
+		else if (setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, ifname, strlen(ifname) + 1) < 0)
+		{
+			FN_ERROR("fnTransmit: SO_BINDTODEVICE: %s\n", strerror(errno));
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	return fd;
+}
+
+/**
+* @brief Returns the socket for an interface, opening it on first use
+*
+* @detailed Published entries never change, so the common case is a scan of a few
+*			entries without locking.  Only a miss takes the lock, re-checks and opens.
+*
+* @param ifindex [IN] Interface index
+*
+* @return The socket, or -1 if none could be opened
+*/
+int fnTransmit::getSocket(uint32_t ifindex)
+{
+	int fd = -1;
+	unsigned int count = __atomic_load_n(&m_nSockets, __ATOMIC_ACQUIRE);
+
+	for (unsigned int n = 0; n < count && fd < 0; n++)
+	{
+		if (m_sockets[n].ifindex == ifindex)
+		{
+			fd = m_sockets[n].fd;
+		}
+	}
+
+	if (fd < 0)
+	{
+		pthread_mutex_lock(&m_lock);
+
+		for (unsigned int n = 0; n < m_nSockets && fd < 0; n++)
+		{
+			if (m_sockets[n].ifindex == ifindex)
+			{
+				fd = m_sockets[n].fd;
+			}
+		}
+
+		if (fd < 0 && m_nSockets < FN_TX_MAX_INTERFACES)
+		{
+			fd = openSocket(ifindex);
+
+			if (fd >= 0)
+			{
+				m_sockets[m_nSockets].ifindex = ifindex;
+				m_sockets[m_nSockets].fd = fd;
+				__atomic_store_n(&m_nSockets, m_nSockets + 1, __ATOMIC_RELEASE);
+			}
+		}
+		else if (fd < 0)
+		{
+			FN_ERROR("fnTransmit: too many outbound interfaces\n");
+		}
+
+		pthread_mutex_unlock(&m_lock);
+	}
+
+	return fd;
+}
+
+/**
+* @brief Sends a complete IPv4 packet out of an interface
+*
+* @param ifindex [IN] Egress interface index
+* @param pData [IN] Packet, starting with its IP header
+* @param nLength [IN] Length of the packet
+*
+* @return Status of packet send.
+*
+* @retval FN_E_FAIL Packet not sent
+* @retval FN_S_OK Packet sent
+*/
+FN_STATUS fnTransmit::send(uint32_t ifindex, const unsigned char *pData, int nLength)
+{
+	FN_STATUS ret = FN_E_FAIL;
+	int fd = getSocket(ifindex);
+
+	if (fd >= 0 && nLength >= 20)
+	{
+		struct sockaddr_in dest;
+
+		memset(&dest, 0, sizeof(dest));
+		dest.sin_family = AF_INET;
+		memcpy(&dest.sin_addr.s_addr, pData + 16, sizeof(dest.sin_addr.s_addr));	// IP destination
+
+		if (sendto(fd, pData, nLength, 0, (struct sockaddr*)&dest, sizeof(dest)) == nLength)
+		{
+			ret = FN_S_OK;
+		}
+		else
+		{
+			FN_ERROR("fnTransmit: sendto: %s\n", strerror(errno));
+		}
+	}
+
+	return ret;
+}
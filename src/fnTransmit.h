@@ -0,0 +1,65 @@
+/*
+
+flexNES - Flexible NAT Emulation Software
+
+Copyright (C) 2008, Jeremy Beker <gothmog@confusticate.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#ifndef FN_FNTRANSMIT_H // one-time include
+#define FN_FNTRANSMIT_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "fn_error.h"
+
+#define FN_TX_MAX_INTERFACES 16	///< distinct egress interfaces a socket is kept for
+
+typedef struct _tx_socket
+{
+	uint32_t	ifindex;
+	int		fd;
+} tx_socket;
+
+/**
+* Sends finished IPv4 packets.  One raw socket is opened per egress interface the
+* first time a packet leaves through it and is reused for every later packet, so
+* a send is a single sendto of the buffer as it is, header included.
+*/
+class fnTransmit
+{
+	public:
+		static fnTransmit* getInstance();
+		~fnTransmit();
+
+		FN_STATUS send(uint32_t ifindex, const unsigned char *pData, int nLength);
+
+	protected:
+		fnTransmit(); ///< Protected constructor prevents creation of object my non-members
+		static fnTransmit* s_Instance; ///< The singleton instance
+
+		int getSocket(uint32_t ifindex);
+		int openSocket(uint32_t ifindex);
+
+	private:
+		pthread_mutex_t	m_lock;	///< Serializes opening sockets, lookups take no lock
+		tx_socket	m_sockets[FN_TX_MAX_INTERFACES];
+		volatile unsigned int	m_nSockets;	///< entries of m_sockets published to readers
+};
+
+#endif
@@ -45,6 +45,7 @@ typedef int32_t FN_STATUS;
 #define FN_FAC_CONFIG 1
 #define FN_FAC_PACKET 2
 #define FN_FAC_STATE 3
+#define FN_FAC_CAPTURE 4
 
 
 /****************************************
@@ -60,8 +61,14 @@ typedef int32_t FN_STATUS;
 #define FN_S_HELP_REQUESTED MAKE_FN_STATUS( FN_SUCCESS, FN_FAC_CONFIG, 2 ) ///< User requested help screen
 
 #define FN_E_INVALID_PROTOCOL MAKE_FN_STATUS( FN_FAILURE, FN_FAC_PACKET, 1 ) ///< Packet/Protocol mismatch
+#define FN_E_PACKET_TRUNCATED MAKE_FN_STATUS( FN_FAILURE, FN_FAC_PACKET, 2 ) ///< Packet too short for the headers it claims
 
 #define FN_E_NO_MAP_FOUND MAKE_FN_STATUS( FN_FAILURE, FN_FAC_STATE, 1 ) ///< No NAT map found
+#define FN_E_NO_PORT_AVAILABLE MAKE_FN_STATUS( FN_FAILURE, FN_FAC_STATE, 2 ) ///< External port pool exhausted
+#define FN_E_MAP_TABLE_FULL MAKE_FN_STATUS( FN_FAILURE, FN_FAC_STATE, 3 ) ///< Maximum number of maps reached
+
+#define FN_S_END_OF_CAPTURE MAKE_FN_STATUS( FN_SUCCESS, FN_FAC_CAPTURE, 1 ) ///< No more packets in the capture file
+#define FN_E_INVALID_CAPTURE MAKE_FN_STATUS( FN_FAILURE, FN_FAC_CAPTURE, 2 ) ///< Capture file unreadable or of an unknown format
 
 
 #endif
@@ -23,21 +23,23 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #ifndef FN_STRUCTURES_H // one-time include
 #define FN_STRUCTURES_H
 
-#include <string>
+#include <stdint.h>
+
+// Tuples keep their 32 bit fields first so they carry no padding
 
 typedef struct _udp_packet_tuple
 {
 	uint32_t	src_ip;
-	uint16_t	src_port;
 	uint32_t	dest_ip;
+	uint16_t	src_port;
 	uint16_t	dest_port;
 } udp_packet_tuple;
 
 typedef struct _tcp_packet_tuple
 {
 	uint32_t	src_ip;
-	uint16_t	src_port;
 	uint32_t	dest_ip;
+	uint16_t	src_port;
 	uint16_t	dest_port;
 } tcp_packet_tuple;
 
@@ -45,18 +47,18 @@ typedef struct _icmp_packet_tuple
 {
 	uint32_t	src_ip;
 	uint32_t	dest_ip;
+	uint16_t	id;			///< query identifier, 0 for other messages
+	uint16_t	reserved;
 } icmp_packet_tuple;
 
 
-
-typedef struct _nat_map_entry
+/**
+* A NAT map.  Laid out to fill exactly one 64 byte cache line: interfaces are kept as
+* kernel interface indexes and times as 32 bit seconds.  Aligned so that no entry
+* straddles two lines.
+*/
+typedef struct alignas(64) _nat_map_entry
 {
-//	char		entry_id[64];
-	std::string		in_interface;
-	std::string		out_interface;
-	uint16_t	protocol;
-	time_t		activity;
-	
 	union
 	{
 		udp_packet_tuple inside_udp;
@@ -71,8 +73,43 @@ typedef struct _nat_map_entry
 		icmp_packet_tuple outside_icmp;
 	};
 	
-	// expiration timestamp
+	struct _nat_map_entry*	inbound_next;	///< next map sharing the same external endpoint
+	
+	struct _nat_map_entry*	timer_next;		///< next map in the same timer wheel slot
+	struct _nat_map_entry**	timer_pprev;	///< link pointing at this map, NULL when not scheduled
+	uint32_t	timer_expires;	///< time the map is next checked for expiry
+	
+	uint32_t	activity;		///< time of last use
+	uint16_t	in_ifindex;
+	uint16_t	out_ifindex;
+	uint8_t		protocol;
+	uint8_t		tcp_state;		///< TCP_STATE of a TCP map
+	uint8_t		tcp_fin;		///< TCP_FIN_* directions a FIN was seen in
+	uint8_t		reserved;
 } nat_map_entry;
 
+/**
+* Result of a map lookup: a handle to the stored map plus the tuple this particular
+* packet is rewritten to.  The handle is only valid until the state tables are next
+* modified; the rest is a copy owned by the caller.
+*/
+typedef struct _nat_map_view
+{
+	const nat_map_entry*	entry;
+	uint32_t	out_ifindex;	///< interface the rewritten packet leaves on
+	
+	union
+	{
+		udp_packet_tuple udp;
+		tcp_packet_tuple tcp;
+		icmp_packet_tuple icmp;
+	};
+} nat_map_view;
+
+static_assert(sizeof(udp_packet_tuple) == 12, "udp_packet_tuple must not be padded");
+static_assert(sizeof(tcp_packet_tuple) == 12, "tcp_packet_tuple must not be padded");
+static_assert(sizeof(icmp_packet_tuple) == 12, "icmp_packet_tuple must not be padded");
+static_assert(sizeof(nat_map_entry) == 64, "nat_map_entry must fill exactly one cache line");
+
 
 #endif